@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <string>
+#include <filesystem>
+
+#include "benchmark.h"
+#include "render.h"
+#include "mixer.h"
+#include "conversions.h"
+#include "sample_cache.h"
+#include "wave_importer.h"
+
+/*
+ * Times the stages of rendering on synthetic workloads, then exports songs end to end. Every
+ * measurement is printed as a line of JSON, see benchmark::report.
+ *
+ * Usage: WavyBench [SONG...], where the songs default to examples/vogel_im_kafig.yaml.
+*/
+
+namespace {
+	constexpr int SAMPLE_RATE = 48000;
+	constexpr int RUNS = 5;
+
+	// The seconds each voice plays for, and that each stream lasts.
+	constexpr double VOICE_SECONDS = 2.0;
+	constexpr double STREAM_SECONDS = 10.0;
+
+	struct WaveCase {
+		char const* name;
+		InstrumentSourceWave wave;
+	};
+
+	constexpr WaveCase WAVES[] = {
+		{ "sine", InstrumentSourceWave::Sine },
+		{ "triangle", InstrumentSourceWave::Triangle },
+		{ "square", InstrumentSourceWave::Square },
+		{ "saw", InstrumentSourceWave::Saw },
+		{ "piano", InstrumentSourceWave::Piano },
+		{ "violin", InstrumentSourceWave::Violin },
+	};
+
+	/*
+	 * @brief Creates voices playing a chromatic run up from C3, lasting VOICE_SECONDS each.
+	*/
+	std::vector<render::SourcePtr> create_voices(InstrumentSourceWave wave, int count) {
+		// 240 bpm makes a beat a quarter of a second.
+		constexpr int BPM = 240;
+		auto resolution = Music::get_resolution_per_beat();
+		Instrument instrument("bench", wave, Adsr(0.01, 0.1, 0.8, 0.2));
+
+		std::vector<render::SourcePtr> voices;
+		voices.reserve(count);
+		for (int i = 0; i < count; ++i) {
+			auto note_idx = i % 48;
+			Note note((Letter)(note_idx % 12), (uint8_t)(3 + note_idx / 12));
+			NoteEvent event(note, 0, (int)(VOICE_SECONDS * 4 * resolution));
+
+			// Built-in waves have no sample to play.
+			voices.push_back(*render::create_source_from_note_event(event, instrument, 1.0 / count, resolution, BPM, nullptr));
+		}
+
+		return voices;
+	}
+
+	/*
+	 * @brief Creates a stereo sample of a chord, as a stand in for a sample loaded from disk.
+	*/
+	std::shared_ptr<SampleData const> create_sample_data(int sample_rate, double seconds) {
+		auto data = std::make_shared<SampleData>();
+		data->channel_count = 2;
+		data->sample_rate = sample_rate;
+		data->samples.resize((size_t)(seconds * sample_rate) * 2);
+
+		for (size_t i = 0; i < data->samples.size() / 2; ++i) {
+			auto t = (double)i / sample_rate;
+			auto value = 0.3 * sin(2.0 * M_PI * 261.63 * t) + 0.3 * sin(2.0 * M_PI * 329.63 * t) + 0.3 * sin(2.0 * M_PI * 392.0 * t);
+			data->samples[2 * i] = (float)value;
+			data->samples[2 * i + 1] = (float)-value;
+		}
+
+		return data;
+	}
+
+	/*
+	 * @brief Renders a source to its end, a block at a time as the mixer does.
+	 * @return The number of frames rendered.
+	*/
+	uint64_t drain(Source& source, std::vector<float>& block) {
+		auto frames = (int)(block.size() / source.channel_count());
+		uint64_t total = 0;
+		while (true) {
+			auto produced = source.fill(block.data(), frames);
+			total += produced;
+
+			if (produced < frames) {
+				return total;
+			}
+		}
+	}
+
+	/*
+	 * @brief Runs a workload RUNS times, creating what it renders outside of the timing.
+	 * @param setup Returns what run needs, which is created again for each run.
+	 * @param run Returns the number of frames produced.
+	*/
+	template<class Setup, class Run>
+	void measure(std::string name, int channel_count, int sample_rate, Setup&& setup, Run&& run) {
+		benchmark::Measurement measurement{ std::move(name), 0, channel_count, sample_rate, RUNS, std::chrono::nanoseconds::max() };
+
+		for (int i = 0; i < RUNS; ++i) {
+			auto state = setup();
+			auto elapsed = benchmark::time([&]() {
+				measurement.frames = run(state);
+			});
+			measurement.elapsed = std::min(measurement.elapsed, elapsed);
+		}
+
+		benchmark::report(measurement);
+	}
+
+	/*
+	 * @brief Renders voices of every built-in wave playing at once, a block of each in turn.
+	 * Frames are counted for every voice, so the realtime factor is how many voices could play
+	 * in real time.
+	*/
+	void bench_voices() {
+		constexpr int VOICE_COUNTS[] = { 1, 64 };
+		std::vector<float> block(render::BLOCK_FRAMES);
+
+		for (auto& wave : WAVES) {
+			for (auto count : VOICE_COUNTS) {
+				auto name = std::string("voices/") + wave.name + "/" + std::to_string(count);
+				measure(name, 1, SAMPLE_RATE, [&]() {
+					return create_voices(wave.wave, count);
+				}, [&](std::vector<render::SourcePtr>& voices) {
+					uint64_t frames = 0;
+					bool is_playing = true;
+					while (is_playing) {
+						is_playing = false;
+						for (auto& voice : voices) {
+							auto produced = voice->fill(block.data(), render::BLOCK_FRAMES);
+							frames += produced;
+							is_playing |= produced == render::BLOCK_FRAMES;
+						}
+					}
+					return frames;
+				});
+			}
+		}
+	}
+
+	/*
+	 * @brief Decodes wave files of each supported format, reading them from disk.
+	*/
+	void bench_decode() {
+		struct Format {
+			char const* name;
+			int bits_per_sample;
+			int16_t format_type;
+		};
+
+		constexpr Format FORMATS[] = {
+			{ "pcm16", 16, wave::FORMAT_PCM },
+			{ "pcm24", 24, wave::FORMAT_PCM },
+			{ "pcm32", 32, wave::FORMAT_PCM },
+			{ "float", 32, wave::FORMAT_FLOAT },
+		};
+
+		auto data = create_sample_data(SAMPLE_RATE, STREAM_SECONDS);
+		std::vector<float> block(render::BLOCK_FRAMES * data->channel_count);
+
+		for (auto& format : FORMATS) {
+			auto path = std::filesystem::temp_directory_path() / (std::string("wavy_bench_") + format.name + ".wav");
+			{
+				auto writer = wave::WaveWriter::create(path.string(), data->sample_rate, data->channel_count, format.bits_per_sample, format.format_type);
+				if (!writer) {
+					fprintf(stderr, "[ERROR] Could not create '%s'\n", path.string().c_str());
+					continue;
+				}
+				writer->write(data->samples.data(), (int)data->samples.size());
+			}
+
+			// Opening the file is part of what is timed, as it is for every stem read back.
+			measure(std::string("decode/") + format.name, data->channel_count, data->sample_rate, []() {
+				return 0;
+			}, [&](int) {
+				auto file = WaveFile::read(path.string());
+				return file ? drain(*file, block) : 0;
+			});
+
+			std::error_code ec;
+			std::filesystem::remove(path, ec);
+		}
+	}
+
+	/*
+	 * @brief Converts a 44.1k sample to 48k at every quality.
+	*/
+	void bench_resample() {
+		struct Quality {
+			char const* name;
+			ResampleQuality quality;
+		};
+
+		constexpr Quality QUALITIES[] = {
+			{ "fast", ResampleQuality::Fast },
+			{ "balanced", ResampleQuality::Balanced },
+			{ "best", ResampleQuality::Best },
+		};
+
+		auto data = create_sample_data(44100, STREAM_SECONDS);
+		std::vector<float> block(render::BLOCK_FRAMES * data->channel_count);
+
+		for (auto& quality : QUALITIES) {
+			measure(std::string("resample/44100-48000/") + quality.name, data->channel_count, SAMPLE_RATE, [&]() {
+				return std::make_unique<SampleRateConverter>(std::make_unique<SamplePlayer>(data), SAMPLE_RATE, quality.quality);
+			}, [&](std::unique_ptr<SampleRateConverter>& converter) {
+				return drain(*converter, block);
+			});
+		}
+	}
+
+	/*
+	 * @brief Mixes sine voices into stereo, every voice starting on the first frame.
+	*/
+	void bench_mixer() {
+		constexpr int SOURCE_COUNTS[] = { 1, 64, 512 };
+		constexpr int CHANNEL_COUNT = 2;
+		std::vector<float> block(render::BLOCK_FRAMES * CHANNEL_COUNT);
+
+		for (auto count : SOURCE_COUNTS) {
+			using MixerPair = std::tuple<std::unique_ptr<Mixer>, std::shared_ptr<MixerController>>;
+			measure("mixer/" + std::to_string(count), CHANNEL_COUNT, SAMPLE_RATE, [&]() {
+				auto mixer = Mixer::create_mixer(CHANNEL_COUNT, SAMPLE_RATE);
+				for (auto& voice : create_voices(InstrumentSourceWave::Sine, count)) {
+					std::get<1>(mixer)->add(std::move(voice));
+				}
+				return mixer;
+			}, [&](MixerPair& mixer) {
+				// Runs until the last source ends, as the mixer then renders fewer frames than asked.
+				uint64_t frames = 0;
+				while (true) {
+					auto produced = std::get<0>(mixer)->fill(block.data(), render::BLOCK_FRAMES);
+					frames += produced;
+
+					if (produced < render::BLOCK_FRAMES) {
+						return frames;
+					}
+				}
+			});
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	bench_voices();
+	bench_decode();
+	bench_resample();
+	bench_mixer();
+
+	std::vector<std::filesystem::path> songs;
+	for (int i = 1; i < argc; ++i) {
+		songs.emplace_back(argv[i]);
+	}
+
+	if (songs.empty()) {
+		songs.emplace_back("examples/vogel_im_kafig.yaml");
+	}
+
+	benchmark::SongOptions options{ (int)std::max(1u, std::thread::hardware_concurrency()), false, RUNS };
+	for (auto& song : songs) {
+		if (!benchmark::run_song(song, options)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -9,6 +9,26 @@ workspace "Wavy"
 
 	defines { "_CRT_SECURE_NO_WARNINGS" }
 
+	filter "system:windows"
+		-- MMCSS, for the audio thread's priority
+		links { "avrt" }
+
+	filter "system:linux"
+		links { "asound", "pthread" }
+
+	filter "system:macosx"
+		links { "AudioToolbox.framework", "CoreAudio.framework", "CoreFoundation.framework" }
+
+	filter "configurations:debug*"
+		symbols "On"
+		optimize "Off"
+
+	filter "configurations:release*"
+		symbols "Off"
+		optimize "Full"
+
+	filter {}
+
 	project "Wavy"
 
 		files {
@@ -16,10 +36,16 @@ workspace "Wavy"
 			"src/**.cpp"
 		}
 
-		filter "configurations:debug*"
-			symbols "On"
-			optimize "Off"
+	-- Times rendering on synthetic workloads and example songs, see bench/main.cpp
+	project "WavyBench"
+
+		files {
+			"src/**.h",
+			"src/**.cpp",
+			"bench/**.cpp"
+		}
+
+		-- Has its own entry point
+		removefiles { "src/main.cpp" }
 
-		filter "configurations:release*"
-			symbols "Off"
-			optimize "Full"
\ No newline at end of file
+		includedirs { "src" }
@@ -1,12 +1,19 @@
 #include "audio.h"
 
-#ifdef _WIN32
+#include "audio_null.h"
+
+#if defined(_WIN32)
 	#include "audio_wasapi.h"
+#elif defined(__APPLE__)
+	#include "audio_coreaudio.h"
+#elif defined(__linux__)
+	#include "audio_alsa.h"
 #endif
 
 namespace audio {
 	Device::Device(std::unique_ptr<HostDevice> host)
 		: _host(std::move(host))
+		, _callback_timing(std::make_unique<metrics::TimingHistogram>())
 	{}
 
 	std::string_view Device::name() const {
@@ -33,8 +40,20 @@ namespace audio {
 		return _host->get_sample_rate();
 	}
 
-	bool Device::open(int desired_sample_rate) {
-		return _host->open(desired_sample_rate);
+	std::chrono::microseconds Device::latency() const {
+		return _host->get_latency();
+	}
+
+	DeviceMetrics Device::metrics() const {
+		return DeviceMetrics{ _callback_timing->snapshot(), _host->get_underrun_count() };
+	}
+
+	bool Device::has_failed() const {
+		return _host->has_failed();
+	}
+
+	bool Device::open(int desired_sample_rate, DeviceOptions const& options) {
+		return _host->open(desired_sample_rate, options);
 	}
 
 	void Device::close() {
@@ -42,7 +61,18 @@ namespace audio {
 	}
 
 	void Device::start(AudioCallback callback) {
-		_host->start(std::move(callback));
+		auto timing = _callback_timing.get();
+		auto sample_rate = _host->get_sample_rate();
+
+		_host->start([callback = std::move(callback), timing, sample_rate](float* data, int channel_count, int sample_count) {
+			auto start = std::chrono::steady_clock::now();
+			callback(data, channel_count, sample_count);
+			auto elapsed = std::chrono::steady_clock::now() - start;
+
+			// The callback has as long as the audio it renders lasts.
+			auto budget = std::chrono::nanoseconds((int64_t)sample_count * 1000000000 / sample_rate);
+			timing->record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed), budget);
+		});
 	}
 
 	void Device::stop() {
@@ -50,8 +80,26 @@ namespace audio {
 	}
 
 
+	static std::unique_ptr<HostInstance> create_native_instance() {
+#if defined(_WIN32)
+		return std::make_unique<WasapiInstance>();
+#elif defined(__APPLE__)
+		return std::make_unique<CoreAudioInstance>();
+#elif defined(__linux__)
+		return std::make_unique<AlsaInstance>();
+#else
+		fprintf(stdout, "No audio backend for this platform, defaulting to the null device\n");
+		return std::make_unique<NullInstance>(NullDeviceOptions{});
+#endif
+	}
+
 	Instance::Instance()
-		: _instance(new WasapiInstance())
+		: _instance(create_native_instance())
+	{
+	}
+
+	Instance::Instance(NullDeviceOptions options)
+		: _instance(std::make_unique<NullInstance>(std::move(options)))
 	{
 	}
 
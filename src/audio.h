@@ -1,15 +1,20 @@
 #pragma once
 
 #include <memory>
+#include <string>
 #include <string_view>
 #include <array>
 #include <vector>
 #include <functional>
 #include <optional>
+#include <chrono>
 
-// There's no plan to make this cross-platform so these interfaces and abstraction
-// are unnecesary. However, I don't want to pollute the global namespace with crappy,
-// bloated win32 headers so yeah.
+#include "metrics.h"
+
+// Each platform's backend implements HostInstance and HostDevice in its own header, which only
+// audio.cpp includes, so none of their system headers leak into the rest of the program:
+// WASAPI on Windows, ALSA on Linux (which PipeWire and PulseAudio serve through their ALSA
+// plugins) and CoreAudio on macOS. The null device runs anywhere, see NullDeviceOptions.
 
 namespace audio {
 	class Instance;
@@ -22,6 +27,35 @@ namespace audio {
 		return { 8000, 9600, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000, 88200, 96000, 192000 };
 	}
 	
+	struct DeviceOptions {
+		// Takes the device for this program alone, bypassing the system mixer for lower latency.
+		bool exclusive = false;
+
+		// The requested time between callbacks. The device's default period is used when none,
+		// and it is raised to the device's minimum period if lower.
+		std::optional<std::chrono::microseconds> period;
+	};
+
+	/*
+	 * A device that plays to nothing, calling back from its own thread the way a sound card
+	 * would, so playback can be soaked and timed on machines without one.
+	*/
+	struct NullDeviceOptions {
+		// How many times faster than real time audio is called back for.
+		double speed = 1.0;
+
+		// A wave file that everything played is written to. Discarded when none.
+		std::optional<std::string> capture_path;
+	};
+
+	struct DeviceMetrics {
+		// How long each callback took against the time the audio it rendered lasts.
+		metrics::TimingSnapshot callbacks;
+
+		// How many times the device ran out of audio to play. See HostDevice::get_underrun_count.
+		uint64_t underrun_count;
+	};
+
 	class HostDevice {
 	public:
 
@@ -33,7 +67,21 @@ namespace audio {
 		virtual std::vector<int> const& get_available_sample_rates() const = 0;
 		virtual int get_sample_rate() const = 0;
 		virtual int get_channel_count() const = 0;
-		virtual bool open(int desired_sample_rate) = 0;
+		virtual std::chrono::microseconds get_latency() const = 0;
+
+		/*
+		 * @brief The number of times the device found nothing left to play since it was opened.
+		 * Backends that can't tell report 0, where overrunning callbacks are the only sign.
+		*/
+		virtual uint64_t get_underrun_count() const = 0;
+
+		/*
+		 * @brief Whether playback stopped on its own because the device failed, after which it
+		 * no longer calls back. Backends that recover from every error report false.
+		*/
+		virtual bool has_failed() const { return false; }
+
+		virtual bool open(int desired_sample_rate, DeviceOptions const& options) = 0;
 		virtual void close() = 0;
 		virtual void start(AudioCallback callback) = 0;
 		virtual void stop() = 0;
@@ -58,8 +106,16 @@ namespace audio {
 	class Instance {
 	public:
 
+		/*
+		 * @brief Plays back through the platform's audio backend.
+		*/
 		Instance();
 
+		/*
+		 * @brief Plays back through the null device instead of any hardware.
+		*/
+		explicit Instance(NullDeviceOptions options);
+
 		std::optional<Device> get_default_output_device() const;
 
 	private:
@@ -78,14 +134,38 @@ namespace audio {
 		int sample_rate() const;
 		uint32_t buffer_size() const;
 		int channel_count() const;
-		bool open(int desired_sample_rate);
+
+		/*
+		 * @brief The time between a sample being rendered and it being heard, as negotiated
+		 * with the device when it was opened.
+		*/
+		std::chrono::microseconds latency() const;
+
+		/*
+		 * @brief Gets how playback has held up so far. Safe to call from any thread while playing.
+		*/
+		DeviceMetrics metrics() const;
+
+		/*
+		 * @brief Whether the device stopped playing because of an error. Safe to call from any thread.
+		*/
+		bool has_failed() const;
+
+		bool open(int desired_sample_rate, DeviceOptions const& options = {});
 		void close();
+
+		/*
+		 * @brief Starts calling back for audio. Each callback is timed, see metrics().
+		*/
 		void start(AudioCallback callback);
 		void stop();
 
 	private:
 
 		std::unique_ptr<HostDevice> _host;
+
+		// Kept apart from the device so it stays put while the device is moved.
+		std::unique_ptr<metrics::TimingHistogram> _callback_timing;
 	};
 
 	class Stream {
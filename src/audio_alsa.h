@@ -0,0 +1,388 @@
+#pragma once
+
+#include "audio.h"
+#include "audio_format.h"
+
+#include <alsa/asoundlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <algorithm>
+
+#include <assert.h>
+
+namespace audio {
+	// Goes through the system's sound server, or its default card when there is none.
+	constexpr char const* ALSA_DEFAULT_DEVICE = "default";
+
+	// The first card, opened directly so nothing else can play on it.
+	constexpr char const* ALSA_EXCLUSIVE_DEVICE = "hw:0,0";
+
+	// The default period when none is requested, and the minimum one.
+	constexpr std::chrono::microseconds ALSA_DEFAULT_PERIOD = std::chrono::microseconds(10000);
+	constexpr std::chrono::microseconds ALSA_MIN_PERIOD = std::chrono::microseconds(1000);
+
+	static inline snd_pcm_format_t get_alsa_format(SampleFormat sample_format) {
+		switch (sample_format) {
+			default:
+			case SampleFormat::Float32:
+				return SND_PCM_FORMAT_FLOAT_LE;
+			case SampleFormat::Int32:
+				return SND_PCM_FORMAT_S32_LE;
+			case SampleFormat::Int24:
+				return SND_PCM_FORMAT_S24_3LE;
+			case SampleFormat::Int16:
+				return SND_PCM_FORMAT_S16_LE;
+		}
+	}
+
+	static std::vector<int> find_available_sample_rates(snd_pcm_t* pcm) {
+		std::vector<int> sample_rates;
+
+		snd_pcm_hw_params_t* params;
+		snd_pcm_hw_params_alloca(&params);
+		if (snd_pcm_hw_params_any(pcm, params) < 0) {
+			return sample_rates;
+		}
+
+		for (int rate : get_standard_sample_rates()) {
+			if (snd_pcm_hw_params_test_rate(pcm, params, (unsigned int)rate, 0) == 0) {
+				sample_rates.push_back(rate);
+			}
+		}
+
+		return sample_rates;
+	}
+
+	/*
+	 * Renders a period at a time on its own thread, each write blocking until the device has
+	 * room for it. PipeWire and PulseAudio are reached through their ALSA plugins, which the
+	 * default device routes to when they run.
+	*/
+	class AlsaOutputDevice : public HostDevice {
+	public:
+
+		/*
+		 * @brief Probes the default device for the rates it takes.
+		 * @return None if there is no device to play on.
+		*/
+		static std::unique_ptr<AlsaOutputDevice> create() {
+			snd_pcm_t* pcm;
+			if (auto err = snd_pcm_open(&pcm, ALSA_DEFAULT_DEVICE, SND_PCM_STREAM_PLAYBACK, 0); err < 0) {
+				fprintf(stderr, "[ERROR] Could not open the default ALSA device: %s\n", snd_strerror(err));
+				return nullptr;
+			}
+
+			auto sample_rates = find_available_sample_rates(pcm);
+			snd_pcm_close(pcm);
+
+			if (sample_rates.empty()) {
+				return nullptr;
+			}
+
+			return std::unique_ptr<AlsaOutputDevice>(new AlsaOutputDevice(std::move(sample_rates)));
+		}
+
+		~AlsaOutputDevice() {
+			if (_pcm) {
+				close();
+			}
+		}
+
+		std::string_view get_name() const override {
+			return _device_name;
+		}
+
+		std::string_view get_id() const override {
+			return _device_id;
+		}
+
+		std::vector<int> const& get_available_sample_rates() const override {
+			return _sample_rates;
+		}
+
+		int get_sample_rate() const override {
+			return _sample_rate;
+		}
+
+		uint32_t get_buffer_size() const override {
+			return _buffer_size;
+		}
+
+		int get_channel_count() const override {
+			return _channels;
+		}
+
+		std::chrono::microseconds get_latency() const override {
+			return _latency;
+		}
+
+		uint64_t get_underrun_count() const override {
+			return _underrun_count.load(std::memory_order_relaxed);
+		}
+
+		bool has_failed() const override {
+			return _has_failed.load(std::memory_order_acquire);
+		}
+
+		bool open(int desired_sample_rate, DeviceOptions const& options) override {
+			// The sound server resamples to its own rate, so only the rates it accepts can be used.
+			// Exclusive mode is checked against the card itself when picking a format.
+			if (!options.exclusive && !std::any_of(_sample_rates.begin(), _sample_rates.end(), [&](int rate) {
+				return rate == desired_sample_rate;
+			})) {
+				return false;
+			}
+
+			auto name = options.exclusive ? ALSA_EXCLUSIVE_DEVICE : ALSA_DEFAULT_DEVICE;
+			if (auto err = snd_pcm_open(&_pcm, name, SND_PCM_STREAM_PLAYBACK, 0); err < 0) {
+				fprintf(stderr, "[ERROR] Could not open the ALSA device '%s': %s\n", name, snd_strerror(err));
+				_pcm = nullptr;
+				return false;
+			}
+
+			auto period = std::max(ALSA_MIN_PERIOD, options.period.value_or(ALSA_DEFAULT_PERIOD));
+			if (auto err = _configure(desired_sample_rate, period); err < 0) {
+				fprintf(stderr, "[ERROR] Could not open device in %s mode: %s\n", options.exclusive ? "exclusive" : "shared", snd_strerror(err));
+				snd_pcm_close(_pcm);
+				_pcm = nullptr;
+				return false;
+			}
+
+			_device_id = name;
+
+			// Rendered as floats first when the device takes another format.
+			_float_buffer.assign((size_t)_period_size * _channels, 0.0f);
+			_device_buffer.assign((size_t)_period_size * _channels * get_bytes_per_sample(_sample_format), 0);
+
+			return true;
+		}
+
+		void close() override {
+			stop();
+
+			snd_pcm_close(_pcm);
+			_pcm = nullptr;
+		}
+
+		void start(AudioCallback callback) override {
+			assert(_pcm);
+
+			if (_is_running.load(std::memory_order_acquire) && !_has_failed.load(std::memory_order_acquire)) {
+				return;
+			}
+
+			// A thread that stopped on its own after a failure is still waiting to be joined.
+			stop();
+
+			_callback = std::move(callback);
+			snd_pcm_prepare(_pcm);
+
+			_has_failed.store(false, std::memory_order_release);
+			_is_running.store(true, std::memory_order_release);
+			_client_thread = std::thread(_task_client_thread, this);
+		}
+
+		void stop() override {
+			// Also joins a thread that already stopped on its own after a failure.
+			if (!_client_thread.joinable()) {
+				return;
+			}
+
+			_is_running.store(false, std::memory_order_release);
+			_client_thread.join();
+
+			snd_pcm_drop(_pcm);
+		}
+
+	private:
+
+		AlsaOutputDevice(std::vector<int> sample_rates)
+			: _device_name("ALSA default device")
+			, _device_id(ALSA_DEFAULT_DEVICE)
+			, _sample_rates(std::move(sample_rates))
+			, _channels(2)
+			, _buffer_size(0)
+			, _period_size(0)
+			, _sample_rate(0)
+			, _sample_format(SampleFormat::Float32)
+			, _latency(0)
+			, _underrun_count(0)
+			, _is_running(false)
+			, _has_failed(false)
+			, _pcm(nullptr)
+		{}
+
+		/*
+		 * @brief Picks the most precise format the device takes, and a buffer of two periods.
+		 * @return A negative error code on failure.
+		*/
+		int _configure(int sample_rate, std::chrono::microseconds period) {
+			snd_pcm_hw_params_t* params;
+			snd_pcm_hw_params_alloca(&params);
+
+			int err;
+			if (err = snd_pcm_hw_params_any(_pcm, params), err < 0) {
+				return err;
+			}
+
+			if (err = snd_pcm_hw_params_set_access(_pcm, params, SND_PCM_ACCESS_RW_INTERLEAVED), err < 0) {
+				return err;
+			}
+
+			constexpr SampleFormat formats[] = {
+				SampleFormat::Float32,
+				SampleFormat::Int32,
+				SampleFormat::Int24,
+				SampleFormat::Int16
+			};
+
+			auto format = std::find_if(std::begin(formats), std::end(formats), [&](SampleFormat sample_format) {
+				return snd_pcm_hw_params_test_format(_pcm, params, get_alsa_format(sample_format)) == 0;
+			});
+			if (format == std::end(formats)) {
+				return -EINVAL;
+			}
+
+			_sample_format = *format;
+			if (err = snd_pcm_hw_params_set_format(_pcm, params, get_alsa_format(_sample_format)), err < 0) {
+				return err;
+			}
+
+			if (err = snd_pcm_hw_params_set_rate(_pcm, params, (unsigned int)sample_rate, 0), err < 0) {
+				return err;
+			}
+
+			unsigned int channels = 2;
+			if (err = snd_pcm_hw_params_set_channels_near(_pcm, params, &channels), err < 0) {
+				return err;
+			}
+
+			auto period_size = (snd_pcm_uframes_t)(period.count() * sample_rate / 1000000);
+			int dir = 0;
+			if (err = snd_pcm_hw_params_set_period_size_near(_pcm, params, &period_size, &dir), err < 0) {
+				return err;
+			}
+
+			// One period plays while the next is rendered.
+			auto buffer_size = period_size * 2;
+			if (err = snd_pcm_hw_params_set_buffer_size_near(_pcm, params, &buffer_size), err < 0) {
+				return err;
+			}
+
+			if (err = snd_pcm_hw_params(_pcm, params), err < 0) {
+				return err;
+			}
+
+			snd_pcm_hw_params_get_period_size(params, &period_size, &dir);
+			snd_pcm_hw_params_get_buffer_size(params, &buffer_size);
+
+			snd_pcm_sw_params_t* sw_params;
+			snd_pcm_sw_params_alloca(&sw_params);
+			snd_pcm_sw_params_current(_pcm, sw_params);
+
+			// Starts once the buffer is full, so the first periods don't run dry right away.
+			snd_pcm_sw_params_set_start_threshold(_pcm, sw_params, buffer_size);
+			snd_pcm_sw_params_set_avail_min(_pcm, sw_params, period_size);
+			if (err = snd_pcm_sw_params(_pcm, sw_params), err < 0) {
+				return err;
+			}
+
+			_channels = (int)channels;
+			_sample_rate = sample_rate;
+			_period_size = (uint32_t)period_size;
+			_buffer_size = (uint32_t)buffer_size;
+			_latency = std::chrono::microseconds((int64_t)((double)_buffer_size / _sample_rate * 1e6));
+
+			return 0;
+		}
+
+		void _process() {
+			auto frames_count = (int)_period_size;
+			void* data = _float_buffer.data();
+
+			_callback(_float_buffer.data(), _channels, frames_count);
+			if (_sample_format != SampleFormat::Float32) {
+				convert_samples(_float_buffer.data(), _device_buffer.data(), frames_count * _channels, _sample_format);
+				data = _device_buffer.data();
+			}
+
+			auto bytes_per_frame = get_bytes_per_sample(_sample_format) * _channels;
+			auto written = 0;
+			while (written < frames_count && _is_running.load(std::memory_order_acquire) && !_has_failed.load(std::memory_order_relaxed)) {
+				auto result = snd_pcm_writei(_pcm, (uint8_t*)data + written * bytes_per_frame, frames_count - written);
+				if (result >= 0) {
+					written += (int)result;
+					continue;
+				}
+
+				// The device played everything it had, what is left is written once it restarts.
+				if (result == -EPIPE) {
+					_underrun_count.store(_underrun_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				}
+
+				if (snd_pcm_recover(_pcm, (int)result, 1) < 0) {
+					fprintf(stderr, "[ERROR] Playback failed: %s\n", snd_strerror((int)result));
+					_has_failed.store(true, std::memory_order_release);
+				}
+			}
+		}
+
+		static void _task_client_thread(AlsaOutputDevice* device) {
+			// Real-time scheduling lets the thread preempt normal work for as long as it keeps up
+			// with audio. It needs the rights to, otherwise it keeps a plain priority.
+			sched_param param{};
+			param.sched_priority = std::max(1, sched_get_priority_max(SCHED_FIFO) / 2);
+			pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+			while (device->_is_running.load(std::memory_order_acquire) && !device->_has_failed.load(std::memory_order_relaxed)) {
+				device->_process();
+			}
+		}
+
+	private:
+
+		std::string _device_name;
+		std::string _device_id;
+		std::vector<int> _sample_rates;
+		int _channels;
+		uint32_t _buffer_size;
+		uint32_t _period_size;	// Frames rendered per callback
+		int _sample_rate;
+		SampleFormat _sample_format;
+		std::chrono::microseconds _latency;
+
+		// Only written from the client thread.
+		std::atomic<uint64_t> _underrun_count;
+
+		// Where the callback renders to, and what it is converted to when the device does not take floats.
+		std::vector<float> _float_buffer;
+		std::vector<uint8_t> _device_buffer;
+
+		std::atomic<bool> _is_running;
+
+		// Set by the client thread when the device can't be recovered, which then stops on its own.
+		std::atomic<bool> _has_failed;
+
+		snd_pcm_t* _pcm;
+
+		std::thread _client_thread;
+
+		AudioCallback _callback;
+	};
+
+	class AlsaInstance : public HostInstance {
+	public:
+
+		std::unique_ptr<HostDevice> get_default_output_device() const override {
+			return AlsaOutputDevice::create();
+		}
+	};
+}
@@ -0,0 +1,395 @@
+#pragma once
+
+#include "audio.h"
+
+#include <AudioToolbox/AudioToolbox.h>
+#include <CoreAudio/CoreAudio.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include <assert.h>
+
+namespace audio {
+	// kAudioObjectPropertyElementMain, which was named kAudioObjectPropertyElementMaster before macOS 12.
+	constexpr AudioObjectPropertyElement COREAUDIO_ELEMENT_MAIN = 0;
+
+	template<class T>
+	static bool get_coreaudio_property(AudioObjectID object, AudioObjectPropertySelector selector, AudioObjectPropertyScope scope, T& value) {
+		AudioObjectPropertyAddress address{ selector, scope, COREAUDIO_ELEMENT_MAIN };
+		UInt32 size = sizeof(T);
+		return AudioObjectGetPropertyData(object, &address, 0, nullptr, &size, &value) == noErr;
+	}
+
+	template<class T>
+	static bool set_coreaudio_property(AudioObjectID object, AudioObjectPropertySelector selector, AudioObjectPropertyScope scope, T const& value) {
+		AudioObjectPropertyAddress address{ selector, scope, COREAUDIO_ELEMENT_MAIN };
+		return AudioObjectSetPropertyData(object, &address, 0, nullptr, sizeof(T), &value) == noErr;
+	}
+
+	static inline std::string get_coreaudio_string(AudioObjectID object, AudioObjectPropertySelector selector) {
+		CFStringRef cf_str = nullptr;
+		if (!get_coreaudio_property(object, selector, kAudioObjectPropertyScopeGlobal, cf_str) || !cf_str) {
+			return {};
+		}
+
+		std::string str;
+		auto size = CFStringGetMaximumSizeForEncoding(CFStringGetLength(cf_str), kCFStringEncodingUTF8) + 1;
+		str.resize((size_t)size);
+		if (CFStringGetCString(cf_str, str.data(), size, kCFStringEncodingUTF8)) {
+			str.resize(strlen(str.c_str()));
+		} else {
+			fprintf(stderr, "Unable to convert CoreAudio string, defaulting to empty");
+			str.clear();
+		}
+
+		CFRelease(cf_str);
+
+		return str;
+	}
+
+	static std::vector<int> find_available_sample_rates(AudioObjectID device) {
+		std::vector<int> sample_rates;
+
+		AudioObjectPropertyAddress address{ kAudioDevicePropertyAvailableNominalSampleRates, kAudioObjectPropertyScopeGlobal, COREAUDIO_ELEMENT_MAIN };
+		UInt32 size = 0;
+		if (AudioObjectGetPropertyDataSize(device, &address, 0, nullptr, &size) != noErr) {
+			return sample_rates;
+		}
+
+		std::vector<AudioValueRange> ranges(size / sizeof(AudioValueRange));
+		if (AudioObjectGetPropertyData(device, &address, 0, nullptr, &size, ranges.data()) != noErr) {
+			return sample_rates;
+		}
+
+		for (int rate : get_standard_sample_rates()) {
+			if (std::any_of(ranges.begin(), ranges.end(), [rate](AudioValueRange const& range) {
+				return rate >= range.mMinimum && rate <= range.mMaximum;
+			})) {
+				sample_rates.push_back(rate);
+			}
+		}
+
+		return sample_rates;
+	}
+
+	static inline int get_output_channel_count(AudioObjectID device) {
+		AudioObjectPropertyAddress address{ kAudioDevicePropertyStreamConfiguration, kAudioObjectPropertyScopeOutput, COREAUDIO_ELEMENT_MAIN };
+		UInt32 size = 0;
+		if (AudioObjectGetPropertyDataSize(device, &address, 0, nullptr, &size) != noErr || size == 0) {
+			return 2;
+		}
+
+		std::vector<uint8_t> storage(size);
+		auto buffers = (AudioBufferList*)storage.data();
+		if (AudioObjectGetPropertyData(device, &address, 0, nullptr, &size, buffers) != noErr) {
+			return 2;
+		}
+
+		int channels = 0;
+		for (UInt32 i = 0; i < buffers->mNumberBuffers; ++i) {
+			channels += (int)buffers->mBuffers[i].mNumberChannels;
+		}
+
+		return channels > 0 ? channels : 2;
+	}
+
+	/*
+	 * Plays through an output unit on the device, which calls back from CoreAudio's own real-time
+	 * thread and converts from the rate rendered at to the device's. Exclusive mode takes the
+	 * device in hog mode and sets its rate, so nothing is converted.
+	*/
+	class CoreAudioOutputDevice : public HostDevice {
+	public:
+
+		CoreAudioOutputDevice(AudioObjectID device)
+			: _device_name(get_coreaudio_string(device, kAudioObjectPropertyName))
+			, _device_id(get_coreaudio_string(device, kAudioDevicePropertyDeviceUID))
+			, _sample_rates(find_available_sample_rates(device))
+			, _channels(get_output_channel_count(device))
+			, _buffer_size(0)
+			, _sample_rate(0)
+			, _latency(0)
+			, _underrun_count(0)
+			, _is_hogging(false)
+			, _is_running(false)
+			, _device(device)
+			, _unit(nullptr)
+		{}
+
+		~CoreAudioOutputDevice() {
+			if (_unit) {
+				close();
+			}
+		}
+
+		std::string_view get_name() const override {
+			return _device_name;
+		}
+
+		std::string_view get_id() const override {
+			return _device_id;
+		}
+
+		std::vector<int> const& get_available_sample_rates() const override {
+			return _sample_rates;
+		}
+
+		int get_sample_rate() const override {
+			return _sample_rate;
+		}
+
+		uint32_t get_buffer_size() const override {
+			return _buffer_size;
+		}
+
+		int get_channel_count() const override {
+			return _channels;
+		}
+
+		std::chrono::microseconds get_latency() const override {
+			return _latency;
+		}
+
+		uint64_t get_underrun_count() const override {
+			return _underrun_count.load(std::memory_order_relaxed);
+		}
+
+		bool open(int desired_sample_rate, DeviceOptions const& options) override {
+			if (!std::any_of(_sample_rates.begin(), _sample_rates.end(), [&](int rate) {
+				return rate == desired_sample_rate;
+			})) {
+				return false;
+			}
+
+			if (options.exclusive && !_hog((Float64)desired_sample_rate)) {
+				fprintf(stderr, "[ERROR] Could not open device in exclusive mode, another program holds it\n");
+				return false;
+			}
+
+			AudioComponentDescription description{};
+			description.componentType = kAudioUnitType_Output;
+			description.componentSubType = kAudioUnitSubType_HALOutput;
+			description.componentManufacturer = kAudioUnitManufacturer_Apple;
+
+			auto component = AudioComponentFindNext(nullptr, &description);
+			if (!component || AudioComponentInstanceNew(component, &_unit) != noErr) {
+				fprintf(stderr, "[ERROR] Could not create the CoreAudio output unit\n");
+				_unhog();
+				_unit = nullptr;
+				return false;
+			}
+
+			if (auto status = _configure(desired_sample_rate, options); status != noErr) {
+				fprintf(stderr, "[ERROR] Could not open device in %s mode, failed with code: %i\n", options.exclusive ? "exclusive" : "shared", (int)status);
+				AudioComponentInstanceDispose(_unit);
+				_unhog();
+				_unit = nullptr;
+				return false;
+			}
+
+			// The device reports a processor overload whenever a cycle wasn't ready in time.
+			AudioObjectPropertyAddress overload{ kAudioDeviceProcessorOverload, kAudioObjectPropertyScopeGlobal, COREAUDIO_ELEMENT_MAIN };
+			AudioObjectAddPropertyListener(_device, &overload, _on_overload, this);
+
+			return true;
+		}
+
+		void close() override {
+			stop();
+
+			AudioObjectPropertyAddress overload{ kAudioDeviceProcessorOverload, kAudioObjectPropertyScopeGlobal, COREAUDIO_ELEMENT_MAIN };
+			AudioObjectRemovePropertyListener(_device, &overload, _on_overload, this);
+
+			AudioUnitUninitialize(_unit);
+			AudioComponentInstanceDispose(_unit);
+			_unit = nullptr;
+
+			_unhog();
+		}
+
+		void start(AudioCallback callback) override {
+			assert(_unit);
+
+			if (_is_running.load(std::memory_order_acquire)) {
+				return;
+			}
+
+			// Only read from the render thread once the unit starts.
+			_callback = std::move(callback);
+			_is_running.store(true, std::memory_order_release);
+
+			AudioOutputUnitStart(_unit);
+		}
+
+		void stop() override {
+			if (!_is_running.load(std::memory_order_acquire)) {
+				return;
+			}
+
+			// Waits for the render thread to be done with the callback.
+			AudioOutputUnitStop(_unit);
+
+			_is_running.store(false, std::memory_order_release);
+		}
+
+	private:
+
+		OSStatus _configure(int sample_rate, DeviceOptions const& options) {
+			OSStatus status;
+
+			// A HAL output unit plays on whichever device it is given, not just the default one.
+			if (status = AudioUnitSetProperty(_unit, kAudioOutputUnitProperty_CurrentDevice, kAudioUnitScope_Global, 0, &_device, sizeof(_device)), status != noErr) {
+				return status;
+			}
+
+			// Rendered as interleaved floats, anything else the device needs is converted by the unit.
+			AudioStreamBasicDescription format{};
+			format.mSampleRate = (Float64)sample_rate;
+			format.mFormatID = kAudioFormatLinearPCM;
+			format.mFormatFlags = kAudioFormatFlagIsFloat | kAudioFormatFlagIsPacked;
+			format.mChannelsPerFrame = (UInt32)_channels;
+			format.mBitsPerChannel = 32;
+			format.mFramesPerPacket = 1;
+			format.mBytesPerFrame = (UInt32)(sizeof(float) * _channels);
+			format.mBytesPerPacket = format.mBytesPerFrame;
+			if (status = AudioUnitSetProperty(_unit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 0, &format, sizeof(format)), status != noErr) {
+				return status;
+			}
+
+			AURenderCallbackStruct render_callback{ _render, this };
+			if (status = AudioUnitSetProperty(_unit, kAudioUnitProperty_SetRenderCallback, kAudioUnitScope_Input, 0, &render_callback, sizeof(render_callback)), status != noErr) {
+				return status;
+			}
+
+			// The buffer size is the period, kept within what the device allows.
+			if (options.period) {
+				AudioValueRange range{};
+				get_coreaudio_property(_device, kAudioDevicePropertyBufferFrameSizeRange, kAudioObjectPropertyScopeGlobal, range);
+
+				auto frames = (double)options.period->count() * sample_rate / 1e6;
+				auto buffer_size = (UInt32)std::clamp(frames, range.mMinimum, std::max(range.mMinimum, range.mMaximum));
+				set_coreaudio_property(_device, kAudioDevicePropertyBufferFrameSize, kAudioObjectPropertyScopeGlobal, buffer_size);
+			}
+
+			if (status = AudioUnitInitialize(_unit), status != noErr) {
+				return status;
+			}
+
+			UInt32 buffer_size = 0;
+			UInt32 device_latency = 0;
+			UInt32 safety_offset = 0;
+			Float64 device_rate = (Float64)sample_rate;
+			get_coreaudio_property(_device, kAudioDevicePropertyBufferFrameSize, kAudioObjectPropertyScopeGlobal, buffer_size);
+			get_coreaudio_property(_device, kAudioDevicePropertyLatency, kAudioObjectPropertyScopeOutput, device_latency);
+			get_coreaudio_property(_device, kAudioDevicePropertySafetyOffset, kAudioObjectPropertyScopeOutput, safety_offset);
+			get_coreaudio_property(_device, kAudioDevicePropertyNominalSampleRate, kAudioObjectPropertyScopeGlobal, device_rate);
+
+			_sample_rate = sample_rate;
+			_buffer_size = buffer_size;
+			_latency = std::chrono::microseconds(
+				(int64_t)((double)(buffer_size + device_latency + safety_offset) / device_rate * 1e6)
+			);
+
+			return noErr;
+		}
+
+		/*
+		 * @brief Takes the device for this process alone, at the given rate.
+		 * @return False if another process holds it.
+		*/
+		bool _hog(Float64 sample_rate) {
+			pid_t owner = getpid();
+			if (!set_coreaudio_property(_device, kAudioDevicePropertyHogMode, kAudioObjectPropertyScopeGlobal, owner)) {
+				return false;
+			}
+
+			get_coreaudio_property(_device, kAudioDevicePropertyHogMode, kAudioObjectPropertyScopeGlobal, owner);
+			if (owner != getpid()) {
+				return false;
+			}
+
+			_is_hogging = true;
+			set_coreaudio_property(_device, kAudioDevicePropertyNominalSampleRate, kAudioObjectPropertyScopeGlobal, sample_rate);
+
+			return true;
+		}
+
+		void _unhog() {
+			if (!_is_hogging) {
+				return;
+			}
+
+			// Setting it to -1 releases it.
+			pid_t owner = -1;
+			set_coreaudio_property(_device, kAudioDevicePropertyHogMode, kAudioObjectPropertyScopeGlobal, owner);
+			_is_hogging = false;
+		}
+
+		static OSStatus _render(
+			void* user_data,
+			AudioUnitRenderActionFlags* flags,
+			AudioTimeStamp const* time_stamp,
+			UInt32 bus,
+			UInt32 frames_count,
+			AudioBufferList* data
+		) {
+			auto device = (CoreAudioOutputDevice*)user_data;
+			auto& buffer = data->mBuffers[0];
+
+			if (device->_is_running.load(std::memory_order_acquire) && device->_callback) {
+				device->_callback((float*)buffer.mData, device->_channels, (int)frames_count);
+			} else {
+				memset(buffer.mData, 0, buffer.mDataByteSize);
+				*flags |= kAudioUnitRenderAction_OutputIsSilence;
+			}
+
+			return noErr;
+		}
+
+		static OSStatus _on_overload(AudioObjectID, UInt32, AudioObjectPropertyAddress const*, void* user_data) {
+			auto device = (CoreAudioOutputDevice*)user_data;
+			device->_underrun_count.fetch_add(1, std::memory_order_relaxed);
+			return noErr;
+		}
+
+	private:
+
+		std::string _device_name;
+		std::string _device_id;
+		std::vector<int> _sample_rates;
+		int _channels;
+		uint32_t _buffer_size;
+		int _sample_rate;
+		std::chrono::microseconds _latency;
+
+		// Written from CoreAudio's notification thread.
+		std::atomic<uint64_t> _underrun_count;
+
+		bool _is_hogging;
+		std::atomic<bool> _is_running;
+
+		AudioObjectID _device;
+		AudioComponentInstance _unit;
+
+		AudioCallback _callback;
+	};
+
+	class CoreAudioInstance : public HostInstance {
+	public:
+
+		std::unique_ptr<HostDevice> get_default_output_device() const override {
+			AudioObjectID device = kAudioObjectUnknown;
+			if (!get_coreaudio_property(kAudioObjectSystemObject, kAudioHardwarePropertyDefaultOutputDevice, kAudioObjectPropertyScopeGlobal, device) || device == kAudioObjectUnknown) {
+				return nullptr;
+			}
+
+			return std::make_unique<CoreAudioOutputDevice>(device);
+		}
+	};
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+// Shared by the backends, for devices that don't take floats.
+
+namespace audio {
+	// How samples are laid out in the device's buffer.
+	enum class SampleFormat {
+		Float32,
+		Int32,	// Also used for 24-bit samples stored in 32 bits, as those are left justified.
+		Int24,
+		Int16
+	};
+
+	static inline int get_bytes_per_sample(SampleFormat sample_format) {
+		switch (sample_format) {
+			case SampleFormat::Int24:
+				return 3;
+			case SampleFormat::Int16:
+				return 2;
+			default:
+				return 4;
+		}
+	}
+
+	static inline void convert_samples(float const* in, uint8_t* out, int sample_count, SampleFormat sample_format) {
+		switch (sample_format) {
+			case SampleFormat::Float32:
+				memcpy(out, in, sample_count * sizeof(float));
+			break;
+			case SampleFormat::Int32:
+				for (int i = 0; i < sample_count; ++i) {
+					auto value = (int32_t)(std::clamp((double)in[i], -1.0, 1.0) * 2147483647.0);
+					memcpy(out + 4 * i, &value, sizeof(int32_t));
+				}
+			break;
+			case SampleFormat::Int24:
+				for (int i = 0; i < sample_count; ++i) {
+					auto value = (int32_t)(std::clamp(in[i], -1.0f, 1.0f) * 8388607.0f);
+					out[3 * i] = (uint8_t)value;
+					out[3 * i + 1] = (uint8_t)(value >> 8);
+					out[3 * i + 2] = (uint8_t)(value >> 16);
+				}
+			break;
+			case SampleFormat::Int16:
+				for (int i = 0; i < sample_count; ++i) {
+					auto value = (int16_t)(std::clamp(in[i], -1.0f, 1.0f) * 32767.0f);
+					memcpy(out + 2 * i, &value, sizeof(int16_t));
+				}
+			break;
+		}
+	}
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "audio.h"
+#include "wave_importer.h"
+
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <algorithm>
+
+#include <assert.h>
+
+namespace audio {
+	/*
+	 * Calls back for a period's worth of audio at a time on its own thread, paced as if a device
+	 * were playing it at NullDeviceOptions::speed. Callbacks run on the same path as any other
+	 * backend's, so they are timed the same, and a period rendered after the previous one would
+	 * have finished playing counts as an underrun.
+	*/
+	class NullOutputDevice : public HostDevice {
+	public:
+
+		NullOutputDevice(NullDeviceOptions options)
+			: _options(std::move(options))
+			, _sample_rates(get_standard_sample_rates().begin(), get_standard_sample_rates().end())
+			, _channels(2)
+			, _buffer_size(0)
+			, _sample_rate(0)
+			, _underrun_count(0)
+			, _is_open(false)
+			, _is_running(false)
+		{}
+
+		~NullOutputDevice() {
+			if (_is_open) {
+				close();
+			}
+		}
+
+		std::string_view get_name() const override {
+			return "Null device";
+		}
+
+		std::string_view get_id() const override {
+			return "null";
+		}
+
+		std::vector<int> const& get_available_sample_rates() const override {
+			return _sample_rates;
+		}
+
+		int get_sample_rate() const override {
+			return _sample_rate;
+		}
+
+		uint32_t get_buffer_size() const override {
+			return _buffer_size;
+		}
+
+		int get_channel_count() const override {
+			return _channels;
+		}
+
+		std::chrono::microseconds get_latency() const override {
+			return std::chrono::microseconds((int64_t)((double)_buffer_size / _sample_rate * 1e6));
+		}
+
+		uint64_t get_underrun_count() const override {
+			return _underrun_count.load(std::memory_order_relaxed);
+		}
+
+		bool open(int desired_sample_rate, DeviceOptions const& options) override {
+			if (!std::any_of(_sample_rates.begin(), _sample_rates.end(), [&](int rate) {
+				return rate == desired_sample_rate;
+			})) {
+				return false;
+			}
+
+			// There is no system mixer to bypass, so exclusive mode is the same as shared.
+			_sample_rate = desired_sample_rate;
+			auto period = options.period.value_or(DEFAULT_PERIOD);
+			_buffer_size = (uint32_t)std::max<int64_t>(1, period.count() * _sample_rate / 1000000);
+			_buffer.assign((size_t)_buffer_size * _channels, 0.0f);
+
+			if (_options.capture_path) {
+				auto capture = wave::WaveWriter::create(*_options.capture_path, _sample_rate, _channels);
+				if (!capture) {
+					fprintf(stderr, "[ERROR] Could not create the capture file '%s'\n", _options.capture_path->c_str());
+					return false;
+				}
+
+				_capture.emplace(std::move(*capture));
+			}
+
+			_is_open = true;
+
+			return true;
+		}
+
+		void close() override {
+			stop();
+
+			if (_capture) {
+				if (!_capture->close()) {
+					fprintf(stderr, "[ERROR] Could not write all of the capture file '%s'\n", _options.capture_path->c_str());
+				}
+				_capture.reset();
+			}
+
+			_is_open = false;
+		}
+
+		void start(AudioCallback callback) override {
+			assert(_is_open);
+
+			if (_is_running.load(std::memory_order_acquire)) {
+				return;
+			}
+
+			_callback = std::move(callback);
+			_is_running.store(true, std::memory_order_release);
+			_thread = std::thread(_task_thread, this);
+		}
+
+		void stop() override {
+			if (!_is_running.load(std::memory_order_acquire)) {
+				return;
+			}
+
+			_is_running.store(false, std::memory_order_release);
+			_thread.join();
+		}
+
+	private:
+
+		// The period a common device defaults to in shared mode.
+		static constexpr std::chrono::microseconds DEFAULT_PERIOD = std::chrono::microseconds(10000);
+
+		void _process() {
+			_callback(_buffer.data(), _channels, (int)_buffer_size);
+
+			if (_capture) {
+				_capture->write(_buffer.data(), (int)_buffer.size());
+			}
+		}
+
+		static void _task_thread(NullOutputDevice* device) {
+			using clock = std::chrono::steady_clock;
+
+			auto period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(
+				(double)device->_buffer_size / device->_sample_rate / device->_options.speed
+			));
+
+			// When the period being rendered has to be ready by, as the one before it finishes
+			// playing. Each period starts rendering once the one before it starts playing.
+			auto deadline = clock::now() + period;
+
+			while (device->_is_running.load(std::memory_order_acquire)) {
+				device->_process();
+
+				auto now = clock::now();
+				if (now > deadline) {
+					// Playing carries on from here, as a device would after running dry.
+					device->_underrun_count.store(device->_underrun_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+					deadline = now;
+				} else {
+					std::this_thread::sleep_until(deadline);
+				}
+
+				deadline += period;
+			}
+		}
+
+	private:
+
+		NullDeviceOptions _options;
+		std::vector<int> _sample_rates;
+		int _channels;
+		uint32_t _buffer_size;
+		int _sample_rate;
+
+		// Only written from the device thread.
+		std::atomic<uint64_t> _underrun_count;
+
+		std::vector<float> _buffer;
+		std::optional<wave::WaveWriter> _capture;
+
+		bool _is_open;
+		std::atomic<bool> _is_running;
+
+		std::thread _thread;
+
+		AudioCallback _callback;
+	};
+
+	class NullInstance : public HostInstance {
+	public:
+
+		NullInstance(NullDeviceOptions options)
+			: _options(std::move(options))
+		{}
+
+		std::unique_ptr<HostDevice> get_default_output_device() const override {
+			return std::make_unique<NullOutputDevice>(_options);
+		}
+
+	private:
+
+		NullDeviceOptions _options;
+	};
+}
@@ -1,16 +1,20 @@
 #pragma once
 
 #include "audio.h"
+#include "audio_format.h"
 
 #include <vector>
 #include <mmdeviceapi.h>
 #include <Audioclient.h>
 #include <wrl/client.h>
 #include <functiondiscoverykeys.h>
+#include <avrt.h>
 #include <string>
 #include <algorithm>
 #include <thread>
 #include <atomic>
+#include <chrono>
+#include <optional>
 
 #include <assert.h>
 
@@ -25,7 +29,7 @@ using ComPtr = Microsoft::WRL::ComPtr<T>;
 	abort();
 }
 
-#define REFTIMES_PER_SEC 100000000
+#define REFTIMES_PER_SEC 10000000
 #define REFTIMES_PER_MILLI 10000
 
 namespace audio {
@@ -111,7 +115,51 @@ namespace audio {
 	}
 
 	static inline REFERENCE_TIME map_samples_to_ref_time(int nsamples, int sample_rate) {
-		return (REFERENCE_TIME)((double)(nsamples) / (double)sample_rate * REFTIMES_PER_SEC);
+		return (REFERENCE_TIME)((double)(nsamples) / (double)sample_rate * REFTIMES_PER_SEC + 0.5);
+	}
+
+	static inline WAVEFORMATEXTENSIBLE make_wave_format(
+		int channels,
+		DWORD channel_mask,
+		int sample_rate,
+		SampleFormat sample_format
+	) {
+		WAVEFORMATEXTENSIBLE format;
+		int valid_bits;
+		switch (sample_format) {
+			default:
+			case SampleFormat::Float32:
+				format.SubFormat = KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
+				format.Format.wBitsPerSample = 32;
+				valid_bits = 32;
+			break;
+			case SampleFormat::Int32:
+				format.SubFormat = KSDATAFORMAT_SUBTYPE_PCM;
+				format.Format.wBitsPerSample = 32;
+				valid_bits = 32;
+			break;
+			case SampleFormat::Int24:
+				format.SubFormat = KSDATAFORMAT_SUBTYPE_PCM;
+				format.Format.wBitsPerSample = 24;
+				valid_bits = 24;
+			break;
+			case SampleFormat::Int16:
+				format.SubFormat = KSDATAFORMAT_SUBTYPE_PCM;
+				format.Format.wBitsPerSample = 16;
+				valid_bits = 16;
+			break;
+		}
+
+		format.Format.cbSize = 22;	// MSDN says 22 when wFormatTag == WAVE_FORMAT_EXTENSIBLE;
+		format.Format.nChannels = (WORD)channels;
+		format.Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+		format.Format.nSamplesPerSec = (DWORD)sample_rate;
+		format.Format.nBlockAlign = (WORD)format.Format.nChannels * (format.Format.wBitsPerSample / 8);
+		format.Format.nAvgBytesPerSec = (DWORD)format.Format.nBlockAlign * format.Format.nSamplesPerSec;
+		format.dwChannelMask = channel_mask;
+		format.Samples.wValidBitsPerSample = (WORD)valid_bits;
+
+		return format;
 	}
 
 	static std::vector<int> find_available_sample_rates(WAVEFORMATEXTENSIBLE format, IAudioClient* client) {
@@ -166,9 +214,9 @@ namespace audio {
 			auto wave_format_ex = extract_wave_format_ext(*wave_format);
 			_sample_rates = find_available_sample_rates(wave_format_ex, client.Get());
 
-			CoTaskMemFree(wave_format);
-
 			_channels = wave_format->nChannels;
+
+			CoTaskMemFree(wave_format);
 			// _channels = 2;
 			_channel_mask = wave_format_ex.dwChannelMask;
 			// _channel_mask = SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT;
@@ -177,6 +225,17 @@ namespace audio {
 			// assert(wave_format_ex.dwChannelMask & SPEAKER_FRONT_RIGHT);
 
 			_client_event = CreateEvent(nullptr, false, false, nullptr);
+
+			_is_open = false;
+			_is_running = false;
+			_is_exclusive = false;
+			_sample_format = SampleFormat::Float32;
+			_bytes_per_sample = sizeof(float);
+			_buffer_size = 0;
+			_sample_rate = 0;
+			_latency = std::chrono::microseconds(0);
+			_underrun_count = 0;
+			_has_rendered = false;
 		}
 
 		~WasapiOutputDevice() {
@@ -211,52 +270,88 @@ namespace audio {
 			return _channels;
 		}
 
-		bool open(int desired_sample_rate) override {
-			if (!std::any_of(_sample_rates.begin(), _sample_rates.end(), [&](int rate) {
+		std::chrono::microseconds get_latency() const override {
+			return _latency;
+		}
+
+		uint64_t get_underrun_count() const override {
+			return _underrun_count.load(std::memory_order_relaxed);
+		}
+
+		bool open(int desired_sample_rate, DeviceOptions const& options) override {
+			// Shared mode resamples to the system mixer's rate, so only the rates it accepts can be
+			// used. Exclusive mode is checked against the device itself when picking a format.
+			if (!options.exclusive && !std::any_of(_sample_rates.begin(), _sample_rates.end(), [&](int rate) {
 				return rate == desired_sample_rate;
 			})) {
 				return false;
 			}
 
+			_is_exclusive = options.exclusive;
+			auto share_mode = _is_exclusive ? AUDCLNT_SHAREMODE_EXCLUSIVE : AUDCLNT_SHAREMODE_SHARED;
+
 			HRESULT hr;
 			if (hr = _device->Activate(_uuidof(IAudioClient), CLSCTX_ALL, nullptr, (void**)_client.GetAddressOf()), FAILED(hr)) {
 				handle_error_fatal(hr);
 			}
 
-			WAVEFORMATEXTENSIBLE format;
-			format.Format.cbSize = 22;	// MSDN says 22 when wFormatTag == WAVE_FORMAT_EXTENSIBLE;
-			format.Format.nChannels = (WORD)_channels;
-			format.Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
-			format.Format.nSamplesPerSec = (DWORD)desired_sample_rate;
-			format.Format.wBitsPerSample = sizeof(float) * 8;
-			format.Format.nBlockAlign = (WORD)format.Format.nChannels * (format.Format.wBitsPerSample / 8);
-			format.Format.nAvgBytesPerSec = (DWORD)format.Format.nBlockAlign * format.Format.nSamplesPerSec;
-			format.dwChannelMask = _channel_mask;
-			format.SubFormat = KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
-			format.Samples.wValidBitsPerSample = format.Format.wBitsPerSample;
+			auto format = _find_format(desired_sample_rate, share_mode);
+			if (!format) {
+				_client = nullptr;
+				return false;
+			}
 
 			REFERENCE_TIME default_period, min_period;
 			_client->GetDevicePeriod(&default_period, &min_period);
 
-			if (SUCCEEDED(_client->Initialize(
-				AUDCLNT_SHAREMODE_SHARED,
-				AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
-				default_period,
-				0,
-				&format.Format,
-				nullptr
-			))) {
-				_is_open = true;
-				_sample_rate = format.Format.nSamplesPerSec;
+			auto period = default_period;
+			if (options.period) {
+				period = std::max(min_period, (REFERENCE_TIME)(options.period->count() * REFTIMES_PER_MILLI / 1000));
+			}
+
+			hr = _initialize(share_mode, period, *format);
 
-				_client->GetBufferSize(&_buffer_size);
+			// Exclusive mode may need the period to land on a whole number of frames the device
+			// can transfer at once. The client has to be created again to retry.
+			if (hr == AUDCLNT_E_BUFFER_SIZE_NOT_ALIGNED) {
+				UINT32 aligned_frames;
+				_client->GetBufferSize(&aligned_frames);
+				period = map_samples_to_ref_time((int)aligned_frames, desired_sample_rate);
+
+				_client = nullptr;
+				if (hr = _device->Activate(_uuidof(IAudioClient), CLSCTX_ALL, nullptr, (void**)_client.GetAddressOf()), FAILED(hr)) {
+					handle_error_fatal(hr);
+				}
 
-				_client->GetService(_uuidof(IAudioRenderClient), (void**)_render_client.GetAddressOf());
-				_client->SetEventHandle(_client_event);
+				hr = _initialize(share_mode, period, *format);
+			}
 
-				_client_thread = std::thread(_task_client_thread, this);
+			if (FAILED(hr)) {
+				fprintf(stderr, "[ERROR] Could not open device in %s mode, failed with code: %i\n", _is_exclusive ? "exclusive" : "shared", hr);
+				_client = nullptr;
+				return false;
 			}
 
+			_sample_rate = format->Format.nSamplesPerSec;
+			_bytes_per_sample = format->Format.wBitsPerSample / 8;
+
+			_client->GetBufferSize(&_buffer_size);
+
+			REFERENCE_TIME stream_latency = 0;
+			_client->GetStreamLatency(&stream_latency);
+			_latency = std::chrono::microseconds(
+				(int64_t)((double)_buffer_size / _sample_rate * 1e6) + stream_latency / (REFTIMES_PER_MILLI / 1000)
+			);
+
+			// Rendered as floats first when the device takes another format.
+			_float_buffer.assign(_sample_format == SampleFormat::Float32 ? 0 : _buffer_size * _channels, 0.0f);
+
+			_client->GetService(_uuidof(IAudioRenderClient), (void**)_render_client.GetAddressOf());
+			_client->SetEventHandle(_client_event);
+
+			_is_open = true;
+			_client_thread = std::thread(_task_client_thread, this);
+
 			return true;
 		}
 
@@ -279,6 +374,15 @@ namespace audio {
 			}
 
 			_callback = std::move(callback);
+			_has_rendered = false;
+
+			// Exclusive streams start by playing a whole buffer, which must not be left uninitialized.
+			if (_is_exclusive) {
+				BYTE* data;
+				if (SUCCEEDED(_render_client->GetBuffer(_buffer_size, &data))) {
+					_render_client->ReleaseBuffer(_buffer_size, AUDCLNT_BUFFERFLAGS_SILENT);
+				}
+			}
 
 			_client->Start();
 
@@ -300,26 +404,89 @@ namespace audio {
 
 	private:
 
+		std::optional<WAVEFORMATEXTENSIBLE> _find_format(int sample_rate, AUDCLNT_SHAREMODE share_mode) {
+			if (share_mode == AUDCLNT_SHAREMODE_SHARED) {
+				_sample_format = SampleFormat::Float32;
+				return make_wave_format(_channels, _channel_mask, sample_rate, _sample_format);
+			}
+
+			// Devices in exclusive mode only take the formats their hardware supports, so the
+			// most precise one available is used.
+			constexpr SampleFormat formats[] = {
+				SampleFormat::Float32,
+				SampleFormat::Int32,
+				SampleFormat::Int24,
+				SampleFormat::Int16
+			};
+
+			for (auto sample_format : formats) {
+				auto format = make_wave_format(_channels, _channel_mask, sample_rate, sample_format);
+
+				// Some devices only take 24 valid bits in a 32-bit container.
+				if (sample_format == SampleFormat::Int32 && FAILED(_client->IsFormatSupported(share_mode, &format.Format, nullptr))) {
+					format.Samples.wValidBitsPerSample = 24;
+				}
+
+				if (SUCCEEDED(_client->IsFormatSupported(share_mode, &format.Format, nullptr))) {
+					_sample_format = sample_format;
+					return format;
+				}
+			}
+
+			return std::nullopt;
+		}
+
+		HRESULT _initialize(AUDCLNT_SHAREMODE share_mode, REFERENCE_TIME period, WAVEFORMATEXTENSIBLE const& format) {
+			// In exclusive mode the buffer is as long as the period. In shared mode the period is
+			// set by the system mixer, so the request only sets the buffer size.
+			return _client->Initialize(
+				share_mode,
+				AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+				period,
+				share_mode == AUDCLNT_SHAREMODE_EXCLUSIVE ? period : 0,
+				&format.Format,
+				nullptr
+			);
+		}
+
 		void _process() {
 			uint32_t frames_count;
-			uint32_t padding_frames_count;
 			uint8_t* data;
 
-			_client->GetCurrentPadding(&padding_frames_count);
-			
-			assert(_buffer_size >= padding_frames_count);
-			frames_count = _buffer_size - padding_frames_count;
+			// Exclusive streams are filled a whole buffer at a time on each event.
+			if (_is_exclusive) {
+				frames_count = _buffer_size;
+			} else {
+				uint32_t padding_frames_count;
+				_client->GetCurrentPadding(&padding_frames_count);
+
+				assert(_buffer_size >= padding_frames_count);
+				frames_count = _buffer_size - padding_frames_count;
 
-			_render_client->GetBuffer(frames_count, &data);
+				// The system mixer played everything written since the last event, so it ran dry.
+				// Exclusive streams hand over a whole buffer each time, which can't be checked this way.
+				if (padding_frames_count == 0 && _has_rendered) {
+					_underrun_count.store(_underrun_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				}
+			}
+
+			if (FAILED(_render_client->GetBuffer(frames_count, &data))) {
+				return;
+			}
 
 			if (_callback) {
-				float* dataf = (float*)data;
-				_callback(dataf, _channels, frames_count);
+				if (_sample_format == SampleFormat::Float32) {
+					_callback((float*)data, _channels, frames_count);
+				} else {
+					_callback(_float_buffer.data(), _channels, frames_count);
+					convert_samples(_float_buffer.data(), data, frames_count * _channels, _sample_format);
+				}
 			} else {
 				memset(data, 0, _bytes_per_sample * _channels * frames_count);
 			}
 
 			_render_client->ReleaseBuffer(frames_count, 0);
+			_has_rendered = true;
 		}
 
 		bool try_process() {
@@ -335,11 +502,23 @@ namespace audio {
 		}
 
 		static void _task_client_thread(WasapiOutputDevice* device) {
-			SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+			// Registering with MMCSS lets the scheduler give the thread priority over normal work
+			// for as long as it keeps up with audio. Falls back to a plain priority if unavailable.
+			DWORD task_index = 0;
+			auto mmcss = AvSetMmThreadCharacteristicsW(L"Pro Audio", &task_index);
+			if (mmcss) {
+				AvSetMmThreadPriority(mmcss, AVRT_PRIORITY_HIGH);
+			} else {
+				SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+			}
 
 			while (device->_is_open.load(std::memory_order_acquire)) {
 				device->try_process();
 			}
+
+			if (mmcss) {
+				AvRevertMmThreadCharacteristics(mmcss);
+			}
 		}
 
 	private:
@@ -353,6 +532,16 @@ namespace audio {
 		int _sample_rate;
 		DWORD _channel_mask;
 		HANDLE _client_event;
+		bool _is_exclusive;
+		SampleFormat _sample_format;
+		std::chrono::microseconds _latency;
+
+		// Only written from the client thread.
+		std::atomic<uint64_t> _underrun_count;
+		bool _has_rendered;
+
+		// Where the callback renders to when the device does not take floats.
+		std::vector<float> _float_buffer;
 		
 		std::atomic<bool> _is_open;
 		std::atomic<bool> _is_running;
@@ -0,0 +1,160 @@
+#include "benchmark.h"
+#include "music.h"
+#include "render.h"
+#include "wave_importer.h"
+
+#include <algorithm>
+#include <optional>
+#include <vector>
+
+namespace benchmark {
+	void report(Measurement const& measurement) {
+		// Names come from file names, so they are escaped to keep the line valid JSON.
+		std::string name;
+		for (auto c : measurement.name) {
+			if (c == '"' || c == '\\') {
+				name += '\\';
+				name += c;
+			} else if ((unsigned char)c < 0x20) {
+				name += '_';
+			} else {
+				name += c;
+			}
+		}
+
+		auto seconds = std::max(measurement.elapsed.count() / 1e9, 1e-9);
+		auto samples = (double)measurement.frames * measurement.channel_count;
+		auto audio_seconds = (double)measurement.frames / measurement.sample_rate;
+
+		fprintf(
+			stdout,
+			"{\"name\":\"%s\",\"frames\":%llu,\"channels\":%d,\"sample_rate\":%d,\"runs\":%d,"
+			"\"seconds\":%.6f,\"samples_per_sec\":%.0f,\"realtime\":%.2f}\n",
+			name.c_str(),
+			(unsigned long long)measurement.frames,
+			measurement.channel_count,
+			measurement.sample_rate,
+			measurement.runs,
+			seconds,
+			samples / seconds,
+			audio_seconds / seconds
+		);
+		fflush(stdout);
+	}
+
+	bool run_song(std::filesystem::path const& music_filename, SongOptions const& options) {
+		// Same format and segments as exporting.
+		constexpr int CHANNEL_COUNT = 2;
+		constexpr int SAMPLE_RATE = 48000;
+		constexpr int SEGMENT_FRAMES = render::BLOCK_FRAMES * 64;
+
+		enum Stage {
+			Load,
+			Samples,
+			Render,
+			Encode,
+			Total,
+			STAGE_COUNT
+		};
+
+		constexpr char const* STAGE_NAMES[STAGE_COUNT] = { "load", "samples", "render", "encode", "total" };
+
+		auto music_base_path = music_filename.parent_path();
+		auto is_compiled = Music::is_compiled(music_filename.string());
+
+		std::chrono::nanoseconds best[STAGE_COUNT];
+		std::fill(std::begin(best), std::end(best), std::chrono::nanoseconds::max());
+
+		std::vector<float> block(SEGMENT_FRAMES * CHANNEL_COUNT);
+		std::vector<uint8_t> encoded(block.size() * sizeof(int16_t));
+		uint64_t frame_count = 0;
+
+		for (int run = 0; run < options.runs; ++run) {
+			std::chrono::nanoseconds elapsed[STAGE_COUNT] = {};
+
+			std::optional<std::variant<Music, MusicError>> res;
+			elapsed[Load] = time([&]() {
+				res.emplace(is_compiled
+					? Music::load_compiled(music_filename.string())
+					: Music::import(music_filename.string()));
+			});
+
+			if (auto e = std::get_if<MusicError>(&*res)) {
+				if (auto e2 = std::get_if<MusicErrorParse>(e)) {
+					fprintf(stderr, "[ERROR] %s\n", e2->msg.c_str());
+				} else if (auto e2 = std::get_if<MusicErrorFile>(e)) {
+					fprintf(stderr, "[ERROR] %s\n", e2->msg.c_str());
+				}
+				return false;
+			}
+
+			auto& music = std::get<Music>(*res);
+
+			// A new cache every run, so that every run decodes the samples.
+			auto samples = std::make_shared<SampleCache>(SAMPLE_RATE);
+			auto is_loaded = false;
+			elapsed[Samples] = time([&]() {
+				is_loaded = render::load_samples(music, music_base_path, *samples);
+			});
+
+			if (!is_loaded) {
+				return false;
+			}
+
+			frame_count = 0;
+			elapsed[Render] = time([&]() {
+				std::shared_ptr<render::PatternCache> patterns;
+				if (options.cache_patterns) {
+					patterns = std::make_shared<render::PatternCache>(music, music_base_path, samples, CHANNEL_COUNT, SAMPLE_RATE);
+				}
+
+				std::vector<render::TrackRenderer> track_renderers;
+				track_renderers.reserve(music.get_tracks().size());
+				for (int i = 0; i < (int)music.get_tracks().size(); ++i) {
+					if (patterns) {
+						track_renderers.emplace_back(std::in_place_type<render::Sequencer>, music, std::vector<int>{ i }, patterns, CHANNEL_COUNT, SAMPLE_RATE);
+					} else {
+						track_renderers.emplace_back(
+							std::in_place_type<render::Sequencer>,
+							music,
+							NoteScheduler(music, { i }),
+							music_base_path,
+							samples,
+							CHANNEL_COUNT,
+							SAMPLE_RATE
+						);
+					}
+				}
+
+				render::OfflineRenderer renderer(std::move(track_renderers), CHANNEL_COUNT, music.get_gain(), options.thread_count);
+				while (true) {
+					auto frames = renderer.render(block.data(), SEGMENT_FRAMES);
+					frame_count += frames;
+
+					// Timed on its own, and taken back out of the render time below.
+					elapsed[Encode] += time([&]() {
+						wave::encode_pcm(block.data(), encoded.data(), frames * CHANNEL_COUNT, 16);
+					});
+
+					if (frames < SEGMENT_FRAMES) {
+						break;
+					}
+				}
+			});
+
+			elapsed[Render] -= elapsed[Encode];
+			elapsed[Total] = elapsed[Load] + elapsed[Samples] + elapsed[Render] + elapsed[Encode];
+
+			for (int i = 0; i < STAGE_COUNT; ++i) {
+				best[i] = std::min(best[i], elapsed[i]);
+			}
+		}
+
+		auto song_name = music_filename.stem().string();
+		for (int i = 0; i < STAGE_COUNT; ++i) {
+			report({ song_name + "/" + STAGE_NAMES[i], frame_count, CHANNEL_COUNT, SAMPLE_RATE, options.runs, best[i] });
+		}
+
+		return true;
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <filesystem>
+
+namespace benchmark {
+	/*
+	 * The time taken to produce a number of frames, as reported by a benchmark.
+	*/
+	struct Measurement {
+		std::string name;
+		uint64_t frames;
+		int channel_count;
+		int sample_rate;
+		int runs;
+
+		// The fastest of the runs, which is the least disturbed by anything else on the machine.
+		std::chrono::nanoseconds elapsed;
+	};
+
+	/*
+	 * @brief Prints a measurement to stdout as a single line of JSON, along with its samples per
+	 * second and realtime factor, i.e. seconds of audio produced per second of work.
+	*/
+	void report(Measurement const& measurement);
+
+	/*
+	 * @brief Times a call.
+	*/
+	template<class F>
+	std::chrono::nanoseconds time(F&& f) {
+		auto start = std::chrono::steady_clock::now();
+		f();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+	}
+
+	struct SongOptions {
+		int thread_count;
+		bool cache_patterns;
+		int runs;
+	};
+
+	/*
+	 * @brief Exports a song without writing it anywhere and reports the time taken by each stage:
+	 * loading the song, loading its samples, rendering and encoding, and all of them together.
+	 * Stages are named after the song's file, e.g. "vogel_im_kafig/render".
+	 * @return False if the song could not be loaded, an error is logged in that case.
+	*/
+	bool run_song(std::filesystem::path const& music_filename, SongOptions const& options);
+}
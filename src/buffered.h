@@ -2,6 +2,7 @@
 
 #include <optional>
 #include <chrono>
+#include <vector>
 #include "source.h"
 
 class Buffered : public Source {
@@ -9,9 +10,10 @@ public:
 
 	Buffered(std::unique_ptr<Source> input, int buffer_size = 1024)
 		: _input(std::move(input))
-		, _buffer_size(buffer_size * _input->channel_count())
-		, _buffer(_buffer_size)
+		, _buffer_size(buffer_size)
+		, _buffer_len(0)
 		, _buffer_idx(0)
+		, _buffer(buffer_size * _input->channel_count())
 	{
 		_advance_buffer();
 	}
@@ -25,11 +27,11 @@ public:
 	}
 
 	std::optional<double> next_sample() override {
-		if (_buffer_idx >= _buffer.size()) {
+		if (_buffer_idx >= _buffer_len) {
 			_advance_buffer();
 		}
-		
-		if (_buffer.empty()) {
+
+		if (_buffer_len == 0) {
 			return std::nullopt;
 		}
 
@@ -40,6 +42,39 @@ public:
 		return sample;
 	}
 
+	int fill(float* out, int frames) override {
+		auto channels = _input->channel_count();
+		auto requested = frames * channels;
+		int written = 0;
+
+		while (written < requested) {
+			if (_buffer_idx >= _buffer_len) {
+				// Requests larger than the buffer can skip the extra copy.
+				auto remaining_frames = (requested - written) / channels;
+				if (remaining_frames >= _buffer_size) {
+					auto produced = _input->fill(out + written, remaining_frames);
+					written += produced * channels;
+					if (produced < remaining_frames) {
+						break;
+					}
+					continue;
+				}
+
+				_advance_buffer();
+				if (_buffer_len == 0) {
+					break;
+				}
+			}
+
+			auto count = std::min(_buffer_len - _buffer_idx, requested - written);
+			std::copy_n(_buffer.data() + _buffer_idx, count, out + written);
+			_buffer_idx += count;
+			written += count;
+		}
+
+		return written / channels;
+	}
+
 	std::optional<std::chrono::nanoseconds> total_duration() const override {
 		return _input->total_duration();
 	}
@@ -47,22 +82,15 @@ public:
 private:
 
 	void _advance_buffer() {
-		_buffer.clear();
 		_buffer_idx = 0;
-
-		for (int i = 0; i < _buffer_size; ++i) {
-			if (auto sample = _input->next_sample()) {
-				_buffer.push_back(*sample);
-			} else {
-				break;
-			}
-		}
+		_buffer_len = _input->fill(_buffer.data(), _buffer_size) * _input->channel_count();
 	}
 
 private:
 
 	std::unique_ptr<Source> _input;
-	int _buffer_size;
+	int _buffer_size;	// In frames
+	int _buffer_len;	// In samples
 	int _buffer_idx;
-	std::vector<double> _buffer;
-};
\ No newline at end of file
+	pool::Vector<float> _buffer;
+};
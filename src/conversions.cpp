@@ -0,0 +1,102 @@
+#include "conversions.h"
+
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <math.h>
+
+namespace {
+	struct QualitySettings {
+		int tap_count;	// When converting up, scaled up when converting down
+		double cutoff;	// Of the lower Nyquist frequency
+		double kaiser_beta;
+	};
+
+	QualitySettings get_quality_settings(ResampleQuality quality) {
+		switch (quality) {
+			case ResampleQuality::Fast:
+				return { 8, 0.80, 5.0 };
+			default:
+			case ResampleQuality::Balanced:
+				return { 24, 0.90, 7.0 };
+			case ResampleQuality::Best:
+				return { 48, 0.94, 9.0 };
+		}
+	}
+
+	// Zeroth order modified Bessel function of the first kind, for the Kaiser window.
+	double bessel_i0(double x) {
+		auto sum = 1.0;
+		auto term = 1.0;
+		auto half_x = x / 2.0;
+		for (int k = 1; k < 64 && term > sum * 1e-12; ++k) {
+			term *= (half_x / k) * (half_x / k);
+			sum += term;
+		}
+
+		return sum;
+	}
+
+	std::shared_ptr<ResampleFilter const> design_filter(int up, int down, ResampleQuality quality) {
+		constexpr double PI = 3.14159265358979323846;
+		constexpr int MAX_TAPS = 512;
+
+		auto settings = get_quality_settings(quality);
+		auto filter = std::make_shared<ResampleFilter>();
+		filter->up = up;
+		filter->down = down;
+		filter->phase_count = std::min(up, ResampleFilter::MAX_PHASES);
+
+		// Converting down cuts below the output's Nyquist frequency, which widens the filter
+		// in input frames by as much.
+		auto ratio = std::min(1.0, (double)up / down);
+		auto cutoff = settings.cutoff * ratio;
+		auto tap_count = (int)ceil(settings.tap_count / ratio);
+		filter->tap_count = std::min(MAX_TAPS, tap_count + (tap_count & 1));
+
+		auto half = filter->tap_count / 2;
+		auto i0_beta = bessel_i0(settings.kaiser_beta);
+		filter->coefficients.resize((size_t)(filter->phase_count + 1) * filter->tap_count);
+
+		for (int phase = 0; phase <= filter->phase_count; ++phase) {
+			auto fraction = (double)phase / filter->phase_count;
+			auto coefficients = filter->coefficients.data() + (size_t)phase * filter->tap_count;
+
+			// Tap half - 1 is the input frame the output frame lands on or just after.
+			auto sum = 0.0;
+			for (int tap = 0; tap < filter->tap_count; ++tap) {
+				auto x = tap - (half - 1) - fraction;
+				auto sinc = x == 0.0 ? 1.0 : sin(PI * cutoff * x) / (PI * cutoff * x);
+				auto r = x / half;
+				auto window = bessel_i0(settings.kaiser_beta * sqrt(std::max(0.0, 1.0 - r * r))) / i0_beta;
+				coefficients[tap] = (float)(sinc * window);
+				sum += sinc * window;
+			}
+
+			// Normalized so that each phase passes a constant signal unchanged.
+			for (int tap = 0; tap < filter->tap_count; ++tap) {
+				coefficients[tap] = (float)(coefficients[tap] / sum);
+			}
+		}
+
+		return filter;
+	}
+}
+
+std::shared_ptr<ResampleFilter const> ResampleFilter::get(int from_sample_rate, int to_sample_rate, ResampleQuality quality) {
+	auto g = gcd(from_sample_rate, to_sample_rate);
+	auto up = to_sample_rate / g;
+	auto down = from_sample_rate / g;
+
+	static std::mutex filters_mtx;
+	static std::map<std::tuple<int, int, ResampleQuality>, std::shared_ptr<ResampleFilter const>> filters;
+
+	std::lock_guard<std::mutex> lock(filters_mtx);
+
+	auto& filter = filters[{ up, down, quality }];
+	if (!filter) {
+		filter = design_filter(up, down, quality);
+	}
+
+	return filter;
+}
@@ -8,249 +8,460 @@
 
 #include "source.h"
 
-class ChannelConverter : public Source {
+template<class T>
+T gcd(T a, T b) {
+	return b == 0 ? a : gcd(b, a % b);
+}
+
+/*
+ * Hands out the frames a source renders through fill() one sample at a time, for the
+ * source's next_sample().
+*/
+class FrameSampleReader {
 public:
 
-	ChannelConverter(std::unique_ptr<Source> input, int to_channels)
-		: _input(std::move(input))
-		, _from(_input->channel_count())
-		, _to(to_channels)
-		, _repeat_sample(std::nullopt)
-		, _next_output_sample_pos(0)
-	{
-	}
+	FrameSampleReader(int channels)
+		: _frame(channels)
+		, _idx(channels)
+	{}
 
-	int channel_count() const override {
-		return _to;
-	}
+	std::optional<double> next_sample(Source& source) {
+		if (_idx == _frame.size()) {
+			if (source.fill(_frame.data(), 1) == 0) {
+				return std::nullopt;
+			}
 
-	int sample_rate() const override {
-		return _input->sample_rate();
+			_idx = 0;
+		}
+
+		auto sample = _frame[_idx];
+		_idx += 1;
+		return sample;
 	}
 
-	std::optional<double> next_sample() override {
-		// Essentially a no-op if there's no conversion.
-		if (_from == _to) {
-			return _input->next_sample();
-		}
+private:
 
-		std::optional<double> result;
-		
-		// When converting from less channels to more, the last channel of the
-		// input is copied to the extra channels of the output.
-		
-		// Copy the last input channel here
-		if (_next_output_sample_pos == _from - 1) {
-			auto sample = _input->next_sample();
-			_repeat_sample = sample;
-			result = sample;
-		}
-		else if (_next_output_sample_pos < _from) {
-			result = _input->next_sample();
-		} else {
-			// We are now outputting to a channel that doesn't exist in the input,
-			// so return the repeat sample.
-			result = _repeat_sample;
-		}
+	pool::Vector<float> _frame;
+	size_t _idx;
+};
 
-		++_next_output_sample_pos;
+/*
+ * Maps the channels of each frame to another channel count.
+ * Extra output channels copy the last input channel, and extra input channels are dropped,
+ * except when mixing down to mono, which averages every input channel.
+*/
+class ChannelMatrix {
+public:
 
-		if (_next_output_sample_pos == _to) {
-			// Wrap around back to 0
-			_next_output_sample_pos = 0;
+	ChannelMatrix(int from_channels, int to_channels)
+		: _from(from_channels)
+		, _to(to_channels)
+	{}
 
-			// Discard any remaining samples if we are converting to a lower channel count.
-			if (_from > _to) {
-				for (int i = _to; i < _from; ++i) {
-					_input->next_sample();
-				}
-			}
-		}
+	bool is_identity() const {
+		return _from == _to;
+	}
 
-		return result;
+	int from_channels() const {
+		return _from;
 	}
 
-	std::optional<std::chrono::nanoseconds> total_duration() const override {
-		return _input->total_duration();
+	int to_channels() const {
+		return _to;
+	}
+
+	/*
+	 * @brief Maps interleaved frames. in and out must not overlap.
+	*/
+	void apply(float const* in, float* out, int frames) const {
+		if (_to == 1) {
+			auto scale = 1.0f / _from;
+			for (int frame = 0; frame < frames; ++frame) {
+				auto sum = 0.0f;
+				for (int channel = 0; channel < _from; ++channel) {
+					sum += in[channel];
+				}
+				*out++ = sum * scale;
+				in += _from;
+			}
+		} else if (_from == 1) {
+			for (int frame = 0; frame < frames; ++frame) {
+				out = std::fill_n(out, _to, in[frame]);
+			}
+		} else {
+			for (int frame = 0; frame < frames; ++frame) {
+				for (int channel = 0; channel < _to; ++channel) {
+					*out++ = in[std::min(channel, _from - 1)];
+				}
+				in += _from;
+			}
+		}
 	}
 
 private:
 
-	std::unique_ptr<Source> _input;
 	int _from;
 	int _to;
-	std::optional<double> _repeat_sample;
-	int _next_output_sample_pos;
 };
 
-template<class T>
-T gcd(T a, T b) {
-	return b == 0 ? a : gcd(b, a % b);
-}
+/*
+ * How hard the sample rate converter works to keep out aliasing and imaging.
+ * Better qualities use longer filters, so cost more per output frame.
+*/
+enum class ResampleQuality {
+	Fast,		// 8 taps, for sources converted while playing
+	Balanced,	// 24 taps
+	Best,		// 48 taps, for samples converted once when loaded
+};
 
-class SampleRateConverter : public Source {
+/*
+ * Kaiser windowed sinc filter for one conversion ratio, split into phases. Output frames
+ * land on input frames at fractions of up, each needing the phase for its fraction.
+ *
+ * All up phases are stored when there are few enough of them, which covers the common rates,
+ * e.g. 160 phases for 44.1k to 48k. Otherwise the fraction is interpolated between
+ * MAX_PHASES evenly spaced phases.
+ *
+ * Never modified once built, and shared between every converter with the same ratio.
+*/
+struct ResampleFilter {
+	static constexpr int MAX_PHASES = 1024;
+
+	int up;
+	int down;
+	int phase_count;
+	int tap_count;
+	// (phase_count + 1) phases of tap_count each. The extra phase is a whole frame's offset,
+	// for interpolating past the last phase.
+	std::vector<float> coefficients;
+
+	bool is_exact() const {
+		return phase_count == up;
+	}
+
+	float const* phase(int idx) const {
+		return coefficients.data() + (size_t)idx * tap_count;
+	}
+
+	/*
+	 * @brief Gets the filter converting between two rates, designing it on first use.
+	 * Safe to use from multiple threads.
+	*/
+	static std::shared_ptr<ResampleFilter const> get(int from_sample_rate, int to_sample_rate, ResampleQuality quality);
+};
+
+/*
+ * Polyphase resampling of interleaved frames. Reads its input in blocks into a history buffer,
+ * and computes each output frame as one dot product per channel with a precomputed phase of
+ * the filter. Nothing is allocated after construction.
+ *
+ * Only holds the history of its input, so the source it reads is passed to each call.
+*/
+class Resampler {
 public:
 
-	SampleRateConverter(std::unique_ptr<Source> input, int to_sample_rate)
-		: _input(std::move(input))
-		, _channels(_input->channel_count())
-		, _current_frame_idx(0)
-		, _next_frame_idx(0)
+	Resampler(int channels, int from_sample_rate, int to_sample_rate, ResampleQuality quality)
+		: _filter(ResampleFilter::get(from_sample_rate, to_sample_rate, quality))
+		, _channels(channels)
+		, _tap_count(_filter->tap_count)
+		, _half_taps(_tap_count / 2)
+		, _down_frames(_filter->down / _filter->up)
+		, _down_phase(_filter->down % _filter->up)
+		, _position(0)
+		, _phase(0)
+		, _buffered(0)
+		, _input_end(0)
+		, _is_input_done(false)
 	{
-		auto from = _input->sample_rate();
-		auto to = to_sample_rate;
-		auto g = gcd(from, to);
+		// Room for whatever a single output frame can step over.
+		_buffer.resize((size_t)(_tap_count + std::max(INPUT_BLOCK_FRAMES, _down_frames + 1)) * _channels);
+		_frame.resize(_channels);
 
-		std::vector<double> first_samples;
-		std::vector<double> next_samples;
+		if (!_filter->is_exact()) {
+			_blended.resize(_tap_count);
+		}
 
-		if (from != to) {
-			first_samples.reserve(_channels);
-			next_samples.reserve(_channels);
+		// The first input frame sits under the centre of the filter, so output starts on it
+		// rather than lagging by half the filter.
+		_buffered = _half_taps - 1;
+		_input_end = _buffered;
+	}
 
-			for (int i = 0; i < _channels; ++i) {
-				if (auto sample = _input->next_sample()) {
-					first_samples.push_back(*sample);
-				}
+	/*
+	 * @brief Resamples up to frames output frames.
+	 * @param input The source read from, always the same one.
+	 * @param emit Called with each output frame, as a pointer to its channels.
+	 * @return The number of frames emitted. Anything less than frames means the input is exhausted.
+	*/
+	template<class F>
+	int process(Source& input, int frames, F&& emit) {
+		for (int frame = 0; frame < frames; ++frame) {
+			if (_position + _tap_count > _buffered) {
+				_refill(input);
+			}
+
+			// Done once the centre of the filter has passed the last input frame.
+			if (_is_input_done && _position + _half_taps - 1 >= _input_end) {
+				return frame;
 			}
 
-			for (int i = 0; i < _channels; ++i) {
-				if (auto sample = _input->next_sample()) {
-					next_samples.push_back(*sample);
+			auto coefficients = _filter->is_exact() ? _filter->phase(_phase) : _blend_phases();
+			auto history = _buffer.data() + (size_t)_position * _channels;
+
+			for (int channel = 0; channel < _channels; ++channel) {
+				auto sum = 0.0f;
+				for (int tap = 0; tap < _tap_count; ++tap) {
+					sum += history[tap * _channels + channel] * coefficients[tap];
 				}
+				_frame[channel] = sum;
+			}
+
+			emit((float const*)_frame.data());
+
+			_position += _down_frames;
+			_phase += _down_phase;
+			if (_phase >= _filter->up) {
+				_phase -= _filter->up;
+				_position += 1;
 			}
 		}
 
-		_current_frame = std::move(first_samples);
-		_next_frame = std::move(next_samples);
-		_output_buffer.reserve(_channels);
-		_from = from / g;
-		_to = to / g;
+		return frames;
 	}
 
-	int channel_count() const override {
-		return _input->channel_count();
-	}
+private:
 
-	int sample_rate() const override {
-		return _to;
+	// Input frames read at once, on top of the filter's history.
+	static constexpr int INPUT_BLOCK_FRAMES = 256;
+
+	/*
+	 * @brief Moves the frames still under the filter to the front of the buffer, and reads
+	 * input after them. Once the input runs out, the rest is padded with silence.
+	*/
+	void _refill(Source& input) {
+		auto capacity = (int)(_buffer.size() / _channels);
+
+		// When converting down, the position may have run past the buffered frames. Those
+		// frames are then skipped from the input.
+		auto start = std::min(_position, _buffered);
+		auto kept = _buffered - start;
+		std::copy_n(_buffer.begin() + (size_t)start * _channels, (size_t)kept * _channels, _buffer.begin());
+		_position -= start;
+		_input_end -= start;
+		_buffered = kept;
+
+		while (!_is_input_done && _buffered < capacity) {
+			auto requested = capacity - _buffered;
+			auto produced = input.fill(_buffer.data() + (size_t)_buffered * _channels, requested);
+			_buffered += produced;
+			_input_end = _buffered;
+			_is_input_done = produced < requested;
+		}
+
+		std::fill(_buffer.begin() + (size_t)_buffered * _channels, _buffer.end(), 0.0f);
+		_buffered = capacity;
 	}
 
-	std::optional<double> next_sample() override {
-		if (_from == _to) {
-			return _input->next_sample();
+	/*
+	 * @brief Interpolates the coefficients for the current fraction between the two closest phases.
+	*/
+	float const* _blend_phases() {
+		auto scaled = (int64_t)_phase * _filter->phase_count;
+		auto idx = (int)(scaled / _filter->up);
+		auto t = (float)(scaled % _filter->up) / _filter->up;
+
+		auto a = _filter->phase(idx);
+		auto b = _filter->phase(idx + 1);
+		for (int tap = 0; tap < _tap_count; ++tap) {
+			_blended[tap] = a[tap] + (b[tap] - a[tap]) * t;
 		}
 
-		if (!_output_buffer.empty()) {
-			auto sample = _output_buffer[0];
-			_output_buffer.erase(_output_buffer.begin());
-			return sample;
+		return _blended.data();
+	}
+
+private:
+
+	std::shared_ptr<ResampleFilter const> _filter;
+	int _channels;
+	int _tap_count;
+	int _half_taps;
+	int _down_frames;	// Whole input frames stepped per output frame
+	int _down_phase;	// Remainder of the step, in fractions of up
+	pool::Vector<float> _buffer;
+	pool::Vector<float> _blended;
+	pool::Vector<float> _frame;
+
+	// In frames of _buffer, the first frame under the filter.
+	int _position;
+	int _phase;
+	int _buffered;
+	int _input_end;
+	bool _is_input_done;
+};
+
+/*
+ * Converts a source to another sample rate. See Resampler.
+*/
+class SampleRateConverter : public Source {
+public:
+
+	SampleRateConverter(std::unique_ptr<Source> input, int to_sample_rate, ResampleQuality quality = ResampleQuality::Balanced)
+		: _input(std::move(input))
+		, _channels(_input->channel_count())
+		, _to_sample_rate(to_sample_rate)
+		, _reader(_channels)
+	{
+		if (_input->sample_rate() != to_sample_rate) {
+			_resampler.emplace(_channels, _input->sample_rate(), to_sample_rate, quality);
 		}
+	}
 
-		if (_next_frame_idx == _to) {
-			_next_frame_idx = 0;
+	int channel_count() const override {
+		return _channels;
+	}
 
-			do {
-				_next_input_frame();
-			} while (_current_frame_idx != _from);
+	int sample_rate() const override {
+		return _to_sample_rate;
+	}
 
-			_current_frame_idx = 0;
-		} else {
-			auto left_sample_idx = (_from * _next_frame_idx / _to) % _from;
-			while (_current_frame_idx != left_sample_idx) {
-				_next_input_frame();
-			}
+	std::optional<double> next_sample() override {
+		if (!_resampler) {
+			return _input->next_sample();
 		}
 
-		std::optional<double> result;
-		auto lerp_factor = (double)((_from * _next_frame_idx) % _to) / _to;
-		for (int i = 0; i < std::min(_current_frame.size(), _next_frame.size()); ++i) {
-			auto cur_sample = _current_frame[i];
-			auto next_sample = _next_frame[i];
-			auto sample = cur_sample * (1.0f - lerp_factor) + next_sample * lerp_factor;
-
-			if (i == 0) {
-				result = sample;
-			} else {
-				_output_buffer.push_back(sample);
-			}
+		return _reader.next_sample(*this);
+	}
+
+	int fill(float* out, int frames) override {
+		if (!_resampler) {
+			return _input->fill(out, frames);
 		}
 
-		_next_frame_idx += 1;
+		auto channels = _channels;
+		return _resampler->process(*_input, frames, [&out, channels](float const* frame) {
+			out = std::copy_n(frame, channels, out);
+		});
+	}
 
-		if (result) {
-			return result;
-		} else {
-			if (!_current_frame.empty()) {
-				auto r = _current_frame[0];
-				_current_frame.erase(_current_frame.begin());
-				std::swap(_output_buffer, _current_frame);
-				_current_frame.clear();
-				return r;
-			}
+	int64_t skip(int64_t frames) override {
+		if (!_resampler) {
+			return _input->skip(frames);
 		}
 
-		return {};
+		return Source::skip(frames);
 	}
 
 	std::optional<std::chrono::nanoseconds> total_duration() const override {
 		return _input->total_duration();
 	}
 
-private:
-
-	void _next_input_frame() {
-		_current_frame_idx += 1;
-		std::swap(_current_frame, _next_frame);
-		_next_frame.clear();
-
-		for (int i = 0; i < _channels; ++i) {
-			if (auto sample = _input->next_sample()) {
-				_next_frame.push_back(*sample);
-			} else {
-				break;
-			}
-		}
+	int64_t silent_frames() const override {
+		// A resampler's filter still rings with the frames before the silence.
+		return _resampler ? 0 : _input->silent_frames();
 	}
 
 private:
 
 	std::unique_ptr<Source> _input;
-	int _from;
-	int _to;
+	std::optional<Resampler> _resampler;	// None when the rates already match
 	int _channels;
-	std::vector<double> _current_frame;
-	std::vector<double> _next_frame;
-	std::vector<double> _output_buffer;
-
-	int _current_frame_idx;
-	int _next_frame_idx;
+	int _to_sample_rate;
+	FrameSampleReader _reader;
 };
 
+/*
+ * Converts a source to the channel count and sample rate of the mix, resampling and mapping
+ * channels in a single pass over each frame. Whichever of the two is not needed is skipped,
+ * and a source that already matches is passed straight through.
+*/
 class Converter : public Source {
 public:
 
-	Converter(std::unique_ptr<Source> input, int channels, int sample_rate)
-		: _input(std::make_unique<SampleRateConverter>(std::move(input), sample_rate), channels)
-	{}
+	Converter(std::unique_ptr<Source> input, int channels, int sample_rate, ResampleQuality quality = ResampleQuality::Balanced)
+		: _input(std::move(input))
+		, _matrix(_input->channel_count(), channels)
+		, _sample_rate(sample_rate)
+		, _reader(channels)
+	{
+		if (_input->sample_rate() != sample_rate) {
+			// Resampled before mapping, so a mono source is only resampled once.
+			_resampler.emplace(_input->channel_count(), _input->sample_rate(), sample_rate, quality);
+		}
+	}
 
 	int channel_count() const override {
-		return _input.channel_count();
+		return _matrix.to_channels();
 	}
 
 	int sample_rate() const override {
-		return _input.sample_rate();
+		return _sample_rate;
 	}
 
 	std::optional<double> next_sample() override {
-		return _input.next_sample();
+		if (!_resampler && _matrix.is_identity()) {
+			return _input->next_sample();
+		}
+
+		return _reader.next_sample(*this);
+	}
+
+	int fill(float* out, int frames) override {
+		if (_resampler) {
+			auto& matrix = _matrix;
+			auto channels = matrix.to_channels();
+			return _resampler->process(*_input, frames, [&out, &matrix, channels](float const* frame) {
+				matrix.apply(frame, out, 1);
+				out += channels;
+			});
+		}
+
+		if (_matrix.is_identity()) {
+			return _input->fill(out, frames);
+		}
+
+		// Mapped in chunks through the stack so that no voice needs its own buffer.
+		float input_buffer[1024];
+		auto from = _matrix.from_channels();
+		auto chunk_frames = std::max(1, (int)(sizeof(input_buffer) / sizeof(float)) / from);
+		int written = 0;
+
+		while (written < frames) {
+			auto count = std::min(chunk_frames, frames - written);
+			auto produced = _input->fill(input_buffer, count);
+			_matrix.apply(input_buffer, out + written * _matrix.to_channels(), produced);
+			written += produced;
+
+			if (produced < count) {
+				break;
+			}
+		}
+
+		return written;
+	}
+
+	int64_t skip(int64_t frames) override {
+		// Frames are skipped the same whatever channels they would be mapped to.
+		if (!_resampler) {
+			return _input->skip(frames);
+		}
+
+		return Source::skip(frames);
 	}
 
 	std::optional<std::chrono::nanoseconds> total_duration() const override {
-		return _input.total_duration();
+		return _input->total_duration();
+	}
+
+	int64_t silent_frames() const override {
+		// A resampler's filter still rings with the frames before the silence.
+		return _resampler ? 0 : _input->silent_frames();
 	}
 
 private:
 
-	ChannelConverter _input;
-};
\ No newline at end of file
+	std::unique_ptr<Source> _input;
+	ChannelMatrix _matrix;
+	std::optional<Resampler> _resampler;	// None when the rates already match
+	int _sample_rate;
+	FrameSampleReader _reader;
+};
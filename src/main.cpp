@@ -1,126 +1,175 @@
 #include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <limits.h>
+#include <cmath>
 #include <thread>
+#include <chrono>
 #include <fstream>
 #include <tuple>
 #include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "audio.h"
 #include "source.h"
-#include "source_builder.h"
-#include "mixer.h"
-#include "note.h"
-#include "oscillators.h"
 #include "music.h"
+#include "render.h"
 #include "wave_importer.h"
-
-#include "concurrentqueue.h"
-
-struct ConcurrentQueueTraits : public moodycamel::ConcurrentQueueDefaultTraits {
-	static constexpr size_t BLOCK_SIZE = 512;
-};
+#include "stem_cache.h"
+#include "benchmark.h"
 
 void log_error(char const* msg) {
 	fprintf(stderr, "[ERROR] %s\n", msg);
 }
 
-using SourcePtr = std::unique_ptr<Source>;
-
-static std::optional<SourcePtr> create_source_from_note_event(
-	NoteEvent const& event,
-	Instrument const& instrument,
-	double gain,
-	int resolution_per_beat,
-	int bpm,
-	std::filesystem::path const& music_base_path
-) {
-	auto freq = event.note.freq();
-	auto adsr = instrument.adsr();
-
-	// Need to allow time for adsr release to have effect.
-	auto duration_seconds = music::map_resolution_to_seconds(event.end - event.start, resolution_per_beat, bpm) + adsr.release;
-	SourcePtr source;
-	
-	if (auto wave = std::get_if<InstrumentSourceWave>(&instrument.source())) {
-		switch (*wave) {
-			default:
-			case InstrumentSourceWave::Sine:
-				source = std::make_unique<SineWave>(freq);
-			break;
-			case InstrumentSourceWave::Triangle:
-				source = std::make_unique<TriangleWave>(freq);
-			break;
-			case InstrumentSourceWave::Square:
-				source = std::make_unique<SquareWave>(freq);
-			break;
-			case InstrumentSourceWave::Saw:
-				source = std::make_unique<SawWave>(freq);
-			break;
-			case InstrumentSourceWave::Piano:
-				source = std::make_unique<PianoWave>(freq);
-			break;
-			case InstrumentSourceWave::Violin:
-				source = std::make_unique<ViolinWave>(freq);
-			break;
-		}
-
-		source = SourceBuilder(std::move(source))
-			.duration(std::chrono::microseconds((int64_t)(duration_seconds * 1e6)))
-			.filter([adsr](double sample, FilterInfo info) {
-				auto total_samples = *info.get_total_samples();
-				auto release_sample_start = total_samples - (int)(adsr.release * info.sample_rate);
-				
-				auto is_release = info.current_sample >= release_sample_start;
-				
-				double value;
-				if (is_release) {
-					auto elapsed_release = (double)(info.current_sample - release_sample_start) / info.sample_rate;
-					auto elapsed = (double)release_sample_start / info.sample_rate;
-					value = adsr.evaluate(elapsed, elapsed_release);
-				} else {
-					auto elapsed = (double)info.current_sample / info.sample_rate;
-					value = adsr.evaluate(elapsed, std::nullopt);
-				}
-				return sample * value;
-			})
-			.build();
-	} else if (auto sample = std::get_if<InstrumentSourceSample>(&instrument.source())) {
-		auto path = (music_base_path / sample->filename);
-		auto file_opt = WaveFile::read(path.string());
-		if (!file_opt) {
-			fprintf(stderr, "[ERROR] Could not find sample at '%ws'\n", path.c_str());
-			return std::nullopt;
-		}
-
-		source = std::make_unique<WaveFile>(std::move(*file_opt));
-		source = SourceBuilder(std::move(source)).buffered(4096).build();
-	}
-
-	source = SourceBuilder(std::move(source))
-		.amplify(gain)
-		.build();
-
-	return source;
-}
-
 struct CommandLineArgs {
 	std::optional<char const*> music_filename;
 	std::optional<char const*> export_filename;
+	std::optional<int> thread_count;
+	bool cache_patterns = false;
+	bool watch = false;
+	bool bench = false;
+	bool metrics = false;
+	std::optional<char const*> cache_directory;
+	std::optional<char const*> stems_directory;
+	std::optional<char const*> compiled_filename;
+	std::optional<char const*> start_position;
+	std::optional<char const*> end_position;
+	int voice_limit = 0;
+	audio::DeviceOptions device_options;
+
+	// What the export and its stems are written as.
+	int export_bits = 16;
+	int16_t export_format = wave::FORMAT_PCM;
+	bool dither = false;
+
+	// Plays back on the null device rather than the platform's default one when set.
+	std::optional<audio::NullDeviceOptions> null_device;
+	std::optional<char const*> capture_filename;
 };
 
 CommandLineArgs parse_command_args(int argc, char** argv) {
 	CommandLineArgs command_args;
 
 	bool export_opt = false;
+	bool threads_opt = false;
+	bool period_opt = false;
+	bool cache_dir_opt = false;
+	bool stems_opt = false;
+	bool compiled_opt = false;
+	bool start_opt = false;
+	bool end_opt = false;
+	bool polyphony_opt = false;
+	bool null_device_opt = false;
+	bool capture_opt = false;
+	bool format_opt = false;
 	for (int i = 1; i < argc; ++i) {
 		char* arg = argv[i];
 		if (strcmp(arg, "-e") == 0) {
 			export_opt = true;
+		} else if (strcmp(arg, "-j") == 0) {
+			threads_opt = true;
+		} else if (strcmp(arg, "--stems") == 0) {
+			stems_opt = true;
+		} else if (strcmp(arg, "--start") == 0) {
+			start_opt = true;
+		} else if (strcmp(arg, "--end") == 0) {
+			end_opt = true;
+		} else if (strcmp(arg, "--export-compiled") == 0) {
+			compiled_opt = true;
+		} else if (strcmp(arg, "--cache-dir") == 0) {
+			cache_dir_opt = true;
+		} else if (strcmp(arg, "--cache-patterns") == 0) {
+			command_args.cache_patterns = true;
+		} else if (strcmp(arg, "--watch") == 0) {
+			command_args.watch = true;
+		} else if (strcmp(arg, "--bench") == 0) {
+			command_args.bench = true;
+		} else if (strcmp(arg, "--metrics") == 0) {
+			command_args.metrics = true;
+		} else if (strcmp(arg, "--exclusive") == 0) {
+			command_args.device_options.exclusive = true;
+		} else if (strcmp(arg, "--period") == 0) {
+			period_opt = true;
+		} else if (strcmp(arg, "--polyphony") == 0) {
+			polyphony_opt = true;
+		} else if (strcmp(arg, "--null-device") == 0) {
+			null_device_opt = true;
+		} else if (strcmp(arg, "--capture") == 0) {
+			capture_opt = true;
+		} else if (strcmp(arg, "--format") == 0) {
+			format_opt = true;
+		} else if (strcmp(arg, "--dither") == 0) {
+			command_args.dither = true;
 		} else {
 			if (export_opt) {
 				command_args.export_filename = arg;
 				export_opt = false;
+			} else if (threads_opt) {
+				auto count = atoi(arg);
+				if (count > 0) {
+					command_args.thread_count = count;
+				} else {
+					fprintf(stdout, "Invalid thread count '%s', defaulting to all cores\n", arg);
+				}
+				threads_opt = false;
+			} else if (stems_opt) {
+				command_args.stems_directory = arg;
+				stems_opt = false;
+			} else if (start_opt) {
+				command_args.start_position = arg;
+				start_opt = false;
+			} else if (end_opt) {
+				command_args.end_position = arg;
+				end_opt = false;
+			} else if (compiled_opt) {
+				command_args.compiled_filename = arg;
+				compiled_opt = false;
+			} else if (cache_dir_opt) {
+				command_args.cache_directory = arg;
+				cache_dir_opt = false;
+			} else if (polyphony_opt) {
+				auto limit = atoi(arg);
+				if (limit > 0) {
+					command_args.voice_limit = limit;
+				} else {
+					fprintf(stdout, "Invalid polyphony '%s', defaulting to no limit\n", arg);
+				}
+				polyphony_opt = false;
+			} else if (null_device_opt) {
+				auto speed = atof(arg);
+				if (speed > 0.0) {
+					command_args.null_device.emplace().speed = speed;
+				} else {
+					fprintf(stdout, "Invalid null device speed '%s', defaulting to the audio device\n", arg);
+				}
+				null_device_opt = false;
+			} else if (capture_opt) {
+				command_args.capture_filename = arg;
+				capture_opt = false;
+			} else if (format_opt) {
+				if (strcmp(arg, "float") == 0) {
+					command_args.export_bits = 32;
+					command_args.export_format = wave::FORMAT_FLOAT;
+				} else if (strcmp(arg, "16") == 0 || strcmp(arg, "24") == 0 || strcmp(arg, "32") == 0) {
+					command_args.export_bits = atoi(arg);
+				} else {
+					fprintf(stdout, "Invalid format '%s', defaulting to 16-bit\n", arg);
+				}
+				format_opt = false;
+			} else if (period_opt) {
+				auto period_ms = atof(arg);
+				if (period_ms > 0.0) {
+					command_args.device_options.period = std::chrono::microseconds((int64_t)(period_ms * 1000.0));
+				} else {
+					fprintf(stdout, "Invalid period '%s', defaulting to the device's period\n", arg);
+				}
+				period_opt = false;
 			} else {
 				command_args.music_filename = arg;
 			}
@@ -131,71 +180,302 @@ CommandLineArgs parse_command_args(int argc, char** argv) {
 		fprintf(stdout, "Export was specified without a path, defaulting to playback\n");
 	}
 
+	if (threads_opt) {
+		fprintf(stdout, "Thread count was specified without a value, defaulting to all cores\n");
+	}
+
+	if (period_opt) {
+		fprintf(stdout, "Period was specified without a value, defaulting to the device's period\n");
+	}
+
+	if (polyphony_opt) {
+		fprintf(stdout, "Polyphony was specified without a value, defaulting to no limit\n");
+	}
+
+	if (command_args.voice_limit > 0 && command_args.export_filename) {
+		fprintf(stdout, "Polyphony across tracks only limits playback, exporting with each track's own\n");
+	}
+
+	if (null_device_opt) {
+		fprintf(stdout, "Null device was specified without a speed, defaulting to the audio device\n");
+	}
+
+	if (capture_opt) {
+		fprintf(stdout, "Capture was specified without a path, discarding what the null device plays\n");
+	}
+
+	if (command_args.capture_filename) {
+		if (command_args.null_device) {
+			command_args.null_device->capture_path = *command_args.capture_filename;
+		} else {
+			fprintf(stdout, "Capture is only written by the null device, playing back as usual\n");
+		}
+	}
+
+	if (command_args.null_device && command_args.export_filename) {
+		fprintf(stdout, "The null device is only used for playback, exporting as usual\n");
+	}
+
+	if (format_opt) {
+		fprintf(stdout, "Format was specified without a value, defaulting to 16-bit\n");
+	}
+
+	if (command_args.dither && command_args.export_format == wave::FORMAT_FLOAT) {
+		fprintf(stdout, "Dither only applies to PCM, exporting floats as is\n");
+	}
+
+	if ((command_args.export_bits != 16 || command_args.export_format != wave::FORMAT_PCM || command_args.dither) && !command_args.export_filename) {
+		fprintf(stdout, "Format and dither are only used when exporting\n");
+	}
+
+	if (stems_opt) {
+		fprintf(stdout, "Stems were specified without a directory, only exporting the master\n");
+	}
+
+	if (command_args.stems_directory && !command_args.export_filename) {
+		fprintf(stdout, "Stems are only written when exporting, defaulting to playback\n");
+	}
+
+	if (start_opt) {
+		fprintf(stdout, "Start was specified without a position, starting from the beginning\n");
+	}
+
+	if (end_opt) {
+		fprintf(stdout, "End was specified without a position, stopping at the end of the song\n");
+	}
+
+	if (compiled_opt) {
+		fprintf(stdout, "Compiled export was specified without a path, defaulting to playback\n");
+	}
+
+	if (command_args.watch && command_args.export_filename) {
+		fprintf(stdout, "Watching is only done during playback, exporting once\n");
+	}
+
+	if (command_args.metrics && command_args.export_filename) {
+		fprintf(stdout, "Metrics are only reported during playback\n");
+	}
+
+	if (cache_dir_opt) {
+		fprintf(stdout, "Cache directory was specified without a path, rendering every track\n");
+	}
+
 	return command_args;
 }
 
-using Queue = moodycamel::ConcurrentQueue<float, ConcurrentQueueTraits>;
+/*
+ * @brief Gets the name of the file a track's stem is written to, without its extension.
+ * Characters that can't be part of a file name are replaced.
+*/
+std::string get_stem_name(std::string_view track_name) {
+	std::string filename(track_name);
+	for (auto& c : filename) {
+		if (strchr("<>:\"/\\|?*", c) || (unsigned char)c < 0x20) {
+			c = '_';
+		}
+	}
+
+	return filename;
+}
+
+/*
+ * @brief Gets the file each track's stem is written to, named after the track. Names that end up
+ * the same once replaced, or only differ by case, get the track's number appended so no two stems
+ * are written to the same file.
+ * @return None if the names still collide, an error is logged in that case.
+*/
+std::optional<std::vector<std::filesystem::path>> get_stem_paths(std::filesystem::path const& directory, std::vector<Track> const& tracks) {
+	// Case insensitive file systems would still open the same file for names differing by case.
+	auto get_key = [](std::string name) {
+		for (auto& c : name) {
+			c = (char)tolower((unsigned char)c);
+		}
+		return name;
+	};
+
+	std::vector<std::string> names;
+	std::unordered_map<std::string, int> name_counts;
+	for (auto& track : tracks) {
+		names.push_back(get_stem_name(track.name()));
+		name_counts[get_key(names.back())] += 1;
+	}
+
+	std::unordered_set<std::string> keys;
+	std::vector<std::filesystem::path> paths;
+	for (int i = 0; i < (int)tracks.size(); ++i) {
+		if (name_counts[get_key(names[i])] > 1) {
+			names[i] += " (" + std::to_string(i + 1) + ")";
+		}
+
+		if (!keys.insert(get_key(names[i])).second) {
+			fprintf(stderr, "[ERROR] Track '%.*s' would write to the same stem file '%s.wav' as another track, rename it\n", (int)tracks[i].name().size(), tracks[i].name().data(), names[i].c_str());
+			return std::nullopt;
+		}
+
+		paths.push_back(directory / (names[i] + ".wav"));
+	}
+
+	return paths;
+}
+
+/*
+ * @brief Loads a song from a YAML file or a compiled song, which are told apart by their contents.
+ * @return None if the song could not be loaded, an error is logged in that case.
+*/
+std::optional<Music> load_music(std::filesystem::path const& music_filename) {
+	auto res = Music::is_compiled(music_filename.string())
+		? Music::load_compiled(music_filename.string())
+		: Music::import(music_filename.string());
+
+	if (auto e = std::get_if<MusicError>(&res)) {
+		if (auto e2 = std::get_if<MusicErrorParse>(e)) {
+			log_error(e2->msg.c_str());
+		} else if (auto e2 = std::get_if<MusicErrorFile>(e)) {
+			log_error(e2->msg.c_str());
+		}
+		return std::nullopt;
+	}
+
+	return std::get<0>(std::move(res));
+}
 
-std::tuple<audio::Device, std::shared_ptr<Queue>> play_on_device() {
-	auto instance = audio::Instance();
-	auto device = *instance.get_default_output_device();
+/*
+ * @brief Finds the frame a position in the song lands on. Positions are either BAR or BAR:BEAT,
+ * both counting from 1 and following the song's time signature, or SECONDS followed by 's'.
+ * @return None if the position is malformed or past what a frame can be.
+*/
+std::optional<uint64_t> parse_song_position(char const* arg, Music const& music, int sample_rate) {
+	// strtod also takes "nan" and "inf", which can't be rounded to a frame.
+	char* end;
+	auto value = strtod(arg, &end);
+	if (end == arg || !std::isfinite(value) || value < 0.0) {
+		return std::nullopt;
+	}
 
-	auto& sample_rates = device.available_sample_rates();
+	if (strcmp(end, "s") == 0) {
+		// Also past what a frame count holds.
+		auto frame = value * sample_rate;
+		if (frame >= (double)INT64_MAX) {
+			return std::nullopt;
+		}
+
+		return (uint64_t)llround(frame);
+	}
+
+	auto bar = value;
+	auto beat = 1.0;
+	if (*end == ':') {
+		auto beat_arg = end + 1;
+		beat = strtod(beat_arg, &end);
+		if (end == beat_arg || !std::isfinite(beat)) {
+			return std::nullopt;
+		}
+	}
+
+	if (*end != '\0' || bar < 1.0 || beat < 1.0) {
+		return std::nullopt;
+	}
+
+	auto beats = (bar - 1.0) * music.get_time_signature().beats_per_bar + (beat - 1.0);
+	if (beats * Music::get_resolution_per_beat() >= (double)INT_MAX) {
+		return std::nullopt;
+	}
+
+	auto resolution = (int)llround(beats * Music::get_resolution_per_beat());
+	return (uint64_t)music::map_resolution_to_frames(resolution, Music::get_resolution_per_beat(), music.get_bpm(), sample_rate);
+}
+
+/*
+ * @brief Gets the frames of the song to play or export, from --start and --end.
+ * @return None if either position is malformed, an error is logged in that case.
+*/
+std::optional<std::tuple<uint64_t, uint64_t>> get_song_range(CommandLineArgs const& command_args, Music const& music, int sample_rate) {
+	uint64_t start_frame = 0;
+	uint64_t end_frame = UINT64_MAX;
+
+	if (command_args.start_position) {
+		auto frame = parse_song_position(*command_args.start_position, music, sample_rate);
+		if (!frame) {
+			fprintf(stderr, "[ERROR] Invalid start '%s', expected BAR, BAR:BEAT or SECONDSs\n", *command_args.start_position);
+			return std::nullopt;
+		}
+		start_frame = *frame;
+	}
+
+	if (command_args.end_position) {
+		auto frame = parse_song_position(*command_args.end_position, music, sample_rate);
+		if (!frame) {
+			fprintf(stderr, "[ERROR] Invalid end '%s', expected BAR, BAR:BEAT or SECONDSs\n", *command_args.end_position);
+			return std::nullopt;
+		}
+		end_frame = *frame;
+	}
+
+	if (end_frame <= start_frame) {
+		log_error("The end must come after the start");
+		return std::nullopt;
+	}
+
+	return std::make_tuple(start_frame, end_frame);
+}
+
+std::optional<std::filesystem::file_time_type> get_write_time(std::filesystem::path const& path) {
+	std::error_code ec;
+	auto time = std::filesystem::last_write_time(path, ec);
+	if (ec) {
+		return std::nullopt;
+	}
+
+	return time;
+}
+
+/*
+ * @brief Prints how playback has held up so far to stderr, as a single line of JSON.
+*/
+void print_metrics(audio::Device const& device, render::LivePlayer const& player, std::chrono::duration<double> elapsed) {
+	auto device_metrics = device.metrics();
+	auto player_metrics = player.metrics();
+
+	fprintf(stderr, "{\"elapsed_s\":%.1f,\"callbacks\":", elapsed.count());
+	metrics::write_json(stderr, device_metrics.callbacks);
+	fprintf(stderr, ",\"underruns\":%llu,\"blocks\":", (unsigned long long)device_metrics.underrun_count);
+	metrics::write_json(stderr, player_metrics.blocks);
+	fprintf(
+		stderr,
+		",\"voices\":%d,\"peak_voices\":%d,\"queued_voices\":%zu,\"late_voices\":%llu,\"stolen_voices\":%llu}\n",
+		player_metrics.voice_count,
+		player_metrics.peak_voice_count,
+		player_metrics.queued_voice_count,
+		(unsigned long long)player_metrics.late_voice_count,
+		(unsigned long long)player_metrics.stolen_voice_count
+	);
+}
+
+std::optional<audio::Device> open_device(audio::Instance const& instance, audio::DeviceOptions options) {
+	auto device = instance.get_default_output_device();
+	if (!device) {
+		return std::nullopt;
+	}
+
+	auto& sample_rates = device->available_sample_rates();
 	int sample_rate = 48000;
 	auto sample_rate_it = std::lower_bound(sample_rates.begin(), sample_rates.end(), sample_rate);
 	sample_rate = sample_rate_it == sample_rates.end() ? sample_rates.back() : *sample_rate_it;
 	
-	device.open(sample_rate);
-
-	auto buffer_size = device.buffer_size();
-	auto channel_count = device.channel_count();
-	auto frame_count = buffer_size*channel_count;
-	sample_rate = device.sample_rate();
-
-	// We give queue double the frame count to give the sending thread a margin
-	// to prevent the audio thread from dequeuing an empty queue.
-	auto queue = std::make_shared<Queue>(frame_count * 2);
-
-	// Buffer for audio thread to deque samples in bulk.
-	std::vector<float> samples_buffer(frame_count, 0.0f);
-
-	// Holds how many samples of the next audio buffer should we zero out
-	// due to an empty queue.
-	int empty_overlap_count = 0;
-
-	device.start([=](float* data, int channel_count, int sample_count) mutable {
-		auto samples_remaining = channel_count * sample_count;
-
-		if (empty_overlap_count > 0 && empty_overlap_count <= samples_remaining) {
-			memset(data, 0, sizeof(float) * empty_overlap_count);
-			data += empty_overlap_count;
-			samples_remaining -= empty_overlap_count;
-			empty_overlap_count = 0;
-		}
-		
-		while (samples_remaining > 0) {
-			auto count = (int)queue->try_dequeue_bulk(samples_buffer.data(), samples_remaining);
-			if (count > 0) {
-				data = std::copy_n(samples_buffer.begin(), count, data);
-			} else {
-				// When the queue is empty, we need to zero out channel_count samples
-				// so that the next enqueue will be at a sample corresponding to the
-				// correct channel. If the samples_remaining is less than channel_count,
-				// then the zeroing needs to also occur in the next audio buffer, so we
-				// keep track of that as well.
-				if (samples_remaining < channel_count) {
-					empty_overlap_count = channel_count - samples_remaining;
-				}
-
-				count = std::min(samples_remaining, channel_count);
-				memset(data, 0, sizeof(float) * count);
-			}
+	if (!device->open(sample_rate, options)) {
+		if (!options.exclusive) {
+			return std::nullopt;
+		}
 
-			samples_remaining -= count;
+		// Another program may hold the device, or it may not support the sample rate.
+		fprintf(stdout, "Could not open the device in exclusive mode, defaulting to shared mode\n");
+		options.exclusive = false;
+		if (!device->open(sample_rate, options)) {
+			return std::nullopt;
 		}
-	});
+	}
 
-	return { std::move(device), queue };
+	return device;
 }
 
 int main(int argc, char** argv) {
@@ -213,137 +493,385 @@ int main(int argc, char** argv) {
 	auto music_filename = std::filesystem::path(*command_args.music_filename);
 	auto music_base_path = music_filename.parent_path();
 
-	auto res = Music::import(music_filename.string());
+	int thread_count = command_args.thread_count.value_or((int)std::max(1u, std::thread::hardware_concurrency()));
 
-	if (auto e = std::get_if<MusicError>(&res)) {
-		if (auto e2 = std::get_if<MusicErrorParse>(e)) {
-			log_error(e2->msg.c_str());
-		} else if (auto e2 = std::get_if<MusicErrorFile>(e)) {
-			log_error(e2->msg.c_str());
-		}
+	// Only measurements go to stdout, so they can be read by other programs.
+	if (command_args.bench) {
+		constexpr int BENCH_RUNS = 3;
+		return benchmark::run_song(music_filename, { thread_count, command_args.cache_patterns, BENCH_RUNS }) ? 0 : 1;
+	}
+
+	auto music_write_time = get_write_time(music_filename);
+	auto music_opt = load_music(music_filename);
+	if (!music_opt) {
 		return 1;
 	}
 
-	auto music = std::get<0>(std::move(res));
+	auto music = std::move(*music_opt);
 	auto gain = music.get_gain();
-	auto& tracks = music.get_tracks();
-	auto& instruments = music.get_instruments();
-	auto& patterns = music.get_patterns();
-	auto bpm = music.get_bpm();
-	auto time_signature = music.get_time_signature();
-
-	std::vector<std::tuple<int, SourcePtr>> sources;
-
-	for (auto& track : tracks) {
-		auto& instrument = instruments[track.instrument_idx()];
-		for (auto& track_event : track.events()) {
-			auto& pattern = patterns[track_event.pattern_idx];
-			for (auto& note_event : pattern.events()) {
-				auto moved_note_event = note_event.move(track_event.start);
-				auto source_opt = create_source_from_note_event(
-					moved_note_event,
-					instrument,
-					track.gain(),
-					Music::get_resolution_per_beat(),
-					bpm,
-					music_base_path
-				);
 
-				if (!source_opt) {
-					return 1;
-				}
-				
-				sources.push_back(std::make_tuple(
-					moved_note_event.start,
-					std::move(*source_opt)
-				));
+	if (command_args.compiled_filename) {
+		auto compile_res = music.export_compiled(*command_args.compiled_filename, music_base_path);
+		if (auto e = std::get_if<MusicError>(&compile_res)) {
+			if (auto e2 = std::get_if<MusicErrorParse>(e)) {
+				log_error(e2->msg.c_str());
+			} else if (auto e2 = std::get_if<MusicErrorFile>(e)) {
+				log_error(e2->msg.c_str());
 			}
+			return 1;
 		}
-	}
 
-	// Sort in descending order of starting resolution times.
-	std::sort(sources.begin(), sources.end(), [](auto& lhs, auto& rhs) {
-		return std::get<0>(lhs) > std::get<0>(rhs);
-	});
+		fprintf(stdout, "Compiled to %s\n", *command_args.compiled_filename);
+		fprintf(stdout, "Done :)\n");
+		return 0;
+	}
 
-	std::optional<audio::Device> device;
+	auto& tracks = music.get_tracks();
 
 	// Default values when exporting
 	int channel_count = 2;
 	int sample_rate = 48000;
 
-	// When exporting, we need to store all samples generated
-	std::vector<float> export_samples;
-
-	// Depends on whether we are exporting or playing back.
-	std::function<bool(float)> enqueue;
+	std::vector<float> block;
 
 	if (!command_args.export_filename) {
-		auto [device_, queue_] = play_on_device();
-		// Cannot captures binded structs
-		auto queue = std::move(queue_);
-		device = std::move(device_);
+		auto instance = command_args.null_device ? audio::Instance(*command_args.null_device) : audio::Instance();
+		auto device = open_device(instance, command_args.device_options);
+		if (!device) {
+			log_error("No audio device to play back on");
+			return 1;
+		}
 
-		fprintf(stdout, "Playing back on %s\n", device->name().data());
+		fprintf(stdout, "Playing back on %s (%.1f ms latency)\n", device->name().data(), device->latency().count() / 1000.0);
 
 		channel_count = device->channel_count();
 		sample_rate = device->sample_rate();
 
-		enqueue = [=](float sample) {
-			return queue->try_enqueue(sample);
-		};
-	} else {
-		fprintf(stdout, "Exporting to %s\n", *command_args.export_filename);
+		auto range = get_song_range(command_args, music, sample_rate);
+		if (!range) {
+			return 1;
+		}
 
-		auto seconds = music::map_resolution_to_seconds(std::get<0>(sources[0]), Music::get_resolution_per_beat(), bpm);
-		auto sample_count = (size_t)(seconds * sample_rate);
-		export_samples.reserve(sample_count);
+		auto [start_frame, end_frame] = *range;
 
-		enqueue = [&](float sample) {
-			export_samples.push_back(sample);
-			return true;
-		};
-	}
+		auto samples = std::make_shared<SampleCache>(sample_rate);
+		if (!render::load_samples(music, music_base_path, *samples)) {
+			return 1;
+		}
+
+		// Live playback goes through a single mixer holding every source.
+		auto player = std::make_shared<render::LivePlayer>(
+			music,
+			NoteScheduler::all_tracks(music),
+			music_base_path,
+			samples,
+			channel_count,
+			sample_rate,
+			gain,
+			start_frame,
+			end_frame,
+			command_args.voice_limit
+		);
 
-	auto [mixer, mixer_controller] = Mixer::create_mixer(channel_count, sample_rate);
-	auto output = SourceBuilder(std::move(mixer)).amplify(gain).buffered(1024).build();
+		// Notes are created this far ahead of the audio thread, which must cover how long
+		// this thread sleeps between scheduling.
+		constexpr auto SCHEDULE_AHEAD = std::chrono::milliseconds(100);
+		constexpr auto SCHEDULE_INTERVAL = std::chrono::milliseconds(10);
+		auto schedule_ahead_frames = (uint64_t)(sample_rate * std::chrono::duration<double>(SCHEDULE_AHEAD).count());
 
-	double time = 0.0;
-	double dt = 1.0 / (sample_rate * channel_count);
+		// A null device playing faster than real time gets through that many more frames in
+		// the same time. Speeds the scheduler can't keep up with show as late voices.
+		if (command_args.null_device && command_args.null_device->speed > 1.0) {
+			schedule_ahead_frames = (uint64_t)(schedule_ahead_frames * command_args.null_device->speed);
+		}
 
-	while (true) {
-		auto sample_opt = output->next_sample();
+		player->schedule(schedule_ahead_frames);
 
-		auto sample = 0.0;
-		if (sample_opt) {
-			sample = *sample_opt;
-			sample = tanh(sample);
-		} else {
-			if (sources.empty()) {
+		// The mix is rendered straight into the device's buffer.
+		device->start([player](float* data, int, int sample_count) {
+			player->render(data, sample_count);
+		});
+
+		if (command_args.watch) {
+			fprintf(stdout, "Watching %s for changes, press Ctrl+C to stop\n", music_filename.string().c_str());
+		}
+
+		constexpr auto METRICS_INTERVAL = std::chrono::seconds(1);
+		auto playback_start = std::chrono::steady_clock::now();
+		auto last_metrics = playback_start;
+
+		// The latest version of the song when watching, which the player plays from.
+		std::unique_ptr<Music> watched_music;
+		constexpr auto WATCH_INTERVAL = std::chrono::milliseconds(250);
+		auto last_watch = std::chrono::steady_clock::now();
+
+		// Watching carries on past the end of the song, so that it plays again once edited.
+		while (command_args.watch || !player->is_finished()) {
+			// The player would never finish once the device stops calling back.
+			if (device->has_failed()) {
 				break;
 			}
+
+			player->schedule(schedule_ahead_frames);
+			std::this_thread::sleep_for(SCHEDULE_INTERVAL);
+
+			if (command_args.metrics && std::chrono::steady_clock::now() - last_metrics >= METRICS_INTERVAL) {
+				last_metrics = std::chrono::steady_clock::now();
+				print_metrics(*device, *player, last_metrics - playback_start);
+			}
+
+			if (!command_args.watch || std::chrono::steady_clock::now() - last_watch < WATCH_INTERVAL) {
+				continue;
+			}
+
+			last_watch = std::chrono::steady_clock::now();
+
+			auto write_time = get_write_time(music_filename);
+			if (!write_time || write_time == music_write_time) {
+				continue;
+			}
+
+			music_write_time = write_time;
+
+			// A broken edit keeps the current version playing until it is fixed.
+			auto reloaded = load_music(music_filename);
+			if (!reloaded || !render::load_samples(*reloaded, music_base_path, *samples)) {
+				continue;
+			}
+
+			auto& current = watched_music ? *watched_music : music;
+			auto& reloaded_tracks = reloaded->get_tracks();
+			int changed_count = 0;
+			for (int i = 0; i < (int)reloaded_tracks.size(); ++i) {
+				if (music::is_track_changed(current, *reloaded, i)) {
+					fprintf(stdout, "Track '%.*s' changed\n", (int)reloaded_tracks[i].name().size(), reloaded_tracks[i].name().data());
+					changed_count += 1;
+				}
+			}
+
+			int removed_count = 0;
+			for (auto& track : current.get_tracks()) {
+				auto is_removed = std::none_of(reloaded_tracks.begin(), reloaded_tracks.end(), [&](Track const& other) {
+					return other.name() == track.name();
+				});
+				if (is_removed) {
+					fprintf(stdout, "Track '%.*s' removed\n", (int)track.name().size(), track.name().data());
+					removed_count += 1;
+				}
+			}
+
+			if (changed_count == 0 && removed_count == 0 && current.get_gain() == reloaded->get_gain()) {
+				continue;
+			}
+
+			// Only notes past what has already been handed to the mixer are scheduled again.
+			// The previous version is kept until the player stops using it.
+			auto next_music = std::make_unique<Music>(std::move(*reloaded));
+			player->reload(*next_music, NoteScheduler::all_tracks(*next_music));
+			watched_music = std::move(next_music);
+
+			fprintf(stdout, "Reloaded %s\n", music_filename.string().c_str());
 		}
 
-		while(!enqueue((float)sample));
+		device->stop();
 
-		auto resolution_time = music::map_seconds_to_resolution(time, Music::get_resolution_per_beat(), bpm);
-		while (!sources.empty() && std::get<0>(sources.back()) <= resolution_time) {
-			auto source = std::get<1>(std::move(sources.back()));
-			sources.pop_back();
-			mixer_controller->add(std::move(source));
+		if (command_args.metrics) {
+			print_metrics(*device, *player, std::chrono::steady_clock::now() - playback_start);
 		}
 
-		time += dt;
-	}
+		if (device->has_failed()) {
+			log_error("Playback stopped because the audio device failed");
+			return 1;
+		}
+	} else {
+		fprintf(stdout, "Exporting to %s\n", *command_args.export_filename);
+
+		auto range = get_song_range(command_args, music, sample_rate);
+		if (!range) {
+			return 1;
+		}
+
+		auto [start_frame, end_frame] = *range;
 
-	if (command_args.export_filename) {
-		wave::export_samples_as_wave(
-			std::string_view(*command_args.export_filename),
+		// Stems in the cache hold whole tracks, so a range only reads them.
+		auto is_whole_song = start_frame == 0 && end_frame == UINT64_MAX;
+
+		auto samples = std::make_shared<SampleCache>(sample_rate);
+		if (!render::load_samples(music, music_base_path, *samples)) {
+			return 1;
+		}
+
+		auto writer = wave::WaveWriter::create(
+			*command_args.export_filename,
 			sample_rate,
 			channel_count,
-			export_samples.data(),
-			(int)export_samples.size()
+			command_args.export_bits,
+			command_args.export_format,
+			command_args.dither
 		);
+		if (!writer) {
+			log_error("Could not create the export file");
+			return 1;
+		}
+
+		// Shared by every track, so a pattern played by several tracks with the same instrument
+		// and gain is only rendered once.
+		std::shared_ptr<render::PatternCache> patterns;
+		if (command_args.cache_patterns) {
+			patterns = std::make_shared<render::PatternCache>(music, music_base_path, samples, channel_count, sample_rate);
+		}
+
+		std::optional<StemCache> stems;
+		if (command_args.cache_directory) {
+			stems.emplace(*command_args.cache_directory);
+		}
+
+		// Each track is rendered independently, so tracks can be spread across threads.
+		// Tracks whose stem is already cached are read back instead, the rest are written to the
+		// cache as they render.
+		std::vector<render::TrackRenderer> track_renderers;
+		std::vector<std::optional<StemWriter>> stem_writers(tracks.size());
+		track_renderers.reserve(tracks.size());
+		for (int i = 0; i < (int)tracks.size(); ++i) {
+			if (stems) {
+				auto hash = StemCache::hash_track(music, i, music_base_path, channel_count, sample_rate, command_args.cache_patterns);
+				if (auto stem = stems->open(hash, channel_count, sample_rate)) {
+					fprintf(stdout, "Reusing the cached render of track '%.*s'\n", (int)tracks[i].name().size(), tracks[i].name().data());
+					stem->skip((int64_t)start_frame);
+					track_renderers.emplace_back(std::move(*stem));
+					continue;
+				}
+
+				// Still rendered if the stem can't be written, it just won't be reused next time.
+				if (is_whole_song) {
+					if (auto stem_writer = stems->create(hash, channel_count, sample_rate)) {
+						stem_writers[i].emplace(std::move(*stem_writer));
+					}
+				}
+			}
+
+			if (patterns) {
+				track_renderers.emplace_back(
+					std::in_place_type<render::Sequencer>,
+					music,
+					std::vector<int>{ i },
+					patterns,
+					channel_count,
+					sample_rate,
+					start_frame
+				);
+			} else {
+				track_renderers.emplace_back(
+					std::in_place_type<render::Sequencer>,
+					music,
+					NoteScheduler(music, { i }),
+					music_base_path,
+					samples,
+					channel_count,
+					sample_rate,
+					start_frame
+				);
+			}
+		}
+
+		// Each track can also be exported on its own, as if it were the only track going through
+		// the master gain and saturation.
+		std::vector<std::optional<wave::WaveWriter>> track_writers(tracks.size());
+		if (command_args.stems_directory) {
+			std::filesystem::path stems_directory(*command_args.stems_directory);
+			std::error_code ec;
+			std::filesystem::create_directories(stems_directory, ec);
+
+			// Checked before any file is created, so colliding names never leave a half written stem.
+			auto stem_paths = get_stem_paths(stems_directory, tracks);
+			if (!stem_paths) {
+				return 1;
+			}
+
+			for (int i = 0; i < (int)tracks.size(); ++i) {
+				auto& path = (*stem_paths)[i];
+				auto track_writer = wave::WaveWriter::create(
+					path.string(),
+					sample_rate,
+					channel_count,
+					command_args.export_bits,
+					command_args.export_format,
+					command_args.dither
+				);
+				if (!track_writer) {
+					fprintf(stderr, "[ERROR] Could not create the stem file '%s'\n", path.string().c_str());
+					return 1;
+				}
+
+				track_writers[i].emplace(std::move(*track_writer));
+			}
+		}
+
+		render::OfflineRenderer renderer(std::move(track_renderers), channel_count, gain, thread_count);
+		for (int i = 0; i < (int)tracks.size(); ++i) {
+			auto& stem_writer = stem_writers[i];
+			auto& track_writer = track_writers[i];
+			if (!stem_writer && !track_writer) {
+				continue;
+			}
+
+			// Called on the thread that rendered the track, so stems are written in parallel.
+			std::vector<float> mastered;
+			renderer.set_track_output(i, [&stem_writer, &track_writer, gain, mastered](float const* samples, int sample_count) mutable {
+				if (stem_writer) {
+					stem_writer->write(samples, sample_count);
+				}
+
+				if (track_writer) {
+					mastered.assign(samples, samples + sample_count);
+					render::apply_master(mastered.data(), sample_count, gain);
+					track_writer->write(mastered.data(), sample_count);
+				}
+			});
+		}
+
+		// Larger than a block so each thread has a decent amount of work per pass.
+		constexpr int SEGMENT_FRAMES = render::BLOCK_FRAMES * 64;
+		block.resize(SEGMENT_FRAMES * channel_count);
+
+		// Segments are written as they are rendered, so memory use does not grow with the song.
+		auto remaining_frames = end_frame - start_frame;
+		while (remaining_frames > 0) {
+			auto requested = (int)std::min<uint64_t>(SEGMENT_FRAMES, remaining_frames);
+			auto frames = renderer.render(block.data(), requested);
+			if (renderer.is_silent()) {
+				writer->write_silence(frames * channel_count);
+			} else {
+				writer->write(block.data(), frames * channel_count);
+			}
+			remaining_frames -= frames;
+
+			// Nothing more gets written, see the error below.
+			if (frames < requested || writer->has_failed()) {
+				break;
+			}
+		}
+
+		// A full disk or a song too long for a wave file leaves the file incomplete.
+		if (!writer->close()) {
+			log_error("Could not write all of the export file, the disk may be full or the song too long for a wave file");
+			return 1;
+		}
+
+		for (int i = 0; i < (int)tracks.size(); ++i) {
+			auto& track_writer = track_writers[i];
+			if (track_writer && !track_writer->close()) {
+				fprintf(stderr, "[ERROR] Could not write all of the stem of track '%.*s'\n", (int)tracks[i].name().size(), tracks[i].name().data());
+				return 1;
+			}
+		}
+
+		// Only once the whole song rendered, so a cancelled export never leaves partial stems.
+		for (auto& stem_writer : stem_writers) {
+			if (stem_writer) {
+				stem_writer->commit();
+			}
+		}
 	}
 
 	fprintf(stdout, "Done :)\n");
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+namespace metrics {
+	// Bounds of each bucket, as the fraction of its time budget the work took. Anything past the
+	// last bound went over budget and lands in the final bucket.
+	constexpr std::array<double, 5> BUDGET_FRACTIONS = { 0.1, 0.25, 0.5, 0.75, 1.0 };
+	constexpr int BUCKET_COUNT = (int)BUDGET_FRACTIONS.size() + 1;
+
+	struct TimingSnapshot {
+		uint64_t count;
+		std::chrono::nanoseconds total;
+		std::chrono::nanoseconds max;
+		std::array<uint64_t, BUCKET_COUNT> buckets;
+
+		/*
+		 * @return How many times the work took longer than it had.
+		*/
+		uint64_t overrun_count() const {
+			return buckets.back();
+		}
+	};
+
+	/*
+	 * Records how long real-time work takes against the time it has, such as an audio callback
+	 * against the audio it renders. Only one thread records, so counters are updated with plain
+	 * atomic stores and recording never waits. Any thread can take a snapshot, though one taken
+	 * while recording may be a single record out of step.
+	*/
+	class TimingHistogram {
+	public:
+
+		TimingHistogram() {
+			_count.store(0, std::memory_order_relaxed);
+			_total_ns.store(0, std::memory_order_relaxed);
+			_max_ns.store(0, std::memory_order_relaxed);
+			for (auto& bucket : _buckets) {
+				bucket.store(0, std::memory_order_relaxed);
+			}
+		}
+
+		/*
+		 * @brief Records work. Only called from one thread.
+		*/
+		void record(std::chrono::nanoseconds elapsed, std::chrono::nanoseconds budget) {
+			auto elapsed_ns = (uint64_t)std::max<int64_t>(0, elapsed.count());
+			auto fraction = budget.count() > 0 ? (double)elapsed_ns / budget.count() : 0.0;
+
+			int bucket = 0;
+			while (bucket < (int)BUDGET_FRACTIONS.size() && fraction > BUDGET_FRACTIONS[bucket]) {
+				bucket += 1;
+			}
+
+			_increment(_buckets[bucket], 1);
+			_increment(_count, 1);
+			_increment(_total_ns, elapsed_ns);
+
+			if (elapsed_ns > _max_ns.load(std::memory_order_relaxed)) {
+				_max_ns.store(elapsed_ns, std::memory_order_relaxed);
+			}
+		}
+
+		TimingSnapshot snapshot() const {
+			TimingSnapshot snapshot;
+			snapshot.count = _count.load(std::memory_order_relaxed);
+			snapshot.total = std::chrono::nanoseconds(_total_ns.load(std::memory_order_relaxed));
+			snapshot.max = std::chrono::nanoseconds(_max_ns.load(std::memory_order_relaxed));
+			for (int i = 0; i < BUCKET_COUNT; ++i) {
+				snapshot.buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+			}
+
+			return snapshot;
+		}
+
+	private:
+
+		// Only the recording thread writes, so this needs no read-modify-write.
+		static void _increment(std::atomic<uint64_t>& counter, uint64_t amount) {
+			counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+		}
+
+	private:
+
+		std::atomic<uint64_t> _count;
+		std::atomic<uint64_t> _total_ns;
+		std::atomic<uint64_t> _max_ns;
+		std::array<std::atomic<uint64_t>, BUCKET_COUNT> _buckets;
+	};
+
+	/*
+	 * @brief Writes a snapshot as a JSON object, with times in microseconds. Buckets are listed in
+	 * order, each counting the work that took up to its bound of the budget.
+	*/
+	inline void write_json(FILE* out, TimingSnapshot const& snapshot) {
+		auto mean_us = snapshot.count > 0 ? snapshot.total.count() / 1000.0 / snapshot.count : 0.0;
+		fprintf(
+			out,
+			"{\"count\":%llu,\"mean_us\":%.1f,\"max_us\":%.1f,\"overruns\":%llu,\"buckets\":[",
+			(unsigned long long)snapshot.count,
+			mean_us,
+			snapshot.max.count() / 1000.0,
+			(unsigned long long)snapshot.overrun_count()
+		);
+
+		for (int i = 0; i < BUCKET_COUNT; ++i) {
+			fprintf(out, "%s%llu", i > 0 ? "," : "", (unsigned long long)snapshot.buckets[i]);
+		}
+
+		fprintf(out, "]}");
+	}
+}
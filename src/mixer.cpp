@@ -3,34 +3,67 @@
 
 std::tuple<std::unique_ptr<Mixer>, std::shared_ptr<MixerController>> Mixer::create_mixer(int channels, int sample_rate) {
 	auto controller = std::make_shared<MixerController>(channels, sample_rate);
-	auto mixer = std::unique_ptr<Mixer>(new Mixer(controller));
+	auto mixer = std::unique_ptr<Mixer>(new Mixer(controller, 0));
 
 	return { std::move(mixer), std::move(controller) };
 }
 
+std::unique_ptr<Mixer> Mixer::create_mixer(std::shared_ptr<MixerController> controller, uint64_t start_frame) {
+	return std::unique_ptr<Mixer>(new Mixer(std::move(controller), start_frame));
+}
+
+// Frames of the scratch block sources render into. Sources are mixed in chunks of this size,
+// so the block size asked of the mixer never requires a larger buffer.
+constexpr int SOURCE_BUFFER_FRAMES = 1024;
+
 MixerController::MixerController(int channels, int sample_rate)
-	: _channel_count(channels)
+	: _pending_sources()
+	// Preallocated for the mixer's single producer token, so handing sources back never allocates.
+	, _finished_sources(Mixer::MAX_SOURCES, 1, 0)
+	, _channel_count(channels)
 	, _sample_rate(sample_rate)
-	, _has_pending(false)
-	, _pending_sources()
-	, _pending_sources_mtx()
 {}
 
-void MixerController::add(std::unique_ptr<Source> source) {
+void MixerController::add(std::unique_ptr<Source> source, uint64_t start_frame, VoiceTag tag) {
+	release_finished_sources();
+
 	auto converted_source = std::make_unique<Converter>(std::move(source), _channel_count, _sample_rate);
-	
-	std::scoped_lock lk(_pending_sources_mtx);
-	_pending_sources.push_back(std::move(converted_source));
-	_has_pending.store(true, std::memory_order::memory_order_release);
+	_pending_sources.enqueue(PendingSource{ start_frame, std::move(converted_source), tag });
 }
 
-Mixer::Mixer(std::shared_ptr<MixerController> input)
+void MixerController::release_finished_sources() {
+	std::unique_ptr<Source> finished[64];
+	while (_finished_sources.try_dequeue_bulk(finished, 64) > 0) {
+		for (auto& source : finished) {
+			source.reset();
+		}
+	}
+}
+
+Mixer::Mixer(std::shared_ptr<MixerController> input, uint64_t start_frame)
 	: _input(std::move(input))
-	, _sample_count(0)
 	, _current_sources()
-	, _still_pending()
+	, _scheduled_sources()
+	, _sample_count(start_frame * _input->_channel_count)
+	, _still_scheduled()
 	, _still_current()
-{}
+	, _voice_limit(0)
+	, _fade_frames(std::max(1, (int)(FADE_SECONDS * _input->_sample_rate)))
+	, _source_buffer(SOURCE_BUFFER_FRAMES * _input->_channel_count)
+	, _finished_token(_input->_finished_sources)
+	, _current_source_count(0)
+	, _peak_source_count(0)
+	, _scheduled_source_count(0)
+	, _late_source_count(0)
+	, _stolen_source_count(0)
+	, _is_silent(true)
+{
+	// Reserved upfront so that moving sources around while mixing never allocates.
+	_current_sources.reserve(MAX_SOURCES);
+	_scheduled_sources.reserve(MAX_SOURCES);
+	_still_current.reserve(MAX_SOURCES);
+	_still_scheduled.reserve(MAX_SOURCES);
+}
 
 int Mixer::channel_count() const {
 	return _input->_channel_count;
@@ -41,54 +74,292 @@ int Mixer::sample_rate() const {
 }
 
 std::optional<double> Mixer::next_sample() {
-	if (_input->_has_pending.load(std::memory_order_acquire)) {
-		_start_pending_sources();
+	_take_pending_sources();
+
+	// Sources can only start on the first channel of a frame.
+	auto channels = _input->_channel_count;
+	auto is_frame_start = _sample_count % channels == 0;
+	if (is_frame_start && !_scheduled_sources.empty()) {
+		_start_scheduled_sources(_sample_count / channels);
 	}
 
 	_sample_count += 1;
+	_is_silent = false;
 
-	auto sum = _sum_current_sources();
+	auto sum = _sum_current_sources(is_frame_start);
 
-	if (_current_sources.empty() && !_input->_has_pending) {
+	if (_current_sources.empty() && _scheduled_sources.empty() && !_has_pending_sources()) {
 		return std::nullopt;
 	}
 
 	return sum;
 }
 
-void Mixer::_start_pending_sources() {
-	_still_pending.clear();
-	
-	std::scoped_lock lk(_input->_pending_sources_mtx);
+int Mixer::fill(float* out, int frames) {
+	_take_pending_sources();
+
+	auto channels = _input->_channel_count;
+	auto sample_count = frames * channels;
+
+	if (_current_sources.empty() && _scheduled_sources.empty()) {
+		// The mix keeps time while idle so start frames of sources added later still line up.
+		_sample_count += sample_count;
+		_is_silent = true;
+		_update_stats(0);
+		return 0;
+	}
+
+	std::fill_n(out, sample_count, 0.0f);
+	_is_silent = true;
+
+	_still_current.clear();
+
+	// The furthest frame any source reached, for when every source finishes in this block.
+	int mixed_frames = 0;
+
+	for (auto& playing : _current_sources) {
+		auto is_fading = playing.fade_remaining >= 0;
+		auto produced = is_fading ? _mix_fading_source(playing, out, frames) : _mix_source(*playing.source, out, frames);
+		mixed_frames = std::max(mixed_frames, produced);
+
+		if (produced == frames && playing.fade_remaining != 0) {
+			_still_current.push_back(std::move(playing));
+		} else {
+			_finish_source(std::move(playing.source));
+		}
+	}
 
-	bool in_step = _sample_count % _input->_channel_count == 0;
-	for (auto& source : _input->_pending_sources) {
-		if (in_step) {
-			_current_sources.push_back(std::move(source));
+	// Sources starting within this block are mixed in from their exact start frame.
+	auto frame = _sample_count / channels;
+	auto block_end = frame + frames;
+
+	_still_scheduled.clear();
+	uint64_t late_count = 0;
+
+	for (auto& scheduled : _scheduled_sources) {
+		if (scheduled.start_frame >= block_end) {
+			_still_scheduled.push_back(std::move(scheduled));
+			continue;
+		}
+
+		if (scheduled.start_frame < frame) {
+			late_count += 1;
+		}
+
+		// Stolen voices have already been mixed for this block, so they fade from the next one.
+		_steal_voices(_still_current, scheduled.tag);
+
+		auto offset = scheduled.start_frame > frame ? (int)(scheduled.start_frame - frame) : 0;
+		auto produced = _mix_source(*scheduled.source, out + offset * channels, frames - offset);
+		mixed_frames = std::max(mixed_frames, offset + produced);
+
+		if (produced == frames - offset) {
+			_still_current.push_back(PlayingSource{ std::move(scheduled.source), scheduled.tag, -1 });
 		} else {
-			_still_pending.push_back(std::move(source));
+			_finish_source(std::move(scheduled.source));
 		}
 	}
 
-	std::swap(_still_pending, _input->_pending_sources);
+	std::swap(_still_scheduled, _scheduled_sources);
+	std::swap(_still_current, _current_sources);
+
+	_sample_count += sample_count;
+	_update_stats(late_count);
 
-	bool has_pending = !_input->_pending_sources.empty();
-	_input->_has_pending.store(has_pending, std::memory_order_release);
+	if (_current_sources.empty() && _scheduled_sources.empty() && !_has_pending_sources()) {
+		return mixed_frames;
+	}
+
+	return frames;
 }
 
-double Mixer::_sum_current_sources() {
+void Mixer::_take_pending_sources() {
+	// Only takes what fits in the reserved space, the rest stays queued until sources finish.
+	auto room = MAX_SOURCES - _current_sources.size() - _scheduled_sources.size();
+	if (room > 0) {
+		_input->_pending_sources.try_dequeue_bulk(std::back_inserter(_scheduled_sources), room);
+	}
+}
+
+void Mixer::_start_scheduled_sources(uint64_t frame) {
+	_still_scheduled.clear();
+
+	for (auto& scheduled : _scheduled_sources) {
+		if (scheduled.start_frame <= frame) {
+			_steal_voices(_current_sources, scheduled.tag);
+			_current_sources.push_back(PlayingSource{ std::move(scheduled.source), scheduled.tag, -1 });
+		} else {
+			_still_scheduled.push_back(std::move(scheduled));
+		}
+	}
+
+	std::swap(_still_scheduled, _scheduled_sources);
+}
+
+double Mixer::_sum_current_sources(bool is_frame_start) {
 	_still_current.clear();
 	
 	auto sum = 0.0;
 
-	for (auto& source : _current_sources) {
-		if (auto sample = source->next_sample()) {
-			sum += *sample;
-			_still_current.push_back(std::move(source));
+	for (auto& playing : _current_sources) {
+		auto gain = 1.0;
+		if (playing.fade_remaining >= 0) {
+			// Fades by frame, so every channel of a frame gets the same gain.
+			if (is_frame_start) {
+				if (playing.fade_remaining == 0) {
+					_finish_source(std::move(playing.source));
+					continue;
+				}
+
+				playing.fade_remaining -= 1;
+			}
+
+			gain = (double)playing.fade_remaining / _fade_frames;
+		}
+
+		if (auto sample = playing.source->next_sample()) {
+			sum += *sample * gain;
+			_still_current.push_back(std::move(playing));
+		} else {
+			_finish_source(std::move(playing.source));
 		}
 	}
 
 	std::swap(_still_current, _current_sources);
 
 	return sum;
-}
\ No newline at end of file
+}
+
+int Mixer::_mix_source(Source& source, float* out, int frames) {
+	auto channels = _input->_channel_count;
+
+	// Silence ahead is skipped in one go, as there is nothing to add to the mix.
+	auto produced = (int)std::min<int64_t>(source.silent_frames(), frames);
+	if (produced > 0) {
+		auto skipped = (int)source.skip(produced);
+		if (skipped < produced) {
+			return skipped;
+		}
+	}
+
+	if (produced < frames) {
+		_is_silent = false;
+	}
+
+	while (produced < frames) {
+		auto chunk = std::min(frames - produced, SOURCE_BUFFER_FRAMES);
+		auto chunk_produced = source.fill(_source_buffer.data(), chunk);
+		auto count = chunk_produced * channels;
+		auto chunk_out = out + produced * channels;
+		for (int i = 0; i < count; ++i) {
+			chunk_out[i] += _source_buffer[i];
+		}
+
+		produced += chunk_produced;
+		if (chunk_produced < chunk) {
+			break;
+		}
+	}
+
+	return produced;
+}
+
+int Mixer::_mix_fading_source(PlayingSource& playing, float* out, int frames) {
+	auto channels = _input->_channel_count;
+	auto step = 1.0f / _fade_frames;
+	auto count = std::min(frames, playing.fade_remaining);
+	int produced = 0;
+	_is_silent = false;
+
+	while (produced < count) {
+		auto chunk = std::min(count - produced, SOURCE_BUFFER_FRAMES);
+		auto chunk_produced = playing.source->fill(_source_buffer.data(), chunk);
+		auto chunk_out = out + produced * channels;
+
+		// Ramps down linearly from where the fade has got to.
+		auto gain = (playing.fade_remaining - produced) * step;
+		for (int i = 0; i < chunk_produced; ++i) {
+			for (int c = 0; c < channels; ++c) {
+				chunk_out[i * channels + c] += _source_buffer[i * channels + c] * gain;
+			}
+			gain -= step;
+		}
+
+		produced += chunk_produced;
+		if (chunk_produced < chunk) {
+			break;
+		}
+	}
+
+	// Once faded out, the source is done even if it had more to play.
+	playing.fade_remaining -= produced;
+	return produced;
+}
+
+void Mixer::_steal_voices(std::vector<PlayingSource>& playing, VoiceTag const& tag) {
+	auto steal = [this](PlayingSource& victim) {
+		victim.fade_remaining = _fade_frames;
+		_stolen_source_count.store(_stolen_source_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	};
+
+	if (tag.group >= 0 && tag.limit > 0) {
+		int count = 0;
+		PlayingSource* oldest = nullptr;
+		PlayingSource* same_note = nullptr;
+
+		for (auto& other : playing) {
+			if (other.fade_remaining >= 0 || other.tag.group != tag.group) {
+				continue;
+			}
+
+			count += 1;
+			oldest = oldest ? oldest : &other;
+			if (!same_note && tag.note >= 0 && other.tag.note == tag.note) {
+				same_note = &other;
+			}
+		}
+
+		if (count >= tag.limit) {
+			steal(same_note ? *same_note : *oldest);
+		}
+	}
+
+	if (_voice_limit > 0) {
+		int count = 0;
+		PlayingSource* oldest = nullptr;
+
+		for (auto& other : playing) {
+			if (other.fade_remaining < 0) {
+				count += 1;
+				oldest = oldest ? oldest : &other;
+			}
+		}
+
+		if (count >= _voice_limit) {
+			steal(*oldest);
+		}
+	}
+}
+
+void Mixer::_finish_source(std::unique_ptr<Source> source) {
+	// Destroyed here only if the controller has not kept up with releasing finished sources.
+	_input->_finished_sources.try_enqueue(_finished_token, std::move(source));
+}
+
+bool Mixer::_has_pending_sources() const {
+	return _input->_pending_sources.size_approx() > 0;
+}
+
+void Mixer::_update_stats(uint64_t late_count) {
+	auto current_count = (int)_current_sources.size();
+	_current_source_count.store(current_count, std::memory_order_relaxed);
+	_scheduled_source_count.store((int)_scheduled_sources.size(), std::memory_order_relaxed);
+
+	if (current_count > _peak_source_count.load(std::memory_order_relaxed)) {
+		_peak_source_count.store(current_count, std::memory_order_relaxed);
+	}
+
+	if (late_count > 0) {
+		_late_source_count.store(_late_source_count.load(std::memory_order_relaxed) + late_count, std::memory_order_relaxed);
+	}
+}
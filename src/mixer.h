@@ -1,22 +1,66 @@
 #pragma once
 
-#include <atomic>
 #include <vector>
 #include <memory>
-#include <mutex>
 #include <tuple>
+#include <atomic>
+#include <stdint.h>
 
 #include "source.h"
+#include "concurrentqueue.h"
+
+/*
+ * What a source competes with for a polyphony limit, see Mixer::set_voice_limit.
+*/
+struct VoiceTag {
+	// Sources of the same group share its limit. -1 for none.
+	int group = -1;
+
+	// The most sources of the group that play at once. 0 for no limit.
+	int limit = 0;
+
+	// Once the limit is reached, a source playing the same note in the group is replaced first.
+	// -1 for none.
+	int note = -1;
+};
 
 /*
- * Allows adding sources to the corresponding Mixer
+ * A source waiting on the frame of the mix it should start on.
+*/
+struct PendingSource {
+	uint64_t start_frame;
+	std::unique_ptr<Source> source;
+	VoiceTag tag;
+};
+
+/*
+ * Allows adding sources to the corresponding Mixer.
+ * Sources are handed over through lock-free queues, both when they are added and when the mixer
+ * is done with them, so that creating and destroying sources only ever happens on the thread
+ * adding them. The mixer never waits on this thread.
 */
 class MixerController {
 public:
 
 	MixerController(int channels, int sample_rate);
 
-	void add(std::unique_ptr<Source> source);
+	/*
+	 * @brief Adds a source to the mix. Also destroys the sources the mixer has finished with.
+	 * @param start_frame The frame of the mix the source starts on. Sources whose start
+	 * has already passed start on the next frame the mixer renders.
+	 * @param tag The voices the source may replace, or be replaced by.
+	*/
+	void add(std::unique_ptr<Source> source, uint64_t start_frame = 0, VoiceTag tag = {});
+
+	/*
+	 * @brief Destroys the sources the mixer has finished with.
+	*/
+	void release_finished_sources();
+
+	/*
+	 * @return Roughly how many added sources the mixer has yet to take.
+	*/
+	size_t pending_source_count() const { return _pending_sources.size_approx(); }
 
 private:
 
@@ -24,43 +68,131 @@ private:
 
 private:
 
-	// Needed so we don't have to lock the mutex to see if pending_sources is empty.
-	std::atomic<bool> _has_pending;
-
-	std::vector<std::unique_ptr<Source>> _pending_sources;
-	std::mutex _pending_sources_mtx;
+	moodycamel::ConcurrentQueue<PendingSource> _pending_sources;
+	moodycamel::ConcurrentQueue<std::unique_ptr<Source>> _finished_sources;
 
 	int _channel_count;
 	int _sample_rate;
 };
 
+/*
+ * Mixes the sources of its MixerController. Rendering never locks, allocates or frees, so it is
+ * safe to call from a real-time thread.
+ *
+ * The number of sources playing can be capped per group of sources and across the mix. A source
+ * starting once a cap is reached steals a voice: the source playing the same note in its group
+ * if any, otherwise the oldest one. Stolen sources are faded out over a few milliseconds rather
+ * than cut, starting from the next block.
+ *
+ * Silence sources know of ahead of time, see Source::silent_frames, is skipped rather than mixed.
+*/
 class Mixer : public Source {
 public:
 
+	// The most sources the mixer holds at once. Sources added past this wait until others finish.
+	static constexpr int MAX_SOURCES = 1024;
+
+	// How long a stolen source takes to fade out. Short enough to hardly be heard, long enough not to click.
+	static constexpr double FADE_SECONDS = 0.005;
+
 	static std::tuple<std::unique_ptr<Mixer>, std::shared_ptr<MixerController>> create_mixer(int channels, int sample_rate);
 
+	/*
+	 * @brief Creates a mixer for an existing controller. A controller must only have one mixer.
+	 * @param start_frame The frame the mixer renders first, which start frames of sources count from.
+	*/
+	static std::unique_ptr<Mixer> create_mixer(std::shared_ptr<MixerController> controller, uint64_t start_frame = 0);
+
 	int channel_count() const override;
 	int sample_rate() const override;
 	std::optional<double> next_sample() override;
+	int fill(float* out, int frames) override;
+
+	/*
+	 * @brief Limits how many sources play at once across the mix, whatever their group. Sources
+	 * fading out don't count. 0 for no limit. Only called before rendering starts.
+	*/
+	void set_voice_limit(int limit) { _voice_limit = limit; }
+
+	/*
+	 * Statistics as of the last block mixed, safe to read from any thread while the mixer renders.
+	*/
+
+	// Sources playing.
+	int current_source_count() const { return _current_source_count.load(std::memory_order_relaxed); }
+
+	// The most sources that have played at once.
+	int peak_source_count() const { return _peak_source_count.load(std::memory_order_relaxed); }
+
+	// Sources taken from the controller that have yet to reach their start frame.
+	int scheduled_source_count() const { return _scheduled_source_count.load(std::memory_order_relaxed); }
+
+	// Sources that were taken after their start frame had passed, so started late.
+	uint64_t late_source_count() const { return _late_source_count.load(std::memory_order_relaxed); }
+
+	// Sources faded out early to keep to a polyphony limit.
+	uint64_t stolen_source_count() const { return _stolen_source_count.load(std::memory_order_relaxed); }
+
+	/*
+	 * @return Whether the last block mixed is silence, as nothing played or whatever did was
+	 * silent for the whole block. Only read from the thread mixing.
+	*/
+	bool is_silent() const { return _is_silent; }
 
 private:
 
-	Mixer(std::shared_ptr<MixerController> input);
+	struct PlayingSource {
+		std::unique_ptr<Source> source;
+		VoiceTag tag;
 
-	void _start_pending_sources();
-	double _sum_current_sources();
+		// Frames left until a stolen source is silent, -1 while not fading.
+		int fade_remaining;
+	};
+
+	Mixer(std::shared_ptr<MixerController> input, uint64_t start_frame);
+
+	void _take_pending_sources();
+	void _start_scheduled_sources(uint64_t frame);
+	double _sum_current_sources(bool is_frame_start);
+	int _mix_source(Source& source, float* out, int frames);
+	int _mix_fading_source(PlayingSource& playing, float* out, int frames);
+	void _steal_voices(std::vector<PlayingSource>& playing, VoiceTag const& tag);
+	void _finish_source(std::unique_ptr<Source> source);
+	bool _has_pending_sources() const;
+	void _update_stats(uint64_t late_count);
 
 private:
 
 	// Pending sounds.
 	std::shared_ptr<MixerController> _input;
 
-	// Current sources producing samples.
-	std::vector<std::unique_ptr<Source>> _current_sources;
+	// Current sources producing samples, oldest first.
+	std::vector<PlayingSource> _current_sources;
+
+	// Sources taken from the controller that have yet to reach their start frame.
+	std::vector<PendingSource> _scheduled_sources;
 
 	// The number of samples produced so far.
-	uint32_t _sample_count;
+	uint64_t _sample_count;
+
+	std::vector<PendingSource> _still_scheduled;
+	std::vector<PlayingSource> _still_current;
+
+	int _voice_limit;
+	int _fade_frames;
 
-	std::vector<std::unique_ptr<Source>> _still_pending;
-	std::vector<std::unique_ptr<Source>> _still_current;
-};
\ No newline at end of file
+	// Scratch block each source renders into before being summed.
+	std::vector<float> _source_buffer;
+
+	// Lets the mixer hand back finished sources without allocating.
+	moodycamel::ProducerToken _finished_token;
+
+	// Only written by the mixer, see the getters.
+	std::atomic<int> _current_source_count;
+	std::atomic<int> _peak_source_count;
+	std::atomic<int> _scheduled_source_count;
+	std::atomic<uint64_t> _late_source_count;
+	std::atomic<uint64_t> _stolen_source_count;
+
+	bool _is_silent;
+};
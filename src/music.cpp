@@ -2,6 +2,7 @@
 #include "rapidyaml.h"
 
 #include <fstream>
+#include <map>
 
 template<class...T>
 std::string format_string(char const* fmt, T&&...args) {
@@ -161,6 +162,45 @@ static auto parse_bpm(ryml::ConstNodeRef root)
 	}
 }
 
+/*
+ * @brief Parses the optional polyphony of an instrument or track.
+ * @return 0 if there is none.
+*/
+static auto parse_polyphony(ryml::ConstNodeRef node)
+	-> std::variant<int, InternalError>
+{
+	constexpr c4::csubstr POLYPHONY_PROP_NAME("polyphony");
+
+	if (!node.has_child(POLYPHONY_PROP_NAME)) {
+		return 0;
+	}
+
+	auto polyphony_node = node[POLYPHONY_PROP_NAME];
+	if (!polyphony_node.is_keyval()) {
+		return InternalErrorFieldUnexpectedType(
+			POLYPHONY_PROP_NAME.data(),
+			ryml::NodeType(ryml::NodeType_e::KEYVAL).type_str(),
+			polyphony_node.type_str()
+		);
+	}
+	if (!polyphony_node.val().is_integer()) {
+		return InternalErrorArgumentUnexpectedType(
+			POLYPHONY_PROP_NAME.data(),
+			0,
+			"Integer",
+			get_val_type_name(polyphony_node.val())
+		);
+	}
+
+	int polyphony;
+	polyphony_node >> polyphony;
+	if (polyphony < 1) {
+		return InternalErrorOther{ format_string("Polyphony must be at least 1, got %d", polyphony) };
+	}
+
+	return polyphony;
+}
+
 static auto parse_gain(ryml::ConstNodeRef root)
 	-> std::variant<std::optional<double>, InternalError>
 {
@@ -440,74 +480,123 @@ static auto parse_pattern_command(ryml::ConstNodeRef node)
 		return pass_through(parse_command_play_note(node));
 	}
 
-	return InternalErrorOther{ format_string("Command '%s' does not exist", std::string(name.data(), name.len)) };
+	return InternalErrorOther{ format_string("Command '%s' does not exist", std::string(name.data(), name.len).c_str()) };
 }
 
-static std::variant<std::monostate, InternalError> process_pattern_commands(
-	std::vector<PatternCommand> commands,
-	int resolution_per_beat,
-	int bpm,
-	TimeSignature time_signature,
-	Pattern& pattern
-) {
-	// We need to translate the raw commands into ones that will actually move
-	// the pattern forward, i.e. delay/play. This will involve expanding repeat
-	// commands.
-
-	std::vector<PatternCommand> final_commands;
-	final_commands.reserve(commands.size());	// Probably gonna need at least num commands.
-
-	std::vector<std::vector<PatternCommand>> repeat_stack;
-
-	std::vector<PatternCommand>* cur_target = &final_commands;
+/*
+ * @brief Checks that every repeat command has a matching end-repeat.
+ * @param weight Gives how many events a command adds once played, for the count of events
+ * the commands add once every repeat is expanded.
+ * @return The number of events the commands expand to.
+*/
+template<class Command, class F>
+static auto count_repeated_commands(std::vector<Command> const& commands, F&& weight)
+	-> std::variant<size_t, InternalError>
+{
+	// The number of times each enclosing repeat plays its commands.
+	std::vector<size_t> repeat_counts;
+	size_t count = 0;
+	size_t multiplier = 1;
 
 	for (auto& command : commands) {
 		if (auto c = std::get_if<CommandRepeat>(&command)) {
-			// Start every stack with the repeat command that caused it, so we can track repeat count.
-			repeat_stack.push_back({ std::move(*c) });
-			cur_target = &repeat_stack.back();
-		} else if (auto c = std::get_if<CommandEndRepeat>(&command)) {
-			if (repeat_stack.empty()) {
+			repeat_counts.push_back(multiplier);
+			multiplier *= (size_t)std::max(c->count, 0);
+		} else if (std::holds_alternative<CommandEndRepeat>(command)) {
+			if (repeat_counts.empty()) {
 				return InternalErrorOther{ "Extra 'end-repeat' called" };
 			}
 
-			// We now need to pop the top of the stack and repeatedly fill the next array in the stack
-			// with the contents repeat_count times.
+			multiplier = repeat_counts.back();
+			repeat_counts.pop_back();
+		} else {
+			count += multiplier * weight(command);
+		}
+	}
 
-			auto repeat_commands = std::move(repeat_stack.back());
-			repeat_stack.pop_back();
-			if (repeat_stack.empty()) {
-				cur_target = &final_commands;
-			} else {
-				cur_target = &repeat_stack.back();
-			}
+	// Missing end-repeat command
+	if (!repeat_counts.empty()) {
+		return InternalErrorOther{ format_string("Missing %lu 'end-repeat' commands", repeat_counts.size() )};
+	}
 
-			// A repeat stack vector should always have its first element be a CommandRepeat.
-			int repeat_count = std::get<CommandRepeat>(repeat_commands[0]).count;
+	return count;
+}
 
-			// We do not count the first CommandRepeat element.
-			if (repeat_commands.size() > 1) {
-				while (repeat_count > 0) {
-					--repeat_count;
+/*
+ * @brief Calls f with each command other than repeat and end-repeat, in the order they are
+ * played. Repeated sections are replayed from their position in commands rather than copied.
+ * Every repeat must have a matching end-repeat, see count_repeated_commands.
+*/
+template<class Command, class F>
+static void for_each_repeated_command(std::vector<Command> const& commands, F&& f) {
+	struct Loop {
+		size_t begin;	// The first command after the repeat
+		int remaining;
+	};
 
-					cur_target->insert(cur_target->end(), repeat_commands.begin() + 1, repeat_commands.end());
+	std::vector<Loop> loops;
+	size_t idx = 0;
+
+	while (idx < commands.size()) {
+		auto& command = commands[idx];
+
+		if (auto c = std::get_if<CommandRepeat>(&command)) {
+			if (c->count > 0) {
+				loops.push_back({ idx + 1, c->count });
+				idx += 1;
+				continue;
+			}
+
+			// Never played, so skip to after the matching end-repeat.
+			int depth = 0;
+			do {
+				if (std::holds_alternative<CommandRepeat>(commands[idx])) {
+					depth += 1;
+				} else if (std::holds_alternative<CommandEndRepeat>(commands[idx])) {
+					depth -= 1;
 				}
+				idx += 1;
+			} while (depth > 0);
+		} else if (std::holds_alternative<CommandEndRepeat>(command)) {
+			auto& loop = loops.back();
+			loop.remaining -= 1;
+			if (loop.remaining > 0) {
+				idx = loop.begin;
+			} else {
+				loops.pop_back();
+				idx += 1;
 			}
 		} else {
-			cur_target->push_back(std::move(command));
+			f(command);
+			idx += 1;
 		}
 	}
+}
 
-	// Missing end-repeat command
-	if (!repeat_stack.empty()) {
-		return InternalErrorOther{ format_string("Missing %lu 'end-repeat' commands", repeat_stack.size() )};
+static std::variant<std::monostate, InternalError> process_pattern_commands(
+	std::vector<PatternCommand> const& commands,
+	int resolution_per_beat,
+	int bpm,
+	TimeSignature time_signature,
+	Pattern& pattern
+) {
+	// We need to translate the raw commands into ones that will actually move
+	// the pattern forward, i.e. delay/play. Repeats are played straight from the
+	// commands, so the expanded commands are never stored.
+
+	auto count_res = count_repeated_commands(commands, [](PatternCommand const& command) -> size_t {
+		return std::holds_alternative<CommandPlayNote>(command) ? 1 : 0;
+	});
+	if (auto err = std::get_if<1>(&count_res)) {
+		return std::move(*err);
 	}
 
+	pattern.reserve(std::get<0>(count_res));
+
 	auto beat_value = (double)time_signature.beat_value;
 	auto elapsed = 0.0;	// Elapsed time in resolution time, stored as double to allow greater precision.
 
-	// Now we have a list of final commands that can be used to generate note events.
-	for (auto& command : final_commands) {
+	for_each_repeated_command(commands, [&](PatternCommand const& command) {
 		if (auto c = std::get_if<CommandDelay>(&command)) {
 			auto beats = beat_value * c->duration.note_value();
 			elapsed += beats * resolution_per_beat;
@@ -519,10 +608,8 @@ static std::variant<std::monostate, InternalError> process_pattern_commands(
 				(int)floor(elapsed),
 				(int)floor(elapsed + duration)
 			));
-		} else {
-			return InternalErrorOther{ "Problem with the software itself" };
 		}
-	}
+	});
 
 	return {};
 }
@@ -584,13 +671,14 @@ static auto parse_pattern(
 		commands.push_back(std::get<0>(std::move(res)));
 	}
 
-	if (auto err = std::get_if<1>(&process_pattern_commands(
-		std::move(commands),
+	auto process_res = process_pattern_commands(
+		commands,
 		resolution_per_beat,
 		bpm,
 		time_signature,
 		pattern
-	))) {
+	);
+	if (auto err = std::get_if<1>(&process_res)) {
 		return std::move(*err);
 	}
 	
@@ -650,6 +738,7 @@ static auto parse_adsr(ryml::ConstNodeRef node, Adsr default_adsr)
 	constexpr c4::csubstr DECAY_PROP_NAME("decay");
 	constexpr c4::csubstr SUSTAIN_PROP_NAME("sustain");
 	constexpr c4::csubstr RELEASE_PROP_NAME("release");
+	constexpr c4::csubstr CURVE_PROP_NAME("curve");
 
 	auto deserialize_double_if_exists = [&](c4::csubstr const& name, double& out_value) {
 		if (node.has_child(name)) {
@@ -662,6 +751,33 @@ static auto parse_adsr(ryml::ConstNodeRef node, Adsr default_adsr)
 	deserialize_double_if_exists(SUSTAIN_PROP_NAME, adsr.sustain);
 	deserialize_double_if_exists(RELEASE_PROP_NAME, adsr.release);
 
+	if (node.has_child(CURVE_PROP_NAME)) {
+		auto curve_node = node[CURVE_PROP_NAME];
+		if (!curve_node.is_keyval()) {
+			return InternalErrorFieldUnexpectedType(
+				CURVE_PROP_NAME.data(),
+				ryml::NodeType(ryml::NodeType_e::KEYVAL).type_str(),
+				curve_node.type_str()
+			);
+		}
+		if (!curve_node.val().has_str()) {
+			return InternalErrorFieldUnexpectedType(
+				CURVE_PROP_NAME.data(),
+				"String",
+				get_val_type_name(curve_node.val())
+			);
+		}
+
+		auto curve = curve_node.val();
+		if (csubstr_compare(curve, "linear") == 0) {
+			adsr.curve = AdsrCurve::Linear;
+		} else if (csubstr_compare(curve, "exponential") == 0) {
+			adsr.curve = AdsrCurve::Exponential;
+		} else {
+			return InternalErrorOther{ format_string("ADSR curve '%s' does not exist", std::string(curve.data(), curve.len).c_str()) };
+		}
+	}
+
 	return adsr;
 }
 
@@ -736,7 +852,12 @@ static auto parse_instrument(
 		adsr = std::get<0>(res);
 	}
 
-	return Instrument(std::move(name), std::move(source_type), adsr);
+	auto polyphony_res = parse_polyphony(node);
+	if (auto err = std::get_if<InternalError>(&polyphony_res)) {
+		return std::move(*err);
+	}
+
+	return Instrument(std::move(name), std::move(source_type), adsr, std::get<int>(polyphony_res));
 }
 
 static auto parse_instruments(
@@ -842,7 +963,7 @@ static auto parse_track_command(ryml::ConstNodeRef node)
 }
 
 static std::variant<std::monostate, InternalError> process_track_commands(
-	std::vector<TrackCommand> commands,
+	std::vector<TrackCommand> const& commands,
 	int resolution_per_beat,
 	int bpm,
 	TimeSignature time_signature,
@@ -850,74 +971,46 @@ static std::variant<std::monostate, InternalError> process_track_commands(
 	Track& track
 ) {
 	// We need to translate the raw commands into ones that will actually move
-	// the pattern forward, i.e. delay/play. This will involve expanding repeat
-	// commands.
-
-	std::vector<TrackCommand> final_commands;
-	final_commands.reserve(commands.size());	// Probably gonna need at least num commands.
-
-	std::vector<std::vector<TrackCommand>> repeat_stack;
-
-	std::vector<TrackCommand>* cur_target = &final_commands;
-
-	for (auto& command : commands) {
-		if (auto c = std::get_if<CommandRepeat>(&command)) {
-			// Start every stack with the repeat command that caused it, so we can track repeat count.
-			repeat_stack.push_back({ std::move(*c) });
-			cur_target = &repeat_stack.back();
-		} else if (auto c = std::get_if<CommandEndRepeat>(&command)) {
-			if (repeat_stack.empty()) {
-				return InternalErrorOther{ "Extra 'end-repeat' called" };
-			}
+	// the pattern forward, i.e. delay/play. Repeats are played straight from the
+	// commands, so the expanded commands are never stored.
 
-			// We now need to pop the top of the stack and repeatedly fill the next array in the stack
-			// with the contents repeat_count times.
-
-			auto repeat_commands = std::move(repeat_stack.back());
-			repeat_stack.pop_back();
-			if (repeat_stack.empty()) {
-				cur_target = &final_commands;
-			} else {
-				cur_target = &repeat_stack.back();
+	// Patterns are looked up once per command rather than once per time they are played.
+	std::vector<int> pattern_indices(commands.size(), -1);
+	for (size_t idx = 0; idx < commands.size(); ++idx) {
+		if (auto c = std::get_if<CommandPlayPattern>(&commands[idx])) {
+			auto pattern = std::find_if(patterns.begin(), patterns.end(), [&](Pattern const& pattern) {
+				return pattern.name().compare(c->pattern_name) == 0;
+			});
+			if (pattern == patterns.end()) {
+				return InternalErrorOther{ format_string("Pattern '%s' does not exist", c->pattern_name.c_str()) };
 			}
 
-			// A repeat stack vector should always have its first element be a CommandRepeat.
-			int repeat_count = std::get<CommandRepeat>(repeat_commands[0]).count;
-
-			// We do not count the first CommandRepeat element.
-			if (repeat_commands.size() > 1) {
-				while (repeat_count > 0) {
-					--repeat_count;
-
-					cur_target->insert(cur_target->end(), repeat_commands.begin() + 1, repeat_commands.end());
-				}
-			}
-		} else {
-			cur_target->push_back(std::move(command));
+			pattern_indices[idx] = (int)(pattern - patterns.begin());
 		}
 	}
 
+	auto count_res = count_repeated_commands(commands, [](TrackCommand const& command) -> size_t {
+		return std::holds_alternative<CommandPlayPattern>(command) ? 1 : 0;
+	});
+	if (auto err = std::get_if<1>(&count_res)) {
+		return std::move(*err);
+	}
+
+	track.reserve(std::get<0>(count_res));
+
 	auto beat_value = (double)time_signature.beat_value;
 	auto elapsed = 0.0;	// Elapsed time in resolution time, stored as double to allow greater precision.
 
-	// Now we have a list of final commands that can be used to generate pattern events.
-	for (auto& command : final_commands) {
+	for_each_repeated_command(commands, [&](TrackCommand const& command) {
 		if (auto c = std::get_if<CommandDelay>(&command)) {
 			auto beats = beat_value * c->duration.note_value();
 			elapsed += beats * resolution_per_beat;
-		} else if (auto c = std::get_if<CommandPlayPattern>(&command)) {
-			auto pattern = std::find_if(patterns.begin(), patterns.end(), [&](Pattern const& pattern) {
-				return pattern.name().compare(c->pattern_name) == 0;
-			});
-			if (pattern == patterns.end()) {
-				return InternalErrorOther{ format_string("Missing %lu 'end-repeat' commands", repeat_stack.size() )};
-			}
-
-			auto pattern_idx = pattern - patterns.begin();
-			auto duration = pattern->duration();
+		} else if (std::holds_alternative<CommandPlayPattern>(command)) {
+			auto pattern_idx = pattern_indices[&command - commands.data()];
+			auto duration = patterns[pattern_idx].duration();
 
 			track.add_pattern(PatternEvent(
-				(int)pattern_idx,
+				pattern_idx,
 				(int)floor(elapsed),
 				(int)floor(elapsed + duration)
 			));
@@ -925,10 +1018,8 @@ static std::variant<std::monostate, InternalError> process_track_commands(
 			// Every play command will increase elapsed, as patterns cannot overlap and must be played
 			// sequentially in the order they appear.
 			elapsed += (double)duration;
-		} else {
-			return InternalErrorOther{ "Problem with software itself" };
 		}
-	}
+	});
 
 	return {};
 }
@@ -1039,7 +1130,12 @@ static auto parse_track(
 		gain_node >> gain;
 	}
 
-	Track track(std::string(name_node.val().data(), name_node.val().len), (int)instrument_idx, gain);
+	auto polyphony_res = parse_polyphony(node);
+	if (auto err = std::get_if<InternalError>(&polyphony_res)) {
+		return std::move(*err);
+	}
+
+	Track track(std::string(name_node.val().data(), name_node.val().len), (int)instrument_idx, gain, std::get<int>(polyphony_res));
 	std::vector<TrackCommand> commands;
 	commands.reserve(commands_node.num_children());
 
@@ -1052,14 +1148,15 @@ static auto parse_track(
 		}
 	}
 
-	if (auto err = std::get_if<1>(&process_track_commands(
-		std::move(commands),
+	auto process_res = process_track_commands(
+		commands,
 		resolution_per_beat,
 		bpm,
 		time_signature,
 		patterns,
 		track
-	))) {
+	);
+	if (auto err = std::get_if<1>(&process_res)) {
 		return std::move(*err);
 	}
 
@@ -1112,6 +1209,9 @@ static auto parse_tracks(
 }
 
 MusicError map_internal_to_music_error(InternalError err) {
+	if (auto e = std::get_if<InternalErrorOther>(&err)) {
+		return MusicErrorParse(std::move(e->msg));
+	}
 	if (auto e = std::get_if<InternalErrorUnexpectedNumberOfArgs>(&err)) {
 		return MusicErrorParse(format_string(
 			"Unexpected number of arguments to '%s' (expected: %i, actual: %i)",
@@ -1170,24 +1270,28 @@ std::variant<Music, MusicError> Music::import(std::string_view filename) {
 		c4::yml::ParserOptions().locations(true)
 	);
 
-	std::ifstream file(filename.data(), std::ios::ate);
+	std::ifstream file(filename.data(), std::ios::binary | std::ios::ate);
 	if (!file.is_open()) {
 		return MusicErrorFile { strerror(errno) };
 	}
 
-	auto file_size = file.tellg();
-	std::string source(file_size, '\0');
+	auto file_size = (size_t)file.tellg();
+	std::vector<char> source(file_size);
 	file.seekg(0);
 	file.read(source.data(), file_size);
+	source.resize((size_t)file.gcount());
 
 	file.close();
 
+	// Parsed in place, so scalars point straight into the source instead of a copy of it
+	// in the tree's arena. Everything kept from them is copied out before the source goes.
 	c4::yml::Tree tree;
 	
 	try {
-		tree = parser.parse_in_arena(
+		parser.parse_in_place(
 			c4::csubstr(filename.data(), filename.length()),
-			c4::csubstr(source.data(), source.length())
+			c4::substr(source.data(), source.size()),
+			&tree
 		);
 	} catch (RymlError e) {
 		return MusicErrorParse { std::move(e.msg) };
@@ -1267,4 +1371,86 @@ std::variant<Music, MusicError> Music::import(std::string_view filename) {
 	music._tracks = std::move(tracks);
 
 	return music;
-}
\ No newline at end of file
+}
+namespace music {
+	static bool is_same_instrument(Instrument const& lhs, Instrument const& rhs) {
+		auto a = lhs.adsr();
+		auto b = rhs.adsr();
+		if (lhs.name() != rhs.name()
+			|| a.attack != b.attack
+			|| a.decay != b.decay
+			|| a.sustain != b.sustain
+			|| a.release != b.release
+			|| a.curve != b.curve
+			|| lhs.polyphony() != rhs.polyphony()
+			|| lhs.source().index() != rhs.source().index()
+		) {
+			return false;
+		}
+
+		if (auto wave = std::get_if<InstrumentSourceWave>(&lhs.source())) {
+			return *wave == std::get<InstrumentSourceWave>(rhs.source());
+		}
+
+		return std::get<InstrumentSourceSample>(lhs.source()).filename
+			== std::get<InstrumentSourceSample>(rhs.source()).filename;
+	}
+
+	static bool is_same_pattern(Pattern const& lhs, Pattern const& rhs) {
+		auto& a = lhs.events();
+		auto& b = rhs.events();
+		return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](NoteEvent const& x, NoteEvent const& y) {
+			return x.start == y.start
+				&& x.end == y.end
+				&& x.note.letter == y.note.letter
+				&& x.note.octave == y.note.octave;
+		});
+	}
+
+	bool is_track_changed(Music const& before, Music const& after, int track_idx) {
+		if (before.get_bpm() != after.get_bpm()
+			|| before.get_time_signature().beats_per_bar != after.get_time_signature().beats_per_bar
+			|| before.get_time_signature().beat_value != after.get_time_signature().beat_value
+		) {
+			return true;
+		}
+
+		auto& track = after.get_tracks()[track_idx];
+		auto& before_tracks = before.get_tracks();
+		auto before_track = std::find_if(before_tracks.begin(), before_tracks.end(), [&](Track const& other) {
+			return other.name() == track.name();
+		});
+		if (before_track == before_tracks.end()) {
+			return true;
+		}
+
+		if (before_track->gain() != track.gain()
+			|| before_track->polyphony() != track.polyphony()
+			|| !is_same_instrument(
+				before.get_instruments()[before_track->instrument_idx()],
+				after.get_instruments()[track.instrument_idx()]
+			)
+		) {
+			return true;
+		}
+
+		// Tracks play the same few patterns over and over, so each pair is only compared once.
+		std::map<std::pair<int, int>, bool> same_patterns;
+		auto& a = before_track->events();
+		auto& b = track.events();
+		return !std::equal(a.begin(), a.end(), b.begin(), b.end(), [&](PatternEvent const& x, PatternEvent const& y) {
+			if (x.start != y.start || x.end != y.end) {
+				return false;
+			}
+
+			auto key = std::make_pair(x.pattern_idx, y.pattern_idx);
+			auto it = same_patterns.find(key);
+			if (it == same_patterns.end()) {
+				auto is_same = is_same_pattern(before.get_patterns()[x.pattern_idx], after.get_patterns()[y.pattern_idx]);
+				it = same_patterns.emplace(key, is_same).first;
+			}
+
+			return it->second;
+		});
+	}
+}
@@ -8,6 +8,9 @@
 #include <unordered_map>
 #include <optional>
 #include <memory>
+#include <filesystem>
+#include <stdint.h>
+#include <math.h>
 
 #include "note.h"
 
@@ -32,6 +35,12 @@ using MusicError = std::variant<
 	MusicErrorFile
 >;
 
+enum class AdsrCurve {
+	Linear,
+	// Each stage eases towards its target like an analog envelope.
+	Exponential
+};
+
 class Adsr {
 public:
 
@@ -47,17 +56,22 @@ public:
 	// The seconds until amplitude reaches 0 after 'release'
 	double release;
 
+	// The shape of each stage
+	AdsrCurve curve;
+
 public:
 
-	constexpr Adsr(double a, double d, double s, double r)
+	constexpr Adsr(double a, double d, double s, double r, AdsrCurve c = AdsrCurve::Linear)
 		: attack(a)
 		, decay(d)
 		, sustain(s)
 		, release(r)
+		, curve(c)
 	{}
 
 	/*
-	 * @brief Evaluates the amplitude of the ADSR given the parameters.
+	 * @brief Evaluates the amplitude of the linear ADSR given the parameters. Voices step
+	 * through the same shape incrementally through AdsrEnvelope instead.
 	 * @param elapsed_press The elapsed seconds since press
 	 * @param elapsed_release Optional elapsed seconds since release. If none, then release is not calculated.
 	 * @return The amplitude to multiply with a sample
@@ -69,7 +83,7 @@ public:
 		if (elapsed_press < attack) {
 			value = elapsed_press / attack;
 		} else if (elapsed_press < attack + decay) {
-			auto t = elapsed_press / (attack + decay);
+			auto t = (elapsed_press - attack) / decay;
 			value = 1.0 + (sustain - 1.0) * t;
 		} else {
 			value = sustain;
@@ -105,10 +119,11 @@ using InstrumentSource = std::variant<
 class Instrument {
 public:
 
-	Instrument(std::string name, InstrumentSource source, Adsr adsr)
+	Instrument(std::string name, InstrumentSource source, Adsr adsr, int polyphony = 0)
 		: _name(std::move(name))
 		, _source(std::move(source))
 		, _adsr(adsr)
+		, _polyphony(polyphony)
 	{}
 
 	std::string_view name() const {
@@ -123,11 +138,20 @@ public:
 		return _adsr;
 	}
 
+	/*
+	 * @brief The most notes each track playing the instrument plays at once, unless the track sets
+	 * its own. 0 for no limit.
+	*/
+	int polyphony() const {
+		return _polyphony;
+	}
+
 private:
 
 	std::string _name;
 	InstrumentSource _source;
 	Adsr _adsr;
+	int _polyphony;
 };
 
 class NoteEvent {
@@ -169,6 +193,10 @@ public:
 		return _name;
 	}
 
+	void reserve(size_t note_count) {
+		_events.reserve(note_count);
+	}
+
 	void add_note(NoteEvent note) {
 		_events.push_back(note);
 		_duration = std::max(_duration, note.end);
@@ -202,10 +230,11 @@ public:
 class Track {
 public:
 
-	Track(std::string name, int instrument_idx, double gain)
+	Track(std::string name, int instrument_idx, double gain, int polyphony = 0)
 		: _name(name)
 		, _instrument_idx(instrument_idx)
 		, _gain(gain)
+		, _polyphony(polyphony)
 	{}
 
 	std::string_view name() const {
@@ -215,17 +244,25 @@ public:
 	int instrument_idx() const { return _instrument_idx; }
 	std::vector<PatternEvent> const& events() const { return _events; }
 
+	void reserve(size_t pattern_count) {
+		_events.reserve(pattern_count);
+	}
+
 	void add_pattern(PatternEvent pattern) {
 		_events.push_back(std::move(pattern));
 	}
 
 	double gain() const { return _gain; }
 
+	// The most notes the track plays at once, 0 to follow its instrument. See music::get_polyphony.
+	int polyphony() const { return _polyphony; }
+
 private:
 
 	std::string _name;
 	int _instrument_idx;
 	double _gain;
+	int _polyphony;
 	std::vector<PatternEvent> _events;
 };
 
@@ -239,6 +276,14 @@ namespace music {
 		return beats * seconds_per_beat;
 	}
 
+	/*
+	 * Utility function that maps a value in resolution time to the nearest frame at a sample rate.
+	 * Frames are exact integers, so positions computed this way never drift over a song.
+	*/
+	inline int64_t map_resolution_to_frames(int value, int resolution, int bpm, int sample_rate) {
+		return llround(map_resolution_to_seconds(value, resolution, bpm) * sample_rate);
+	}
+
 	/**
 	 * Utility function that maps seconds to a resolution value.
 	*/
@@ -257,6 +302,28 @@ public:
 
 	static std::variant<Music, MusicError> import(std::string_view filename);
 
+	/*
+	 * @brief Loads a song written by export_compiled. Nothing is parsed, the tables are checked
+	 * and copied straight out of the file.
+	*/
+	static std::variant<Music, MusicError> load_compiled(std::string_view filename);
+
+	/*
+	 * @return Whether the file holds a compiled song rather than YAML.
+	*/
+	static bool is_compiled(std::string_view filename);
+
+	/*
+	 * @brief Writes the song with every repeat and pattern resolved, in a flat binary format
+	 * that loads without parsing. See music_compiled.cpp for the layout.
+	 * @param music_base_path The directory sample filenames are relative to. They are written
+	 * relative to the compiled file instead, so it can be kept anywhere.
+	*/
+	std::variant<std::monostate, MusicError> export_compiled(
+		std::string_view filename,
+		std::filesystem::path const& music_base_path
+	) const;
+
 	int get_bpm() const { return _bpm; }
 	double get_gain() const { return _gain; }
 
@@ -280,4 +347,22 @@ private:
 	std::vector<Instrument> _instruments;
 	std::vector<Pattern> _patterns;
 	std::vector<Track> _tracks;
-};
\ No newline at end of file
+};
+
+namespace music {
+	/*
+	 * @brief Compares a track to the track of the same name in another version of the song,
+	 * along with its instrument, the notes of the patterns it plays, and the song's tempo and
+	 * time signature.
+	 * @return Whether the track plays any differently, including when it is new.
+	*/
+	bool is_track_changed(Music const& before, Music const& after, int track_idx);
+
+	/*
+	 * @return The most notes a track plays at once, either its own limit or its instrument's.
+	 * 0 for no limit.
+	*/
+	inline int get_polyphony(Music const& music, Track const& track) {
+		return track.polyphony() > 0 ? track.polyphony() : music.get_instruments()[track.instrument_idx()].polyphony();
+	}
+}
@@ -0,0 +1,482 @@
+#include "music.h"
+
+#include <fstream>
+#include <type_traits>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * The compiled format holds a song once every pattern and repeat has been resolved into events.
+ * Everything is a fixed size record, so a song is read with a single read and a copy per table.
+ *
+ * The file starts with a Header, which gives the offset and count of each table. Tables are
+ * 8 byte aligned, so the file can just as well be mapped and read in place:
+ * - strings: the characters of every name and filename, referred to by StringRef
+ * - instruments: an InstrumentRecord per instrument
+ * - patterns: a PatternRecord per pattern, each a range of notes
+ * - tracks: a TrackRecord per track, each a range of pattern events
+ * - notes: a NoteRecord per note of every pattern
+ * - pattern_events: a PatternEventRecord per pattern played by every track
+ *
+ * Values are stored in the byte order of the machine that wrote them, and the magic reads
+ * differently on a machine of the other order, so such files are never loaded.
+*/
+namespace {
+	constexpr char MAGIC[4] = { 'W', 'A', 'V', 'C' };
+
+	// Bumped whenever the layout changes. Files of another version are not loaded.
+	constexpr uint32_t COMPILED_VERSION = 2;
+
+	struct Section {
+		uint64_t offset;
+		uint64_t count;
+	};
+
+	struct StringRef {
+		uint32_t offset;
+		uint32_t length;
+	};
+
+	struct Header {
+		char magic[4];
+		uint32_t version;
+		int32_t resolution_per_beat;
+		int32_t bpm;
+		int32_t beats_per_bar;
+		int32_t beat_value;
+		double gain;
+		Section strings;
+		Section instruments;
+		Section patterns;
+		Section tracks;
+		Section notes;
+		Section pattern_events;
+	};
+
+	enum class SourceKind : uint32_t {
+		Wave,
+		Sample
+	};
+
+	struct InstrumentRecord {
+		StringRef name;
+		SourceKind source_kind;
+		InstrumentSourceWave wave;
+		StringRef sample_filename;
+		AdsrCurve curve;
+		int32_t polyphony;
+		double attack;
+		double decay;
+		double sustain;
+		double release;
+	};
+
+	struct PatternRecord {
+		StringRef name;
+		uint32_t first_note;
+		uint32_t note_count;
+	};
+
+	struct TrackRecord {
+		StringRef name;
+		int32_t instrument_idx;
+		int32_t polyphony;
+		double gain;
+		uint32_t first_event;
+		uint32_t event_count;
+	};
+
+	struct NoteRecord {
+		int32_t start;
+		int32_t end;
+		uint8_t letter;
+		uint8_t octave;
+		uint8_t reserved[2];
+	};
+
+	struct PatternEventRecord {
+		int32_t pattern_idx;
+		int32_t start;
+		int32_t end;
+	};
+
+	static_assert(sizeof(InstrumentSourceWave) == 4 && sizeof(AdsrCurve) == 4);
+	static_assert(sizeof(Header) == 128);
+	static_assert(sizeof(InstrumentRecord) == 64);
+	static_assert(sizeof(PatternRecord) == 16);
+	static_assert(sizeof(TrackRecord) == 32);
+	static_assert(sizeof(NoteRecord) == 12);
+	static_assert(sizeof(PatternEventRecord) == 12);
+
+	/*
+	 * Lays out the tables of a compiled song one after the other.
+	*/
+	class CompiledWriter {
+	public:
+
+		CompiledWriter() {
+			_data.resize(sizeof(Header));
+		}
+
+		StringRef string(std::string_view str) {
+			auto ref = StringRef{ (uint32_t)_strings.size(), (uint32_t)str.size() };
+			_strings.insert(_strings.end(), str.begin(), str.end());
+			return ref;
+		}
+
+		template<class T>
+		Section table(std::vector<T> const& records) {
+			static_assert(std::is_trivially_copyable_v<T>);
+			return _append(records.data(), records.size(), sizeof(T));
+		}
+
+		Section strings() {
+			return _append(_strings.data(), _strings.size(), 1);
+		}
+
+		std::vector<char> finish(Header const& header) {
+			memcpy(_data.data(), &header, sizeof(Header));
+			return std::move(_data);
+		}
+
+	private:
+
+		Section _append(void const* data, size_t count, size_t size) {
+			_data.resize((_data.size() + 7) & ~(size_t)7);
+
+			auto section = Section{ _data.size(), count };
+			auto ptr = (char const*)data;
+			_data.insert(_data.end(), ptr, ptr + count * size);
+			return section;
+		}
+
+	private:
+
+		std::vector<char> _data;
+		std::vector<char> _strings;
+	};
+
+	/*
+	 * Reads the tables of a compiled song, checking that each lies within the file.
+	*/
+	class CompiledReader {
+	public:
+
+		CompiledReader(std::vector<char> data)
+			: _data(std::move(data))
+		{}
+
+		template<class T>
+		std::optional<std::vector<T>> table(Section section) const {
+			static_assert(std::is_trivially_copyable_v<T>);
+			if (!_contains(section, sizeof(T))) {
+				return std::nullopt;
+			}
+
+			std::vector<T> records((size_t)section.count);
+			memcpy(records.data(), _data.data() + section.offset, records.size() * sizeof(T));
+			return records;
+		}
+
+		bool set_strings(Section section) {
+			if (!_contains(section, 1)) {
+				return false;
+			}
+
+			_strings = std::string_view(_data.data() + section.offset, (size_t)section.count);
+			return true;
+		}
+
+		std::optional<std::string> string(StringRef ref) const {
+			if (ref.offset > _strings.size() || ref.length > _strings.size() - ref.offset) {
+				return std::nullopt;
+			}
+
+			return std::string(_strings.substr(ref.offset, ref.length));
+		}
+
+	private:
+
+		bool _contains(Section section, size_t size) const {
+			return section.offset <= _data.size()
+				&& section.count <= (_data.size() - section.offset) / size;
+		}
+
+	private:
+
+		std::vector<char> _data;
+		std::string_view _strings;
+	};
+
+	MusicError corrupt_error() {
+		return MusicErrorParse("The compiled song is corrupt");
+	}
+
+	/*
+	 * @brief Whether an enum read from the file is one of its values, from the first up to last.
+	 * Records hold whatever integer the file has, so both ends are checked.
+	*/
+	template <typename Enum>
+	bool is_in_range(Enum value, Enum last) {
+		return (int64_t)value >= 0 && (int64_t)value <= (int64_t)last;
+	}
+
+	/*
+	 * @brief Gets where a sample is found from the directory of the compiled file.
+	*/
+	std::string rebase_sample_path(
+		std::string const& filename,
+		std::filesystem::path const& music_base_path,
+		std::filesystem::path const& compiled_directory
+	) {
+		auto path = music_base_path / filename;
+
+		std::error_code ec;
+		auto relative = std::filesystem::relative(path, compiled_directory, ec);
+		if (!ec && !relative.empty()) {
+			return relative.generic_string();
+		}
+
+		auto absolute = std::filesystem::absolute(path, ec);
+		return (ec ? path : absolute).generic_string();
+	}
+}
+
+bool Music::is_compiled(std::string_view filename) {
+	std::ifstream file(std::string(filename), std::ios::binary);
+	char magic[sizeof(MAGIC)] = {0};
+	if (!file.read(magic, sizeof(magic))) {
+		return false;
+	}
+
+	return memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+std::variant<std::monostate, MusicError> Music::export_compiled(
+	std::string_view filename,
+	std::filesystem::path const& music_base_path
+) const {
+	auto compiled_directory = std::filesystem::path(filename).parent_path();
+	CompiledWriter writer;
+
+	std::vector<InstrumentRecord> instruments;
+	instruments.reserve(_instruments.size());
+	for (auto& instrument : _instruments) {
+		auto adsr = instrument.adsr();
+
+		InstrumentRecord record = {};
+		record.name = writer.string(instrument.name());
+		record.curve = adsr.curve;
+		record.polyphony = instrument.polyphony();
+		record.attack = adsr.attack;
+		record.decay = adsr.decay;
+		record.sustain = adsr.sustain;
+		record.release = adsr.release;
+
+		if (auto wave = std::get_if<InstrumentSourceWave>(&instrument.source())) {
+			record.source_kind = SourceKind::Wave;
+			record.wave = *wave;
+		} else if (auto sample = std::get_if<InstrumentSourceSample>(&instrument.source())) {
+			record.source_kind = SourceKind::Sample;
+			record.sample_filename = writer.string(rebase_sample_path(sample->filename, music_base_path, compiled_directory));
+		}
+
+		instruments.push_back(record);
+	}
+
+	std::vector<PatternRecord> patterns;
+	std::vector<NoteRecord> notes;
+	patterns.reserve(_patterns.size());
+	for (auto& pattern : _patterns) {
+		auto& events = pattern.events();
+		patterns.push_back({ writer.string(pattern.name()), (uint32_t)notes.size(), (uint32_t)events.size() });
+
+		for (auto& event : events) {
+			notes.push_back({ event.start, event.end, (uint8_t)event.note.letter, event.note.octave, {} });
+		}
+	}
+
+	std::vector<TrackRecord> tracks;
+	std::vector<PatternEventRecord> pattern_events;
+	tracks.reserve(_tracks.size());
+	for (auto& track : _tracks) {
+		auto& events = track.events();
+
+		TrackRecord record = {};
+		record.name = writer.string(track.name());
+		record.instrument_idx = track.instrument_idx();
+		record.gain = track.gain();
+		record.polyphony = track.polyphony();
+		record.first_event = (uint32_t)pattern_events.size();
+		record.event_count = (uint32_t)events.size();
+		tracks.push_back(record);
+
+		for (auto& event : events) {
+			pattern_events.push_back({ event.pattern_idx, event.start, event.end });
+		}
+	}
+
+	Header header = {};
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = COMPILED_VERSION;
+	header.resolution_per_beat = get_resolution_per_beat();
+	header.bpm = _bpm;
+	header.beats_per_bar = _time_signature.beats_per_bar;
+	header.beat_value = _time_signature.beat_value;
+	header.gain = _gain;
+	header.instruments = writer.table(instruments);
+	header.patterns = writer.table(patterns);
+	header.tracks = writer.table(tracks);
+	header.notes = writer.table(notes);
+	header.pattern_events = writer.table(pattern_events);
+	header.strings = writer.strings();
+
+	auto data = writer.finish(header);
+
+	std::ofstream file(std::string(filename), std::ios::binary | std::ios::trunc);
+	if (!file.is_open()) {
+		return MusicErrorFile{ strerror(errno) };
+	}
+
+	if (!file.write(data.data(), data.size())) {
+		return MusicErrorFile{ "Could not write the compiled song" };
+	}
+
+	return {};
+}
+
+std::variant<Music, MusicError> Music::load_compiled(std::string_view filename) {
+	std::ifstream file(std::string(filename), std::ios::binary | std::ios::ate);
+	if (!file.is_open()) {
+		return MusicErrorFile{ strerror(errno) };
+	}
+
+	auto file_size = (size_t)file.tellg();
+	std::vector<char> data(file_size);
+	file.seekg(0);
+	if (!file.read(data.data(), file_size)) {
+		return MusicErrorFile{ "Could not read the compiled song" };
+	}
+
+	file.close();
+
+	Header header;
+	if (data.size() < sizeof(Header)) {
+		return corrupt_error();
+	}
+
+	memcpy(&header, data.data(), sizeof(Header));
+	if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+		return MusicErrorParse("Not a compiled song");
+	}
+
+	if (header.version != COMPILED_VERSION || header.resolution_per_beat != get_resolution_per_beat()) {
+		return MusicErrorParse("The compiled song was written by another version of wavy, compile it again");
+	}
+
+	if (header.bpm <= 0 || header.beats_per_bar <= 0 || header.beat_value <= 0) {
+		return corrupt_error();
+	}
+
+	CompiledReader reader(std::move(data));
+	auto instrument_records = reader.table<InstrumentRecord>(header.instruments);
+	auto pattern_records = reader.table<PatternRecord>(header.patterns);
+	auto track_records = reader.table<TrackRecord>(header.tracks);
+	auto note_records = reader.table<NoteRecord>(header.notes);
+	auto pattern_event_records = reader.table<PatternEventRecord>(header.pattern_events);
+	if (!reader.set_strings(header.strings)
+		|| !instrument_records
+		|| !pattern_records
+		|| !track_records
+		|| !note_records
+		|| !pattern_event_records
+	) {
+		return corrupt_error();
+	}
+
+	std::vector<Instrument> instruments;
+	instruments.reserve(instrument_records->size());
+	for (auto& record : *instrument_records) {
+		auto name = reader.string(record.name);
+		if (!name || !is_in_range(record.curve, AdsrCurve::Exponential) || record.polyphony < 0) {
+			return corrupt_error();
+		}
+
+		InstrumentSource source = InstrumentSourceWave::Sine;
+		if (record.source_kind == SourceKind::Wave && is_in_range(record.wave, InstrumentSourceWave::Violin)) {
+			source = record.wave;
+		} else if (record.source_kind == SourceKind::Sample) {
+			auto sample_filename = reader.string(record.sample_filename);
+			if (!sample_filename) {
+				return corrupt_error();
+			}
+
+			source = InstrumentSourceSample{ std::move(*sample_filename) };
+		} else {
+			return corrupt_error();
+		}
+
+		auto adsr = Adsr(record.attack, record.decay, record.sustain, record.release, record.curve);
+		instruments.emplace_back(std::move(*name), std::move(source), adsr, record.polyphony);
+	}
+
+	std::vector<Pattern> patterns;
+	patterns.reserve(pattern_records->size());
+	for (auto& record : *pattern_records) {
+		auto name = reader.string(record.name);
+		if (!name || record.first_note > note_records->size() || record.note_count > note_records->size() - record.first_note) {
+			return corrupt_error();
+		}
+
+		Pattern pattern(std::move(*name));
+		pattern.reserve(record.note_count);
+		for (uint32_t i = 0; i < record.note_count; ++i) {
+			auto& note = (*note_records)[record.first_note + i];
+			if (note.letter > (uint8_t)Letter::B || note.octave >= 10) {
+				return corrupt_error();
+			}
+
+			pattern.add_note(NoteEvent(Note((Letter)note.letter, note.octave), note.start, note.end));
+		}
+
+		patterns.push_back(std::move(pattern));
+	}
+
+	std::vector<Track> tracks;
+	tracks.reserve(track_records->size());
+	for (auto& record : *track_records) {
+		auto name = reader.string(record.name);
+		if (!name
+			|| record.instrument_idx < 0
+			|| (size_t)record.instrument_idx >= instruments.size()
+			|| record.polyphony < 0
+			|| record.first_event > pattern_event_records->size()
+			|| record.event_count > pattern_event_records->size() - record.first_event
+		) {
+			return corrupt_error();
+		}
+
+		Track track(std::move(*name), record.instrument_idx, record.gain, record.polyphony);
+		track.reserve(record.event_count);
+		for (uint32_t i = 0; i < record.event_count; ++i) {
+			auto& event = (*pattern_event_records)[record.first_event + i];
+			if (event.pattern_idx < 0 || (size_t)event.pattern_idx >= patterns.size()) {
+				return corrupt_error();
+			}
+
+			track.add_pattern(PatternEvent(event.pattern_idx, event.start, event.end));
+		}
+
+		tracks.push_back(std::move(track));
+	}
+
+	Music music;
+	music._time_signature = TimeSignature{ header.beats_per_bar, header.beat_value };
+	music._bpm = header.bpm;
+	music._gain = header.gain;
+	music._patterns = std::move(patterns);
+	music._instruments = std::move(instruments);
+	music._tracks = std::move(tracks);
+
+	return music;
+}
@@ -1,6 +1,8 @@
 #include "note.h"
 
 #include <cstdlib>
+#include <stdio.h>
+#include <string.h>
 
 std::variant<Note, NoteParseError> Note::from_str(std::string_view str) {
 	if (str.length() < 2 || str.length() > 3) {
@@ -2,6 +2,10 @@
 
 #include "source.h"
 
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+
 #define _USE_MATH_DEFINES
 #include <math.h>
 
@@ -22,59 +26,214 @@ namespace detail {
 		return asin(sin(phase)) * M_2_PI;
 	}
 
+	/*
+	 * The number of samples in a wave table. Larger tables are more accurate, especially when
+	 * band limited, as they can hold more harmonics.
+	*/
+#ifdef WAVY_WAVE_TABLE_SIZE
+	constexpr int NUM_WAVE_SAMPLES = WAVY_WAVE_TABLE_SIZE;
+#else
 	constexpr int NUM_WAVE_SAMPLES = 128;
-
+#endif
+
+	static_assert(NUM_WAVE_SAMPLES >= 2 && (NUM_WAVE_SAMPLES & (NUM_WAVE_SAMPLES - 1)) == 0, "Wave tables must be a power of two in size");
+
+	/*
+	 * Whether saw, square and triangle waves, as well as the partials of additive waves, are kept
+	 * under the Nyquist frequency so that high notes do not alias.
+	*/
+#ifdef WAVY_BAND_LIMITED_WAVES
+	constexpr bool BAND_LIMITED_WAVES = WAVY_BAND_LIMITED_WAVES;
+#else
+	constexpr bool BAND_LIMITED_WAVES = false;
+#endif
+
+	/*
+	 * A single cycle of a wave, sampled N times.
+	 * Phases are measured in table samples, i.e. in [0, N), so that wrapping a phase is a
+	 * subtraction rather than an fmod.
+	*/
 	template<int N>
 	class WaveTable {
 	public:
 
-		constexpr WaveTable(double(*fn)(int, int)) {
+		static constexpr int SIZE = N;
+
+		/*
+		 * @param fn Gives the value of the wave at a phase in radians.
+		*/
+		template<class F>
+		WaveTable(F fn) {
 			for (int i = 0; i < N; ++i) {
-				_table[i] = fn(i, N);
+				_table[i] = fn(2.0 * M_PI * i / N);
 			}
+
+			// Repeats the first sample so interpolating past the last sample needs no wrap.
+			_table[N] = _table[0];
+		}
+
+		/*
+		 * @brief The phase increment per sample of a wave at freq.
+		*/
+		static constexpr double increment(double freq, int sample_rate) {
+			return freq * N / sample_rate;
+		}
+
+		/*
+		 * @brief Whether a wave at the increment is under the Nyquist frequency.
+		*/
+		static constexpr bool is_audible(double increment) {
+			return increment < N * 0.5;
+		}
+
+		static constexpr double wrap(double phase) {
+			return phase - N * (double)(int64_t)(phase * (1.0 / N));
 		}
 
 		constexpr double evaluate(double phase) const {
-			phase /= 2.0 * M_PI;
-			phase *= N;
-			auto lerp = phase - floor(phase);
-			int left_sample = (int)floor(phase) % N;
-			int right_sample = (int)ceil(phase) % N;
+			auto idx = std::min((int)phase, N - 1);
+			auto lerp = phase - idx;
+
+			return _table[idx] + (_table[idx + 1] - _table[idx]) * lerp;
+		}
+
+		/*
+		 * @brief Adds frames samples of the wave, scaled by amp, to out. Each sample's phase is
+		 * computed from the start of the block rather than carried over from the previous sample,
+		 * so the loop has no dependency between iterations and can be vectorized.
+		 * @return The phase following the block.
+		*/
+		double accumulate(double phase, double increment, double amp, float* out, int frames) const {
+			for (int i = 0; i < frames; ++i) {
+				auto sample_phase = wrap(phase + i * increment);
+				out[i] += (float)(evaluate(sample_phase) * amp);
+			}
+
+			return wrap(phase + frames * increment);
+		}
+
+		/*
+		 * @brief Same as accumulate, but overwrites out.
+		*/
+		double render(double phase, double increment, float* out, int frames) const {
+			for (int i = 0; i < frames; ++i) {
+				auto sample_phase = wrap(phase + i * increment);
+				out[i] = (float)evaluate(sample_phase);
+			}
+
+			return wrap(phase + frames * increment);
+		}
+
+	private:
+
+		double _table[N + 1];
+	};
+
+	/*
+	 * A wave table per octave, each holding only the harmonics that stay under the Nyquist
+	 * frequency for notes in that octave. Level k holds the first (N / 2) >> k harmonics.
+	*/
+	template<int N>
+	class MipMappedWaveTable {
+	public:
+
+		/*
+		 * @param coefficient Gives the amplitude of the sine at a harmonic in the wave's Fourier series.
+		*/
+		MipMappedWaveTable(double(*coefficient)(int)) {
+			_levels.reserve(LEVEL_COUNT);
+			for (int harmonics = N / 2; harmonics >= 1; harmonics /= 2) {
+				_levels.emplace_back([=](double phase) {
+					auto value = 0.0;
+					for (int h = 1; h <= harmonics; ++h) {
+						value += coefficient(h) * sin(h * phase);
+					}
+					return value;
+				});
+			}
+		}
 
-			return _table[left_sample] * (1.0 - lerp) + _table[right_sample] * lerp;
+		/*
+		 * @brief The richest table that plays at the increment without aliasing.
+		*/
+		WaveTable<N> const& level(double increment) const {
+			size_t level = 0;
+			while (level + 1 < _levels.size() && ((N / 2) >> level) * increment > N * 0.5) {
+				level += 1;
+			}
+
+			return _levels[level];
 		}
 
 	private:
 
-		double _table[N];
+		static constexpr int LEVEL_COUNT = [] {
+			int count = 0;
+			for (int harmonics = N / 2; harmonics >= 1; harmonics /= 2) {
+				count += 1;
+			}
+			return count;
+		}();
+
+		std::vector<WaveTable<N>> _levels;
 	};
 
-	WaveTable<NUM_WAVE_SAMPLES> const SINE_TABLE([](int current_sample, int num_samples) {
-		auto phase = (double)current_sample / num_samples;
-		phase *= 2.0 * M_PI;
-		return sine_wave(phase);
-	});
-
-	WaveTable<NUM_WAVE_SAMPLES> const SAW_TABLE([](int current_sample, int num_samples) {
-		auto phase = (double)current_sample / num_samples;
-		phase *= 2.0 * M_PI;
-		return saw_wave(phase);
-	});
-	
-	WaveTable<NUM_WAVE_SAMPLES> const TRIANGLE_WAVE([](int current_sample, int num_samples) {
-		auto phase = (double)current_sample / num_samples;
-		phase *= 2.0 * M_PI;
-		return triangle_wave(phase);
-	});
-
-	WaveTable<NUM_WAVE_SAMPLES> const SQUARE_WAVE([](int current_sample, int num_samples) {
-		auto phase = (double)current_sample / num_samples;
-		phase *= 2.0 * M_PI;
-		return square_wave(phase);
-	});
+	using Table = WaveTable<NUM_WAVE_SAMPLES>;
+
+	/*
+	 * Tables are built the first time they are used, once for the whole program.
+	*/
+	inline Table const& sine_table() {
+		static Table const table([](double phase) {
+			return sine_wave(phase);
+		});
+		return table;
+	}
+
+	inline Table const& saw_table(double increment) {
+		if constexpr (BAND_LIMITED_WAVES) {
+			static MipMappedWaveTable<NUM_WAVE_SAMPLES> const tables([](int h) {
+				return (h % 2 == 0 ? -M_2_PI : M_2_PI) / h;
+			});
+			return tables.level(increment);
+		} else {
+			static Table const table([](double phase) {
+				return saw_wave(phase);
+			});
+			return table;
+		}
+	}
+
+	inline Table const& square_table(double increment) {
+		if constexpr (BAND_LIMITED_WAVES) {
+			static MipMappedWaveTable<NUM_WAVE_SAMPLES> const tables([](int h) {
+				return h % 2 == 0 ? 0.0 : 2.0 * M_2_PI / h;
+			});
+			return tables.level(increment);
+		} else {
+			static Table const table([](double phase) {
+				return square_wave(phase);
+			});
+			return table;
+		}
+	}
+
+	inline Table const& triangle_table(double increment) {
+		if constexpr (BAND_LIMITED_WAVES) {
+			static MipMappedWaveTable<NUM_WAVE_SAMPLES> const tables([](int h) {
+				return h % 2 == 0 ? 0.0 : ((h / 2) % 2 == 0 ? 2.0 : -2.0) * M_2_PI * M_2_PI / (h * h);
+			});
+			return tables.level(increment);
+		} else {
+			static Table const table([](double phase) {
+				return triangle_wave(phase);
+			});
+			return table;
+		}
+	}
 }
 
-double mod(double n, double d) {
+inline double mod(double n, double d) {
 	n = fmod(n, d);
 	if (n < 0.0) {
 		n += d;
@@ -83,7 +242,7 @@ double mod(double n, double d) {
 	return n;
 }
 
-double saturate(double input) {
+inline double saturate(double input) {
 	return tanh(input);
 }
 
@@ -91,8 +250,9 @@ class SineWave : public Source {
 public:
 
 	SineWave(double freq)
-		: _freq(freq)
+		: _increment(detail::Table::increment(freq, 48000))
 		, _phase(0.0)
+		, _table(&detail::sine_table())
 	{}
 
 	int sample_rate() const {
@@ -104,26 +264,41 @@ public:
 	}
 
 	std::optional<double> next_sample() {
-		auto value = detail::SINE_TABLE.evaluate(_phase);
-		auto dt = 1.0 / sample_rate();
-		_phase += 2.0*M_PI * _freq * dt;
-		_phase = fmod(_phase, 2.0*M_PI);
+		return _next_value();
+	}
 
-		return value;
+	int fill(float* out, int frames) {
+		_phase = _table->render(_phase, _increment, out, frames);
+		return frames;
+	}
+
+	// Lands on the same phase as rendering the frames would.
+	int64_t skip(int64_t frames) {
+		_phase = detail::Table::wrap(_phase + frames * _increment);
+		return frames;
 	}
 
 private:
 
-	double _freq;
+	double _next_value() {
+		auto value = _table->evaluate(_phase);
+		_phase = detail::Table::wrap(_phase + _increment);
+
+		return value;
+	}
+
+	double _increment;
 	double _phase;
+	detail::Table const* _table;
 };
 
 class SawWave : public Source {
 public:
 
 	SawWave(double freq)
-		: _freq(freq)
+		: _increment(detail::Table::increment(freq, 48000))
 		, _phase(0.0)
+		, _table(&detail::saw_table(_increment))
 	{}
 
 	int sample_rate() const {
@@ -135,26 +310,40 @@ public:
 	}
 
 	std::optional<double> next_sample() {
-		auto value = detail::SAW_TABLE.evaluate(_phase);
-		auto dt = 1.0 / sample_rate();
-		_phase += 2.0*M_PI * _freq * dt;
-		_phase = fmod(_phase, 2.0*M_PI);
+		return _next_value();
+	}
 
-		return value;
+	int fill(float* out, int frames) {
+		_phase = _table->render(_phase, _increment, out, frames);
+		return frames;
+	}
+
+	int64_t skip(int64_t frames) {
+		_phase = detail::Table::wrap(_phase + frames * _increment);
+		return frames;
 	}
 
 private:
 
-	double _freq;
+	double _next_value() {
+		auto value = _table->evaluate(_phase);
+		_phase = detail::Table::wrap(_phase + _increment);
+
+		return value;
+	}
+
+	double _increment;
 	double _phase;
+	detail::Table const* _table;
 };
 
 class TriangleWave : public Source {
 public:
 
 	TriangleWave(double freq)
-		: _freq(freq)
+		: _increment(detail::Table::increment(freq, 48000))
 		, _phase(0.0)
+		, _table(&detail::triangle_table(_increment))
 	{}
 
 	int sample_rate() const {
@@ -166,26 +355,40 @@ public:
 	}
 
 	std::optional<double> next_sample() {
-		auto value = detail::TRIANGLE_WAVE.evaluate(_phase);
-		auto dt = 1.0 / sample_rate();
-		_phase += 2.0*M_PI * _freq * dt;
-		_phase = fmod(_phase, 2.0*M_PI);
+		return _next_value();
+	}
 
-		return value;
+	int fill(float* out, int frames) {
+		_phase = _table->render(_phase, _increment, out, frames);
+		return frames;
+	}
+
+	int64_t skip(int64_t frames) {
+		_phase = detail::Table::wrap(_phase + frames * _increment);
+		return frames;
 	}
 
 private:
 
-	double _freq;
+	double _next_value() {
+		auto value = _table->evaluate(_phase);
+		_phase = detail::Table::wrap(_phase + _increment);
+
+		return value;
+	}
+
+	double _increment;
 	double _phase;
+	detail::Table const* _table;
 };
 
 class SquareWave : public Source {
 public:
 
 	SquareWave(double freq)
-		: _freq(freq)
+		: _increment(detail::Table::increment(freq, 48000))
 		, _phase(0.0)
+		, _table(&detail::square_table(_increment))
 	{}
 
 	int sample_rate() const {
@@ -197,27 +400,38 @@ public:
 	}
 
 	std::optional<double> next_sample() {
-		auto value = detail::SQUARE_WAVE.evaluate(_phase);
-		auto dt = 1.0 / sample_rate();
-		_phase += 2.0*M_PI * _freq * dt;
-		_phase = fmod(_phase, 2.0*M_PI);
+		return _next_value();
+	}
 
-		return value;
+	int fill(float* out, int frames) {
+		_phase = _table->render(_phase, _increment, out, frames);
+		return frames;
+	}
+
+	int64_t skip(int64_t frames) {
+		_phase = detail::Table::wrap(_phase + frames * _increment);
+		return frames;
 	}
 
 private:
 
-	double _freq;
+	double _next_value() {
+		auto value = _table->evaluate(_phase);
+		_phase = detail::Table::wrap(_phase + _increment);
+
+		return value;
+	}
+
+	double _increment;
 	double _phase;
+	detail::Table const* _table;
 };
 
 class PianoWave : public Source {
 public:
 
 	PianoWave(double freq)
-		: _freqs{ freq, 0.0 }
-		, _phases{ 0.0 }
-		, _amps{
+		: _amps{
 			1.0,
 			0.15,
 			0.17,
@@ -228,9 +442,19 @@ public:
 			0.067,
 			0.05
 		}
+		, _phases{ 0.0 }
+		, _partial_count(9)
+		, _table(&detail::sine_table())
 	{
-		for (int i = 1; i < 9; ++i) {
-			_freqs[i] = freq * (i + 1);
+		for (int i = 0; i < 9; ++i) {
+			_increments[i] = detail::Table::increment(freq * (i + 1), 48000);
+		}
+
+		// Partials are in increasing order of frequency, so only the ones past Nyquist are cut.
+		if constexpr (detail::BAND_LIMITED_WAVES) {
+			while (_partial_count > 0 && !detail::Table::is_audible(_increments[_partial_count - 1])) {
+				_partial_count -= 1;
+			}
 		}
 	}
 
@@ -243,31 +467,51 @@ public:
 	}
 
 	std::optional<double> next_sample() {
-		auto sum = 0.0;
-		auto dt = 1.0 / sample_rate();
-		for (int i = 0; i < 9; ++i) {
-			sum += detail::SINE_TABLE.evaluate(_phases[i]) * _amps[i];
-			_phases[i] += 2.0*M_PI * _freqs[i] * dt;
-			_phases[i] = fmod(_phases[i], 2.0*M_PI);
+		return _next_value();
+	}
+
+	int fill(float* out, int frames) {
+		// Renders one partial at a time across the block rather than every partial per sample.
+		std::fill_n(out, frames, 0.0f);
+		for (int i = 0; i < _partial_count; ++i) {
+			_phases[i] = _table->accumulate(_phases[i], _increments[i], _amps[i], out, frames);
 		}
 
-		return sum;
+		return frames;
+	}
+
+	int64_t skip(int64_t frames) {
+		for (int i = 0; i < _partial_count; ++i) {
+			_phases[i] = detail::Table::wrap(_phases[i] + frames * _increments[i]);
+		}
+
+		return frames;
 	}
 
 private:
 
-	double _freqs[9];
+	double _next_value() {
+		auto sum = 0.0;
+		for (int i = 0; i < _partial_count; ++i) {
+			sum += _table->evaluate(_phases[i]) * _amps[i];
+			_phases[i] = detail::Table::wrap(_phases[i] + _increments[i]);
+		}
+
+		return sum;
+	}
+
+	double _increments[9];
 	double _amps[9];
 	double _phases[9];
+	int _partial_count;
+	detail::Table const* _table;
 };
 
 class ViolinWave : public Source {
 public:
 
 	ViolinWave(double freq)
-		: _freqs{ freq, 0.0 }
-		, _phases{ 0.0 }
-		, _amps{
+		: _amps{
 			0.447,
 			1.0,
 			0.794,
@@ -280,9 +524,19 @@ public:
 			0.0794,
 			0.178
 		}
+		, _phases{ 0.0 }
+		, _partial_count(9)
+		, _table(&detail::sine_table())
 	{
-		for (int i = 1; i < 9; ++i) {
-			_freqs[i] = _freqs[0] * (i + 1);
+		for (int i = 0; i < 9; ++i) {
+			_increments[i] = detail::Table::increment(freq * (i + 1), 48000);
+		}
+
+		// Partials are in increasing order of frequency, so only the ones past Nyquist are cut.
+		if constexpr (detail::BAND_LIMITED_WAVES) {
+			while (_partial_count > 0 && !detail::Table::is_audible(_increments[_partial_count - 1])) {
+				_partial_count -= 1;
+			}
 		}
 	}
 
@@ -295,20 +549,42 @@ public:
 	}
 
 	std::optional<double> next_sample() {
-		auto sum = 0.0;
-		auto dt = 1.0 / sample_rate();
-		for (int i = 0; i < 9; ++i) {
-			sum += detail::SINE_TABLE.evaluate(_phases[i]) * _amps[i];
-			_phases[i] += 2.0*M_PI * _freqs[i] * dt;
-			_phases[i] = fmod(_phases[i], 2.0*M_PI);
+		return _next_value();
+	}
+
+	int fill(float* out, int frames) {
+		// Renders one partial at a time across the block rather than every partial per sample.
+		std::fill_n(out, frames, 0.0f);
+		for (int i = 0; i < _partial_count; ++i) {
+			_phases[i] = _table->accumulate(_phases[i], _increments[i], _amps[i], out, frames);
 		}
 
-		return sum;
+		return frames;
+	}
+
+	int64_t skip(int64_t frames) {
+		for (int i = 0; i < _partial_count; ++i) {
+			_phases[i] = detail::Table::wrap(_phases[i] + frames * _increments[i]);
+		}
+
+		return frames;
 	}
 
 private:
 
-	double _freqs[11];
+	double _next_value() {
+		auto sum = 0.0;
+		for (int i = 0; i < _partial_count; ++i) {
+			sum += _table->evaluate(_phases[i]) * _amps[i];
+			_phases[i] = detail::Table::wrap(_phases[i] + _increments[i]);
+		}
+
+		return sum;
+	}
+
+	double _increments[11];
 	double _amps[11];
 	double _phases[11];
+	int _partial_count;
+	detail::Table const* _table;
 };
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include "pool.h"
+
+#include <mutex>
+#include <new>
+#include <algorithm>
+
+namespace pool {
+	namespace {
+		constexpr size_t MIN_BLOCK_SIZE = 16;
+		constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+		// One class for every power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE.
+		constexpr int NUM_SIZE_CLASSES = 13;
+		static_assert((MIN_BLOCK_SIZE << (NUM_SIZE_CLASSES - 1)) == MAX_BLOCK_SIZE);
+
+		struct FreeBlock {
+			FreeBlock* next;
+		};
+
+		struct SizeClass {
+			std::mutex mtx;
+			FreeBlock* free_list = nullptr;
+		};
+
+		SizeClass& get_size_class(int idx) {
+			// Intentionally never destroyed, so sources in static storage can still
+			// be freed during shutdown.
+			static SizeClass* size_classes = new SizeClass[NUM_SIZE_CLASSES];
+			return size_classes[idx];
+		}
+
+		int get_size_class_idx(size_t size) {
+			int idx = 0;
+			size_t block_size = MIN_BLOCK_SIZE;
+			while (block_size < size) {
+				block_size <<= 1;
+				idx += 1;
+			}
+
+			return idx;
+		}
+
+		void refill(SizeClass& size_class, size_t block_size) {
+			// Blocks are carved out of a single chunk, and chunks are kept for the
+			// lifetime of the program.
+			auto chunk_size = std::max(CHUNK_SIZE, block_size);
+			auto chunk = static_cast<char*>(::operator new(chunk_size));
+
+			for (size_t offset = 0; offset + block_size <= chunk_size; offset += block_size) {
+				auto block = reinterpret_cast<FreeBlock*>(chunk + offset);
+				block->next = size_class.free_list;
+				size_class.free_list = block;
+			}
+		}
+	}
+
+	void* allocate(size_t size) {
+		if (size > MAX_BLOCK_SIZE) {
+			return ::operator new(size);
+		}
+
+		auto idx = get_size_class_idx(size);
+		auto& size_class = get_size_class(idx);
+
+		std::scoped_lock lk(size_class.mtx);
+
+		if (!size_class.free_list) {
+			refill(size_class, MIN_BLOCK_SIZE << idx);
+		}
+
+		auto block = size_class.free_list;
+		size_class.free_list = block->next;
+
+		return block;
+	}
+
+	void deallocate(void* ptr, size_t size) {
+		if (!ptr) {
+			return;
+		}
+
+		if (size > MAX_BLOCK_SIZE) {
+			::operator delete(ptr);
+			return;
+		}
+
+		auto& size_class = get_size_class(get_size_class_idx(size));
+
+		std::scoped_lock lk(size_class.mtx);
+
+		auto block = static_cast<FreeBlock*>(ptr);
+		block->next = size_class.free_list;
+		size_class.free_list = block;
+	}
+}
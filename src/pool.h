@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+/*
+ * Recycles memory for objects that are created and destroyed for every note, such as sources.
+ * Memory is handed out in power of two size classes, and freed blocks are kept for the next
+ * allocation of the same class rather than given back to the heap. Once enough voices have
+ * played, new voices are built entirely out of recycled memory.
+ *
+ * Safe to use from multiple threads.
+*/
+namespace pool {
+	// Allocations larger than this go straight to the heap.
+	constexpr size_t MAX_BLOCK_SIZE = 64 * 1024;
+
+	void* allocate(size_t size);
+	void deallocate(void* ptr, size_t size);
+
+	/*
+	 * Allocator to let standard containers owned by sources use the pool.
+	*/
+	template<class T>
+	class Allocator {
+	public:
+
+		using value_type = T;
+
+		Allocator() = default;
+
+		template<class U>
+		Allocator(Allocator<U> const&) {}
+
+		T* allocate(size_t count) {
+			return static_cast<T*>(pool::allocate(count * sizeof(T)));
+		}
+
+		void deallocate(T* ptr, size_t count) {
+			pool::deallocate(ptr, count * sizeof(T));
+		}
+
+		template<class U>
+		bool operator==(Allocator<U> const&) const { return true; }
+
+		template<class U>
+		bool operator!=(Allocator<U> const&) const { return false; }
+	};
+
+	template<class T>
+	using Vector = std::vector<T, Allocator<T>>;
+}
@@ -0,0 +1,668 @@
+#include "render.h"
+#include "source_builder.h"
+#include "oscillators.h"
+#include "voice.h"
+
+#include <algorithm>
+#include <type_traits>
+#include <math.h>
+
+namespace render {
+	template<class V, class Osc>
+	SourcePtr create_voice(Osc osc, Adsr adsr, ConstantGain gain, uint64_t duration_ns) {
+		AdsrEnvelope envelope(adsr, osc.sample_rate(), duration_ns);
+		return std::make_unique<V>(std::move(osc), envelope, gain, duration_ns);
+	}
+
+	/*
+	 * @brief Gets what the voice of a note competes with for its track's polyphony.
+	 * @param group Tells the track apart from the others sharing the mixer.
+	*/
+	VoiceTag get_voice_tag(Music const& music, Track const& track, int group, Note note) {
+		return VoiceTag{ group, music::get_polyphony(music, track), detail::get_note_idx(note.letter, note.octave) };
+	}
+
+	std::optional<SourcePtr> create_source_from_note_event(
+		NoteEvent const& event,
+		Instrument const& instrument,
+		double gain,
+		int resolution_per_beat,
+		int bpm,
+		std::shared_ptr<SampleData const> const& sample_data
+	) {
+		auto freq = event.note.freq();
+		auto adsr = instrument.adsr();
+
+		// Need to allow time for adsr release to have effect.
+		auto duration_seconds = music::map_resolution_to_seconds(event.end - event.start, resolution_per_beat, bpm) + adsr.release;
+
+		if (auto wave = std::get_if<InstrumentSourceWave>(&instrument.source())) {
+			auto duration_ns = (uint64_t)(duration_seconds * 1e6) * 1000;
+			ConstantGain voice_gain{ gain };
+
+			switch (*wave) {
+				default:
+				case InstrumentSourceWave::Sine:
+					return create_voice<SineVoice>(SineWave(freq), adsr, voice_gain, duration_ns);
+				case InstrumentSourceWave::Triangle:
+					return create_voice<TriangleVoice>(TriangleWave(freq), adsr, voice_gain, duration_ns);
+				case InstrumentSourceWave::Square:
+					return create_voice<SquareVoice>(SquareWave(freq), adsr, voice_gain, duration_ns);
+				case InstrumentSourceWave::Saw:
+					return create_voice<SawVoice>(SawWave(freq), adsr, voice_gain, duration_ns);
+				case InstrumentSourceWave::Piano:
+					return create_voice<PianoVoice>(PianoWave(freq), adsr, voice_gain, duration_ns);
+				case InstrumentSourceWave::Violin:
+					return create_voice<ViolinVoice>(ViolinWave(freq), adsr, voice_gain, duration_ns);
+			}
+		} else if (std::holds_alternative<InstrumentSourceSample>(instrument.source())) {
+			// Already logged when the instrument's samples were looked up.
+			if (!sample_data) {
+				return std::nullopt;
+			}
+
+			return SourceBuilder(std::make_unique<SamplePlayer>(sample_data))
+				.amplify(gain)
+				.build();
+		}
+
+		return std::nullopt;
+	}
+
+	bool load_samples(Music const& music, std::filesystem::path const& music_base_path, SampleCache& samples) {
+		for (auto& instrument : music.get_instruments()) {
+			if (auto sample = std::get_if<InstrumentSourceSample>(&instrument.source())) {
+				auto path = (music_base_path / sample->filename);
+				if (!samples.load(path)) {
+					fprintf(stderr, "[ERROR] Could not find sample at '%s'\n", path.string().c_str());
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	std::shared_ptr<SampleData const> get_instrument_sample(Instrument const& instrument, std::filesystem::path const& music_base_path, SampleCache& samples) {
+		auto sample = std::get_if<InstrumentSourceSample>(&instrument.source());
+		if (!sample) {
+			return nullptr;
+		}
+
+		auto path = (music_base_path / sample->filename);
+		auto data = samples.load(path);
+		if (!data) {
+			fprintf(stderr, "[ERROR] Could not find sample at '%s'\n", path.string().c_str());
+		}
+
+		return data;
+	}
+
+	/*
+	 * @brief The longest a note keeps sounding past its end, which is its release, or the length
+	 * of its sample for sample instruments as those play out whatever the note's length.
+	*/
+	static double get_tail_seconds(Instrument const& instrument, SampleData const* sample_data) {
+		if (std::holds_alternative<InstrumentSourceSample>(instrument.source())) {
+			if (sample_data) {
+				return (double)sample_data->frame_count() / sample_data->sample_rate;
+			}
+
+			return 0.0;
+		}
+
+		return instrument.adsr().release;
+	}
+
+	void apply_master(float* samples, int sample_count, double gain) {
+		for (int i = 0; i < sample_count; ++i) {
+			samples[i] = (float)tanh(samples[i] * gain);
+		}
+	}
+
+	NoteStarter::NoteStarter(
+		Music const& music,
+		NoteScheduler scheduler,
+		std::filesystem::path music_base_path,
+		std::shared_ptr<SampleCache> samples,
+		std::shared_ptr<MixerController> mixer_controller,
+		int sample_rate,
+		uint64_t frame_offset
+	)
+		: _music(&music)
+		, _scheduler(std::move(scheduler))
+		, _mixer_controller(std::move(mixer_controller))
+		, _sample_rate(sample_rate)
+		, _frame_offset(frame_offset)
+	{
+		// Looked up once rather than for every note, which would go through the cache's lock.
+		for (auto& instrument : music.get_instruments()) {
+			_instrument_samples.push_back(get_instrument_sample(instrument, music_base_path, *samples));
+		}
+
+		_next_start_frame = _peek_start_frame();
+	}
+
+	void NoteStarter::start_until(uint64_t frame) {
+		while (_next_start_frame < frame) {
+			auto note = _scheduler.next();
+
+			// Samples are loaded upfront, so this only fails if a sample was not part of the
+			// song's instruments. The note is skipped rather than stopping the song.
+			if (auto source_opt = _create_source(note)) {
+				auto tag = get_voice_tag(*_music, _music->get_tracks()[note.track_idx], note.track_idx, note.event.note);
+				_mixer_controller->add(std::move(*source_opt), _next_start_frame, tag);
+			}
+
+			_next_start_frame = _peek_start_frame();
+		}
+	}
+
+	void NoteStarter::fast_forward(uint64_t frame) {
+		if (frame <= _frame_offset) {
+			return;
+		}
+
+		// Only notes starting within the longest a note sounds for can still be sounding at frame,
+		// so every note before those is sought past.
+		auto resolution = Music::get_resolution_per_beat();
+		auto bpm = _music->get_bpm();
+
+		int longest_note = 0;
+		for (auto& pattern : _music->get_patterns()) {
+			for (auto& event : pattern.events()) {
+				longest_note = std::max(longest_note, event.end - event.start);
+			}
+		}
+
+		auto longest_tail = 0.0;
+		auto& instruments = _music->get_instruments();
+		for (int i = 0; i < (int)instruments.size(); ++i) {
+			longest_tail = std::max(longest_tail, get_tail_seconds(instruments[i], _instrument_samples[i].get()));
+		}
+
+		auto seconds = (double)(frame - _frame_offset) / _sample_rate;
+		auto start = music::map_seconds_to_resolution(seconds, resolution, bpm);
+		auto lookback = (int64_t)longest_note + music::map_seconds_to_resolution(longest_tail, resolution, bpm) + 1;
+		_scheduler.seek((int)std::max<int64_t>(0, start - lookback));
+		_next_start_frame = _peek_start_frame();
+
+		while (_next_start_frame < frame) {
+			auto note_frame = _next_start_frame;
+			auto note = _scheduler.next();
+			_next_start_frame = _peek_start_frame();
+
+			auto source_opt = _create_source(note);
+			if (!source_opt) {
+				continue;
+			}
+
+			// Skipped at the source's own rate, as it is only converted to the mix's once added.
+			auto& source = *source_opt;
+			auto skip_frames = (int64_t)((frame - note_frame) * source->sample_rate() / _sample_rate);
+			if (source->skip(skip_frames) == skip_frames) {
+				auto tag = get_voice_tag(*_music, _music->get_tracks()[note.track_idx], note.track_idx, note.event.note);
+				_mixer_controller->add(std::move(source), frame, tag);
+			}
+		}
+	}
+
+	std::optional<SourcePtr> NoteStarter::_create_source(ScheduledNote const& note) const {
+		auto& track = _music->get_tracks()[note.track_idx];
+		return create_source_from_note_event(
+			note.event,
+			_music->get_instruments()[track.instrument_idx()],
+			track.gain(),
+			Music::get_resolution_per_beat(),
+			_music->get_bpm(),
+			_instrument_samples[track.instrument_idx()]
+		);
+	}
+
+	void NoteStarter::skip_until(uint64_t frame) {
+		if (frame <= _frame_offset) {
+			return;
+		}
+
+		// Seeks to just before the frame, as the frames notes start on are rounded. The notes
+		// left before it are then skipped one by one.
+		auto seconds = (double)(frame - _frame_offset) / _sample_rate;
+		auto start = music::map_seconds_to_resolution(seconds, Music::get_resolution_per_beat(), _music->get_bpm());
+		_scheduler.seek(start - 1);
+		_next_start_frame = _peek_start_frame();
+
+		while (_next_start_frame < frame) {
+			_scheduler.next();
+			_next_start_frame = _peek_start_frame();
+		}
+	}
+
+	uint64_t NoteStarter::_peek_start_frame() const {
+		auto start = _scheduler.peek_start();
+		if (!start) {
+			return UINT64_MAX;
+		}
+
+		auto frame = music::map_resolution_to_frames(*start, Music::get_resolution_per_beat(), _music->get_bpm(), _sample_rate);
+		return _frame_offset + (uint64_t)std::max<int64_t>(frame, 0);
+	}
+
+	PatternCache::PatternCache(
+		Music const& music,
+		std::filesystem::path music_base_path,
+		std::shared_ptr<SampleCache> samples,
+		int channel_count,
+		int sample_rate
+	)
+		: _music(&music)
+		, _music_base_path(std::move(music_base_path))
+		, _samples(std::move(samples))
+		, _channel_count(channel_count)
+		, _sample_rate(sample_rate)
+	{}
+
+	std::shared_ptr<SampleData const> PatternCache::get(int pattern_idx, Track const& track) {
+		Key key{ pattern_idx, track.instrument_idx(), track.gain(), music::get_polyphony(*_music, track), _music->get_bpm() };
+
+		std::shared_ptr<Entry> entry;
+		{
+			std::lock_guard<std::mutex> lock(_entries_mtx);
+			auto& slot = _entries[key];
+			if (!slot) {
+				slot = std::make_shared<Entry>();
+			}
+			entry = slot;
+		}
+
+		std::call_once(entry->rendered, [&]() {
+			entry->data = _render(pattern_idx, track);
+		});
+
+		return entry->data;
+	}
+
+	std::shared_ptr<SampleData const> PatternCache::_render(int pattern_idx, Track const& track) const {
+		auto& instrument = _music->get_instruments()[track.instrument_idx()];
+		auto sample_data = get_instrument_sample(instrument, _music_base_path, *_samples);
+		auto [mixer, mixer_controller] = Mixer::create_mixer(_channel_count, _sample_rate);
+
+		for (auto& note : _music->get_patterns()[pattern_idx].events()) {
+			auto source_opt = create_source_from_note_event(
+				note,
+				instrument,
+				track.gain(),
+				Music::get_resolution_per_beat(),
+				_music->get_bpm(),
+				sample_data
+			);
+
+			// Same as NoteStarter, a note whose sample is missing is skipped.
+			if (source_opt) {
+				auto frame = music::map_resolution_to_frames(note.start, Music::get_resolution_per_beat(), _music->get_bpm(), _sample_rate);
+				mixer_controller->add(std::move(*source_opt), (uint64_t)std::max<int64_t>(frame, 0), get_voice_tag(*_music, track, 0, note.note));
+			}
+		}
+
+		auto data = std::make_shared<SampleData>();
+		data->channel_count = _channel_count;
+		data->sample_rate = _sample_rate;
+
+		constexpr int CHUNK_FRAMES = 4096;
+		while (true) {
+			auto offset = data->samples.size();
+			data->samples.resize(offset + CHUNK_FRAMES * _channel_count);
+
+			auto frames = mixer->fill(data->samples.data() + offset, CHUNK_FRAMES);
+			data->samples.resize(offset + frames * _channel_count);
+
+			if (frames < CHUNK_FRAMES) {
+				break;
+			}
+		}
+
+		data->samples.shrink_to_fit();
+		data->find_audible_range();
+
+		return data;
+	}
+
+	PatternStarter::PatternStarter(
+		Music const& music,
+		std::vector<int> const& track_indices,
+		std::shared_ptr<PatternCache> patterns,
+		std::shared_ptr<MixerController> mixer_controller,
+		int sample_rate
+	)
+		: _music(&music)
+		, _patterns(std::move(patterns))
+		, _mixer_controller(std::move(mixer_controller))
+		, _sample_rate(sample_rate)
+		, _next_start_idx(0)
+	{
+		auto resolution = Music::get_resolution_per_beat();
+		for (auto track_idx : track_indices) {
+			for (auto& event : music.get_tracks()[track_idx].events()) {
+				auto frame = music::map_resolution_to_frames(event.start, resolution, music.get_bpm(), sample_rate);
+				auto end_frame = music::map_resolution_to_frames(event.end, resolution, music.get_bpm(), sample_rate);
+				_starts.push_back(Start{
+					(uint64_t)std::max<int64_t>(frame, 0),
+					(uint64_t)std::max<int64_t>(end_frame, 0),
+					track_idx,
+					event.pattern_idx
+				});
+			}
+		}
+
+		// Ties are broken by track order to keep the output deterministic, like NoteScheduler.
+		std::stable_sort(_starts.begin(), _starts.end(), [](Start const& lhs, Start const& rhs) {
+			return lhs.frame < rhs.frame;
+		});
+	}
+
+	void PatternStarter::start_until(uint64_t frame) {
+		while (!is_done() && _starts[_next_start_idx].frame < frame) {
+			auto& start = _starts[_next_start_idx];
+			auto data = _patterns->get(start.pattern_idx, _music->get_tracks()[start.track_idx]);
+			if (data->frame_count() > 0) {
+				_mixer_controller->add(std::make_unique<SamplePlayer>(std::move(data)), start.frame);
+			}
+
+			_next_start_idx += 1;
+		}
+	}
+
+	void PatternStarter::fast_forward(uint64_t frame) {
+		while (!is_done() && _starts[_next_start_idx].frame < frame) {
+			auto& start = _starts[_next_start_idx];
+			_next_start_idx += 1;
+
+			// Patterns whose notes have all been released are skipped without being rendered.
+			// How long samples last is only known once rendered.
+			auto& track = _music->get_tracks()[start.track_idx];
+			auto& instrument = _music->get_instruments()[track.instrument_idx()];
+			auto release_frames = (uint64_t)(instrument.adsr().release * _sample_rate) + 1;
+			auto is_sample = std::holds_alternative<InstrumentSourceSample>(instrument.source());
+			if (!is_sample && start.end_frame + release_frames <= frame) {
+				continue;
+			}
+
+			auto data = _patterns->get(start.pattern_idx, track);
+			auto skip_frames = frame - start.frame;
+			if ((uint64_t)data->frame_count() > skip_frames) {
+				auto player = std::make_unique<SamplePlayer>(std::move(data));
+				player->skip((int64_t)skip_frames);
+				_mixer_controller->add(std::move(player), frame);
+			}
+		}
+	}
+
+	Sequencer::Sequencer(
+		Music const& music,
+		NoteScheduler scheduler,
+		std::filesystem::path music_base_path,
+		std::shared_ptr<SampleCache> samples,
+		int channel_count,
+		int sample_rate,
+		uint64_t start_frame
+	)
+		: _mixer_controller(std::make_shared<MixerController>(channel_count, sample_rate))
+		, _mixer(Mixer::create_mixer(_mixer_controller, start_frame))
+		, _starter(std::in_place_type<NoteStarter>, music, std::move(scheduler), std::move(music_base_path), std::move(samples), _mixer_controller, sample_rate)
+		, _channel_count(channel_count)
+		, _is_finished(false)
+		, _is_silent(false)
+		, _frame(start_frame)
+	{
+		std::get<NoteStarter>(_starter).fast_forward(start_frame);
+	}
+
+	Sequencer::Sequencer(
+		Music const& music,
+		std::vector<int> const& track_indices,
+		std::shared_ptr<PatternCache> patterns,
+		int channel_count,
+		int sample_rate,
+		uint64_t start_frame
+	)
+		: _mixer_controller(std::make_shared<MixerController>(channel_count, sample_rate))
+		, _mixer(Mixer::create_mixer(_mixer_controller, start_frame))
+		, _starter(std::in_place_type<PatternStarter>, music, track_indices, std::move(patterns), _mixer_controller, sample_rate)
+		, _channel_count(channel_count)
+		, _is_finished(false)
+		, _is_silent(false)
+		, _frame(start_frame)
+	{
+		std::get<PatternStarter>(_starter).fast_forward(start_frame);
+	}
+
+	int Sequencer::render(float* out, int frames) {
+		if (_is_finished) {
+			_is_silent = true;
+			return 0;
+		}
+
+		auto block_end = _frame + frames;
+		auto is_done = std::visit([block_end](auto& starter) {
+			if (starter.next_start_frame() < block_end) {
+				starter.start_until(block_end);
+			}
+
+			return starter.is_done();
+		}, _starter);
+
+		auto produced = _mixer->fill(out, frames);
+		_is_silent = _mixer->is_silent();
+		_frame = block_end;
+
+		if (produced < frames) {
+			if (is_done) {
+				_is_finished = true;
+				return produced;
+			}
+
+			// The mixer has nothing to play until the next source starts.
+			std::fill(out + produced * _channel_count, out + frames * _channel_count, 0.0f);
+		}
+
+		return frames;
+	}
+
+	LivePlayer::LivePlayer(
+		Music const& music,
+		NoteScheduler scheduler,
+		std::filesystem::path music_base_path,
+		std::shared_ptr<SampleCache> samples,
+		int channel_count,
+		int sample_rate,
+		double gain,
+		uint64_t start_frame,
+		uint64_t end_frame,
+		int voice_limit
+	)
+		: _mixer_controller(std::make_shared<MixerController>(channel_count, sample_rate))
+		, _mixer(Mixer::create_mixer(_mixer_controller, start_frame))
+		, _music_base_path(std::move(music_base_path))
+		, _samples(std::move(samples))
+		, _starter(music, std::move(scheduler), _music_base_path, _samples, _mixer_controller, sample_rate)
+		, _channel_count(channel_count)
+		, _sample_rate(sample_rate)
+		, _gain(gain)
+		, _scheduled_frame(start_frame)
+		, _start_frame(start_frame)
+		, _song_end_frame(end_frame)
+		, _frame_offset(0)
+		, _end_frame(end_frame)
+		, _frame(start_frame)
+		, _is_scheduled(false)
+		, _generation(0)
+		, _finished_generation(UINT64_MAX)
+	{
+		_mixer->set_voice_limit(voice_limit);
+		_starter.fast_forward(start_frame);
+	}
+
+	void LivePlayer::render(float* out, int frames) {
+		auto render_start = std::chrono::steady_clock::now();
+
+		// Read first, so the state read after it is from that generation's reload or later.
+		auto generation = _generation.load(std::memory_order_acquire);
+
+		// Read before mixing, so that every source it accounts for has already been added.
+		auto is_scheduled = _is_scheduled.load(std::memory_order_acquire);
+
+		auto produced = _mixer->fill(out, frames);
+		std::fill(out + produced * _channel_count, out + frames * _channel_count, 0.0f);
+
+		// Whatever plays past the end is cut off.
+		auto frame = _frame.load(std::memory_order_relaxed);
+		auto end_frame = _end_frame.load(std::memory_order_relaxed);
+		auto played = frame < end_frame ? (int)std::min<uint64_t>(frames, end_frame - frame) : 0;
+		std::fill(out + played * _channel_count, out + frames * _channel_count, 0.0f);
+
+		// Saturating silence leaves it silent.
+		if (!_mixer->is_silent()) {
+			apply_master(out, frames * _channel_count, _gain.load(std::memory_order_relaxed));
+		}
+
+		_frame.store(frame + frames, std::memory_order_release);
+
+		if (played < frames || (is_scheduled && produced < frames)) {
+			_finished_generation.store(generation, std::memory_order_release);
+		}
+
+		auto elapsed = std::chrono::steady_clock::now() - render_start;
+		auto budget = std::chrono::nanoseconds((int64_t)frames * 1000000000 / _sample_rate);
+		_block_timing.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed), budget);
+	}
+
+	PlaybackMetrics LivePlayer::metrics() const {
+		PlaybackMetrics metrics;
+		metrics.blocks = _block_timing.snapshot();
+		metrics.voice_count = _mixer->current_source_count();
+		metrics.peak_voice_count = _mixer->peak_source_count();
+		metrics.queued_voice_count = _mixer->scheduled_source_count() + _mixer_controller->pending_source_count();
+		metrics.late_voice_count = _mixer->late_source_count();
+		metrics.stolen_voice_count = _mixer->stolen_source_count();
+		return metrics;
+	}
+
+	void LivePlayer::schedule(uint64_t lookahead_frames) {
+		_mixer_controller->release_finished_sources();
+
+		// Kept up to date once every note has started too, as a reload carries on from here.
+		// Nothing past the end is started.
+		_scheduled_frame = std::max(_scheduled_frame, _frame.load(std::memory_order_acquire) + lookahead_frames);
+		_scheduled_frame = std::min(_scheduled_frame, _end_frame.load(std::memory_order_relaxed));
+
+		if (_starter.is_done()) {
+			return;
+		}
+
+		_starter.start_until(_scheduled_frame);
+
+		if (_starter.is_done()) {
+			_is_scheduled.store(true, std::memory_order_release);
+		}
+	}
+
+	void LivePlayer::reload(Music const& music, NoteScheduler scheduler) {
+		if (is_finished()) {
+			// Starts past what the audio thread may be rendering at the moment.
+			auto frame = _frame.load(std::memory_order_acquire) + BLOCK_FRAMES;
+			_frame_offset = frame - _start_frame;
+			_scheduled_frame = frame;
+
+			auto end_frame = _song_end_frame == UINT64_MAX ? UINT64_MAX : _song_end_frame + _frame_offset;
+			_end_frame.store(end_frame, std::memory_order_relaxed);
+
+			_starter = NoteStarter(music, std::move(scheduler), _music_base_path, _samples, _mixer_controller, _sample_rate, _frame_offset);
+			_starter.fast_forward(frame);
+		} else {
+			_starter = NoteStarter(music, std::move(scheduler), _music_base_path, _samples, _mixer_controller, _sample_rate, _frame_offset);
+			_starter.skip_until(_scheduled_frame);
+		}
+
+		_gain.store(music.get_gain(), std::memory_order_relaxed);
+
+		// Cleared before the audio thread can see the new notes, so it does not finish on them.
+		// Bumped last, so the audio thread only finishes the new generation once it sees all of the above.
+		_is_scheduled.store(false, std::memory_order_release);
+		_generation.fetch_add(1, std::memory_order_acq_rel);
+	}
+
+	OfflineRenderer::OfflineRenderer(std::vector<TrackRenderer> tracks, int channel_count, double gain, int thread_count)
+		: _tracks(std::move(tracks))
+		, _track_outputs(_tracks.size())
+		, _track_buffers(_tracks.size())
+		, _track_frames(_tracks.size(), 0)
+		, _track_silent(_tracks.size(), 0)
+		, _channel_count(channel_count)
+		, _gain(gain)
+		, _is_silent(false)
+		, _pool(thread_count)
+	{}
+
+	void OfflineRenderer::set_track_output(int track_idx, TrackOutput output) {
+		_track_outputs[track_idx] = std::move(output);
+	}
+
+	int OfflineRenderer::render(float* out, int frames) {
+		auto sample_count = frames * _channel_count;
+		for (auto& buffer : _track_buffers) {
+			if (buffer.size() < (size_t)sample_count) {
+				buffer.resize(sample_count);
+			}
+		}
+
+		_pool.parallel_for((int)_tracks.size(), [&](int i) {
+			auto buffer = _track_buffers[i].data();
+			_track_frames[i] = std::visit([buffer, frames](auto& track) {
+				if constexpr (std::is_same_v<std::decay_t<decltype(track)>, Sequencer>) {
+					return track.render(buffer, frames);
+				} else {
+					return track.fill(buffer, frames);
+				}
+			}, _tracks[i]);
+
+			// Cached stems are read back as they are, so are never known to be silent.
+			_track_silent[i] = std::visit([](auto& track) {
+				if constexpr (std::is_same_v<std::decay_t<decltype(track)>, Sequencer>) {
+					return track.is_silent();
+				} else {
+					return false;
+				}
+			}, _tracks[i]);
+
+			if (_track_outputs[i]) {
+				_track_outputs[i](buffer, _track_frames[i] * _channel_count);
+			}
+		});
+
+		int produced = 0;
+		for (auto track_frames : _track_frames) {
+			produced = std::max(produced, track_frames);
+		}
+
+		// Summed in track order, regardless of which thread rendered what. Silent tracks add nothing.
+		std::fill_n(out, produced * _channel_count, 0.0f);
+		_is_silent = true;
+		for (size_t i = 0; i < _tracks.size(); ++i) {
+			if (_track_silent[i]) {
+				continue;
+			}
+
+			_is_silent = false;
+			auto& buffer = _track_buffers[i];
+			auto count = _track_frames[i] * _channel_count;
+			for (int j = 0; j < count; ++j) {
+				out[j] += buffer[j];
+			}
+		}
+
+		if (!_is_silent) {
+			apply_master(out, produced * _channel_count, _gain);
+		}
+
+		return produced;
+	}
+}
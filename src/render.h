@@ -0,0 +1,473 @@
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+#include <tuple>
+#include <optional>
+#include <variant>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <filesystem>
+
+#include "source.h"
+#include "mixer.h"
+#include "music.h"
+#include "thread_pool.h"
+#include "scheduler.h"
+#include "sample_cache.h"
+#include "wave_importer.h"
+#include "metrics.h"
+
+namespace render {
+	using SourcePtr = std::unique_ptr<Source>;
+
+	// The number of frames rendered at a time during playback.
+	constexpr int BLOCK_FRAMES = 256;
+
+	/*
+	 * @param sample_data The instrument's sample from get_instrument_sample, unused for waves.
+	 * @return None if the instrument's sample is missing.
+	*/
+	std::optional<SourcePtr> create_source_from_note_event(
+		NoteEvent const& event,
+		Instrument const& instrument,
+		double gain,
+		int resolution_per_beat,
+		int bpm,
+		std::shared_ptr<SampleData const> const& sample_data
+	);
+
+	/*
+	 * @brief Gets the decoded sample a sample instrument plays, to be looked up once and shared
+	 * by each of its notes.
+	 * @return Null for other instruments, and if the sample is not in the cache, which is logged.
+	*/
+	std::shared_ptr<SampleData const> get_instrument_sample(Instrument const& instrument, std::filesystem::path const& music_base_path, SampleCache& samples);
+
+	/*
+	 * @brief Decodes the sample of every sample instrument into the cache, so that nothing is
+	 * read from disk or fails once rendering has started.
+	 * @return False if a sample is unusable, an error is logged in that case.
+	*/
+	bool load_samples(Music const& music, std::filesystem::path const& music_base_path, SampleCache& samples);
+
+	/*
+	 * @brief Applies the master gain and saturation to a block of mixed samples.
+	*/
+	void apply_master(float* samples, int sample_count, double gain);
+
+	/*
+	 * Creates the sources of scheduled notes and hands them to a mixer along with the frame they
+	 * start on. Only notes that are about to start hold a source, so memory follows the number of
+	 * notes playing at once rather than the length of the song.
+	*/
+	class NoteStarter {
+	public:
+
+		NoteStarter(
+			Music const& music,
+			NoteScheduler scheduler,
+			std::filesystem::path music_base_path,
+			std::shared_ptr<SampleCache> samples,
+			std::shared_ptr<MixerController> mixer_controller,
+			int sample_rate,
+			uint64_t frame_offset = 0
+		);
+
+		/*
+		 * @brief Starts every note that starts before frame.
+		*/
+		void start_until(uint64_t frame);
+
+		/*
+		 * @brief Skips every note that starts before frame, without creating their sources.
+		*/
+		void skip_until(uint64_t frame);
+
+		/*
+		 * @brief Starts playing from frame rather than the start of the song. Notes still sounding
+		 * at frame are started partway through, and the rest of the notes before it are skipped.
+		*/
+		void fast_forward(uint64_t frame);
+
+		/*
+		 * @return Whether every note has been started.
+		*/
+		bool is_done() const { return _next_start_frame == UINT64_MAX; }
+
+		/*
+		 * @return The frame the next note starts on.
+		*/
+		uint64_t next_start_frame() const { return _next_start_frame; }
+
+	private:
+
+		uint64_t _peek_start_frame() const;
+		std::optional<SourcePtr> _create_source(ScheduledNote const& note) const;
+
+	private:
+
+		Music const* _music;
+		NoteScheduler _scheduler;
+		std::shared_ptr<MixerController> _mixer_controller;
+
+		// The sample of each instrument by index, null for those that aren't sample instruments.
+		std::vector<std::shared_ptr<SampleData const>> _instrument_samples;
+		int _sample_rate;
+
+		// The frame of the mix the song starts on.
+		uint64_t _frame_offset;
+
+		// Cached so that checking whether anything starts in a block is a single comparison.
+		uint64_t _next_start_frame;
+	};
+
+	/*
+	 * Renders each pattern once for every instrument, gain and polyphony it is played with, so that
+	 * every occurrence of it is mixed in as a single buffer instead of synthesizing its notes again.
+	 * Buffers run until the release of the pattern's last note ends, so tails that overlap the
+	 * next occurrence are mixed in with it.
+	 *
+	 * Polyphony is kept to within each occurrence, tails overlapping the next one are not stolen.
+	 *
+	 * Note onsets are rounded to frames within the pattern rather than within the song, so they
+	 * may land a frame away from where rendering notes one by one puts them.
+	 *
+	 * Safe to use from multiple threads.
+	*/
+	class PatternCache {
+	public:
+
+		PatternCache(
+			Music const& music,
+			std::filesystem::path music_base_path,
+			std::shared_ptr<SampleCache> samples,
+			int channel_count,
+			int sample_rate
+		);
+
+		/*
+		 * @brief Gets the rendered pattern as played by a track, rendering it on first use.
+		*/
+		std::shared_ptr<SampleData const> get(int pattern_idx, Track const& track);
+
+	private:
+
+		struct Key {
+			int pattern_idx;
+			int instrument_idx;
+			double gain;
+			int polyphony;
+			int bpm;
+
+			bool operator<(Key const& other) const {
+				return std::tie(pattern_idx, instrument_idx, gain, polyphony, bpm)
+					< std::tie(other.pattern_idx, other.instrument_idx, other.gain, other.polyphony, other.bpm);
+			}
+		};
+
+		struct Entry {
+			std::once_flag rendered;
+			std::shared_ptr<SampleData const> data;
+		};
+
+		std::shared_ptr<SampleData const> _render(int pattern_idx, Track const& track) const;
+
+	private:
+
+		Music const* _music;
+		std::filesystem::path _music_base_path;
+		std::shared_ptr<SampleCache> _samples;
+		int _channel_count;
+		int _sample_rate;
+
+		// Entries are only looked up under the lock, patterns are rendered outside of it so
+		// that threads rendering different patterns don't wait on each other.
+		std::map<Key, std::shared_ptr<Entry>> _entries;
+		std::mutex _entries_mtx;
+	};
+
+	/*
+	 * Hands the rendered patterns of a set of tracks to a mixer along with the frame they start on.
+	 * The counterpart of NoteStarter for rendering through a PatternCache.
+	*/
+	class PatternStarter {
+	public:
+
+		PatternStarter(
+			Music const& music,
+			std::vector<int> const& track_indices,
+			std::shared_ptr<PatternCache> patterns,
+			std::shared_ptr<MixerController> mixer_controller,
+			int sample_rate
+		);
+
+		/*
+		 * @brief Starts every pattern that starts before frame.
+		*/
+		void start_until(uint64_t frame);
+
+		/*
+		 * @brief Starts playing from frame rather than the start of the song. See NoteStarter.
+		*/
+		void fast_forward(uint64_t frame);
+
+		/*
+		 * @return Whether every pattern has been started.
+		*/
+		bool is_done() const { return _next_start_idx == _starts.size(); }
+
+		/*
+		 * @return The frame the next pattern starts on.
+		*/
+		uint64_t next_start_frame() const { return is_done() ? UINT64_MAX : _starts[_next_start_idx].frame; }
+
+	private:
+
+		struct Start {
+			uint64_t frame;
+			uint64_t end_frame;	// Where the pattern's notes end, before their release
+			int track_idx;
+			int pattern_idx;
+		};
+
+		Music const* _music;
+		std::shared_ptr<PatternCache> _patterns;
+		std::shared_ptr<MixerController> _mixer_controller;
+		int _sample_rate;
+
+		// Patterns are far fewer than notes, so they are all sorted upfront.
+		std::vector<Start> _starts;
+		size_t _next_start_idx;
+	};
+
+	/*
+	 * Creates the sources of scheduled notes as rendering reaches them, and plays them on its own
+	 * mixer. Every note starts on the exact frame its start time maps to, regardless of how many
+	 * frames are rendered at a time.
+	*/
+	class Sequencer {
+	public:
+
+		/*
+		 * @param start_frame The frame of the song rendering starts from.
+		*/
+		Sequencer(
+			Music const& music,
+			NoteScheduler scheduler,
+			std::filesystem::path music_base_path,
+			std::shared_ptr<SampleCache> samples,
+			int channel_count,
+			int sample_rate,
+			uint64_t start_frame = 0
+		);
+
+		/*
+		 * @brief Plays the tracks through rendered patterns rather than note by note.
+		*/
+		Sequencer(
+			Music const& music,
+			std::vector<int> const& track_indices,
+			std::shared_ptr<PatternCache> patterns,
+			int channel_count,
+			int sample_rate,
+			uint64_t start_frame = 0
+		);
+
+		int channel_count() const { return _channel_count; }
+
+		/*
+		 * @brief Renders the next frames of the mix. Gaps where nothing plays are rendered as silence.
+		 * @return The number of frames written. Anything less than frames means every note has finished.
+		*/
+		int render(float* out, int frames);
+
+		/*
+		 * @return Whether the frames last rendered are all silence.
+		*/
+		bool is_silent() const { return _is_silent; }
+
+	private:
+
+		std::shared_ptr<MixerController> _mixer_controller;
+		std::unique_ptr<Mixer> _mixer;
+		std::variant<NoteStarter, PatternStarter> _starter;
+		int _channel_count;
+		bool _is_finished;
+		bool _is_silent;
+
+		// The number of frames rendered so far.
+		uint64_t _frame;
+	};
+
+	struct PlaybackMetrics {
+		// How long mixing each block took against the time its audio lasts.
+		metrics::TimingSnapshot blocks;
+
+		// Voices playing, and the most that have played at once.
+		int voice_count;
+		int peak_voice_count;
+
+		// Voices created ahead of time that have yet to start, whether the mixer has taken them or not.
+		size_t queued_voice_count;
+
+		// Voices that reached the mixer after they should have started, so started late.
+		uint64_t late_voice_count;
+
+		// Voices faded out early to keep to a polyphony limit.
+		uint64_t stolen_voice_count;
+	};
+
+	/*
+	 * Plays a song in real time. The mix is rendered from the audio thread straight into the
+	 * device's buffer, while the sources of upcoming notes are created ahead of time on another
+	 * thread. Rendering never waits on that thread, allocates or frees.
+	*/
+	class LivePlayer {
+	public:
+
+		/*
+		 * @param start_frame The frame of the song playback starts from.
+		 * @param end_frame The frame of the song playback stops at.
+		 * @param voice_limit The most voices that play at once across every track, 0 for no limit.
+		*/
+		LivePlayer(
+			Music const& music,
+			NoteScheduler scheduler,
+			std::filesystem::path music_base_path,
+			std::shared_ptr<SampleCache> samples,
+			int channel_count,
+			int sample_rate,
+			double gain,
+			uint64_t start_frame = 0,
+			uint64_t end_frame = UINT64_MAX,
+			int voice_limit = 0
+		);
+
+		/*
+		 * @brief Renders the next frames of the master mix. Only called from the audio thread.
+		*/
+		void render(float* out, int frames);
+
+		/*
+		 * @brief Creates the sources of notes starting within lookahead_frames of what has been
+		 * rendered so far, and destroys the ones that have finished. Only called from one thread.
+		*/
+		void schedule(uint64_t lookahead_frames);
+
+		/*
+		 * @brief Carries on playing another version of the song, such as the song after its file
+		 * was edited. Notes already handed to the mixer play out as they are, and the new song
+		 * takes over from the first frame none was started for. A song that had finished is
+		 * played again from its start frame. Only called from the thread calling schedule().
+		 * @param music Must outlive the player, or the next call to reload.
+		 * @param scheduler Notes of music to play. Every sample they use must already be loaded.
+		*/
+		void reload(Music const& music, NoteScheduler scheduler);
+
+		/*
+		 * @return Whether every note has been played to the end.
+		*/
+		bool is_finished() const {
+			return _finished_generation.load(std::memory_order_acquire) == _generation.load(std::memory_order_acquire);
+		}
+
+		/*
+		 * @brief Gets how rendering has held up so far. Safe to call from any thread while playing.
+		*/
+		PlaybackMetrics metrics() const;
+
+	private:
+
+		std::shared_ptr<MixerController> _mixer_controller;
+		std::unique_ptr<Mixer> _mixer;
+		std::filesystem::path _music_base_path;
+		std::shared_ptr<SampleCache> _samples;
+		NoteStarter _starter;
+		int _channel_count;
+		int _sample_rate;
+		std::atomic<double> _gain;
+
+		// Every note starting before this frame has been handed to the mixer.
+		uint64_t _scheduled_frame;
+
+		// The frames of the song played, and where its start lands in the mix.
+		uint64_t _start_frame;
+		uint64_t _song_end_frame;
+		uint64_t _frame_offset;
+
+		// The frame of the mix playback stops at.
+		std::atomic<uint64_t> _end_frame;
+
+		// The number of frames rendered so far.
+		std::atomic<uint64_t> _frame;
+
+		// Set once every note has been handed to the mixer.
+		std::atomic<bool> _is_scheduled;
+
+		// Bumped by each reload. The audio thread finishes the generation it started a block in,
+		// so a block of the previous version finishing after a reload is not taken for the new one.
+		std::atomic<uint64_t> _generation;
+		std::atomic<uint64_t> _finished_generation;
+
+		// Only recorded from the audio thread.
+		metrics::TimingHistogram _block_timing;
+	};
+
+	/*
+	 * A track as rendered by OfflineRenderer, either synthesized or read back from a stem
+	 * rendered before.
+	*/
+	using TrackRenderer = std::variant<Sequencer, WaveFile>;
+
+	/*
+	 * Receives the samples of a track before they are summed into the master mix.
+	*/
+	using TrackOutput = std::function<void(float const* samples, int sample_count)>;
+
+	/*
+	 * Renders each track on its own sequencer, spread over a thread pool, then sums the tracks.
+	 * Tracks are always summed in the same order, so the output does not depend on the
+	 * thread count. It matches a single mixer over every source up to float rounding, as
+	 * the sum is grouped per track.
+	*/
+	class OfflineRenderer {
+	public:
+
+		OfflineRenderer(std::vector<TrackRenderer> tracks, int channel_count, double gain, int thread_count);
+
+		/*
+		 * @brief Sends every block a track renders to output as well. Called on the thread that
+		 * rendered the track, in the order blocks are rendered.
+		*/
+		void set_track_output(int track_idx, TrackOutput output);
+
+		/*
+		 * @brief Renders the next frames of the master mix.
+		 * @return The number of frames written. Anything less than frames means the song has finished.
+		*/
+		int render(float* out, int frames);
+
+		/*
+		 * @return Whether the frames last rendered are all silence, as every track was silent.
+		*/
+		bool is_silent() const { return _is_silent; }
+
+	private:
+
+		std::vector<TrackRenderer> _tracks;
+		std::vector<TrackOutput> _track_outputs;
+		std::vector<std::vector<float>> _track_buffers;
+		std::vector<int> _track_frames;
+
+		// Not a vector<bool>, as each track's is written from its own thread.
+		std::vector<uint8_t> _track_silent;
+		int _channel_count;
+		double _gain;
+		bool _is_silent;
+		ThreadPool _pool;
+	};
+}
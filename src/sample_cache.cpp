@@ -0,0 +1,59 @@
+#include "sample_cache.h"
+#include "wave_importer.h"
+#include "conversions.h"
+
+std::shared_ptr<SampleData const> SampleCache::load(std::filesystem::path const& path) {
+	std::error_code ec;
+	auto resolved = std::filesystem::absolute(path, ec).lexically_normal();
+	auto key = (ec ? path : resolved).string();
+
+	std::lock_guard<std::mutex> lock(_samples_mtx);
+
+	if (auto it = _samples.find(key); it != _samples.end()) {
+		return it->second;
+	}
+
+	auto data = _decode(path);
+	if (data) {
+		_samples.emplace(std::move(key), data);
+	}
+
+	return data;
+}
+
+std::shared_ptr<SampleData const> SampleCache::_decode(std::filesystem::path const& path) const {
+	auto file_opt = WaveFile::read(path.string());
+	if (!file_opt) {
+		return nullptr;
+	}
+
+	std::unique_ptr<Source> source = std::make_unique<WaveFile>(std::move(*file_opt));
+	auto channel_count = source->channel_count();
+
+	// Resampled here once, so voices never have to, which affords the best quality.
+	if (source->sample_rate() != _sample_rate) {
+		source = std::make_unique<SampleRateConverter>(std::move(source), _sample_rate, ResampleQuality::Best);
+	}
+
+	auto data = std::make_shared<SampleData>();
+	data->channel_count = channel_count;
+	data->sample_rate = _sample_rate;
+
+	constexpr int CHUNK_FRAMES = 4096;
+	while (true) {
+		auto offset = data->samples.size();
+		data->samples.resize(offset + CHUNK_FRAMES * channel_count);
+
+		auto frames = source->fill(data->samples.data() + offset, CHUNK_FRAMES);
+		data->samples.resize(offset + frames * channel_count);
+
+		if (frames < CHUNK_FRAMES) {
+			break;
+		}
+	}
+
+	data->samples.shrink_to_fit();
+	data->find_audible_range();
+
+	return data;
+}
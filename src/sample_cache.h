@@ -0,0 +1,150 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <optional>
+#include <algorithm>
+#include <filesystem>
+#include <limits.h>
+#include <unordered_map>
+
+#include "source.h"
+
+/*
+ * A decoded sample, already converted to the rate it is played back at.
+ * Never modified once loaded, so any number of voices can read it at once.
+*/
+struct SampleData {
+	int channel_count;
+	int sample_rate;
+	std::vector<float> samples;
+
+	// Frames before the start and from the end on are silent, see find_audible_range.
+	int audible_start = 0;
+	int audible_end = INT_MAX;
+
+	int frame_count() const {
+		return (int)samples.size() / channel_count;
+	}
+
+	/*
+	 * @brief Finds the frames between the leading and trailing silence, so players can skip the
+	 * silence ahead and end once the rest is silent. Called once the samples are all in.
+	*/
+	void find_audible_range() {
+		auto is_audible = [](float sample) {
+			return sample > SILENCE_THRESHOLD || sample < -SILENCE_THRESHOLD;
+		};
+
+		auto first = std::find_if(samples.begin(), samples.end(), is_audible);
+		if (first == samples.end()) {
+			audible_start = 0;
+			audible_end = 0;
+			return;
+		}
+
+		auto last = std::find_if(samples.rbegin(), samples.rend(), is_audible);
+		audible_start = (int)(first - samples.begin()) / channel_count;
+		audible_end = (int)(samples.rend() - last - 1) / channel_count + 1;
+	}
+};
+
+/*
+ * Decodes each sample file once and hands out the same data to every voice playing it.
+ * Files are keyed by their resolved path, so the same file reached through different
+ * relative paths is only decoded once.
+ *
+ * Safe to use from multiple threads.
+*/
+class SampleCache {
+public:
+
+	SampleCache(int sample_rate)
+		: _sample_rate(sample_rate)
+	{}
+
+	int sample_rate() const {
+		return _sample_rate;
+	}
+
+	/*
+	 * @brief Gets the decoded sample for a file, decoding it on first use.
+	 * @return None if the file could not be read as a wave file.
+	*/
+	std::shared_ptr<SampleData const> load(std::filesystem::path const& path);
+
+private:
+
+	std::shared_ptr<SampleData const> _decode(std::filesystem::path const& path) const;
+
+private:
+
+	int _sample_rate;
+	std::unordered_map<std::string, std::shared_ptr<SampleData const>> _samples;
+	std::mutex _samples_mtx;
+};
+
+/*
+ * Plays a cached sample. Only holds a position into the shared data, so starting a voice
+ * does not touch the file or copy any samples. Ends once the rest of the sample is silent.
+*/
+class SamplePlayer : public Source {
+public:
+
+	SamplePlayer(std::shared_ptr<SampleData const> data)
+		: _data(std::move(data))
+		, _position(0)
+		, _end(std::min(_data->samples.size(), (size_t)std::max(0, _data->audible_end) * _data->channel_count))
+	{}
+
+	int channel_count() const override {
+		return _data->channel_count;
+	}
+
+	int sample_rate() const override {
+		return _data->sample_rate;
+	}
+
+	std::optional<double> next_sample() override {
+		if (_position >= _end) {
+			return std::nullopt;
+		}
+
+		auto sample = _data->samples[_position];
+		_position += 1;
+		return sample;
+	}
+
+	int fill(float* out, int frames) override {
+		auto channels = _data->channel_count;
+		auto count = std::min(_end - _position, (size_t)frames * channels);
+		std::copy_n(_data->samples.data() + _position, count, out);
+		_position += count;
+		return (int)count / channels;
+	}
+
+	int64_t skip(int64_t frames) override {
+		auto channels = _data->channel_count;
+		auto count = std::min<uint64_t>(_end - _position, (uint64_t)frames * channels);
+		_position += count;
+		return (int64_t)(count / channels);
+	}
+
+	std::optional<std::chrono::nanoseconds> total_duration() const override {
+		return std::chrono::nanoseconds((int64_t)((double)_data->frame_count() / _data->sample_rate * 1e9));
+	}
+
+	int64_t silent_frames() const override {
+		auto frame = (int64_t)(_position / _data->channel_count);
+		return std::max<int64_t>(0, _data->audible_start - frame);
+	}
+
+private:
+
+	std::shared_ptr<SampleData const> _data;
+	size_t _position;	// In samples
+	size_t _end;	// In samples, where the trailing silence starts
+};
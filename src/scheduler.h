@@ -0,0 +1,180 @@
+#pragma once
+
+#include <vector>
+#include <optional>
+#include <algorithm>
+
+#include "music.h"
+
+struct ScheduledNote {
+	int track_idx;
+
+	// In absolute resolution time, i.e. already moved by the start of its pattern.
+	NoteEvent event;
+};
+
+/*
+ * Walks the notes of a set of tracks in order of their start time, without expanding them upfront.
+ * Track events are played sequentially and pattern notes are added in the order of their start,
+ * so each track is already sorted and only the tracks themselves need merging.
+*/
+class NoteScheduler {
+public:
+
+	NoteScheduler(Music const& music, std::vector<int> const& track_indices)
+		: _music(&music)
+	{
+		_cursors.reserve(track_indices.size());
+		for (auto track_idx : track_indices) {
+			Cursor cursor{ track_idx, 0, 0, 0 };
+			if (_settle(cursor)) {
+				_cursors.push_back(cursor);
+			}
+		}
+
+		std::make_heap(_cursors.begin(), _cursors.end(), _is_later);
+	}
+
+	/*
+	 * @brief Schedules every track of the song.
+	*/
+	static NoteScheduler all_tracks(Music const& music) {
+		std::vector<int> track_indices(music.get_tracks().size());
+		for (size_t i = 0; i < track_indices.size(); ++i) {
+			track_indices[i] = (int)i;
+		}
+
+		return NoteScheduler(music, track_indices);
+	}
+
+	/*
+	 * @brief Skips every note starting before start, finding where each track resumes with a
+	 * binary search rather than walking the notes before it.
+	*/
+	void seek(int start) {
+		auto& tracks = _music->get_tracks();
+		auto& patterns = _music->get_patterns();
+
+		for (auto& cursor : _cursors) {
+			auto& track_events = tracks[cursor.track_idx].events();
+			if (cursor.start >= start) {
+				continue;
+			}
+
+			// Patterns are played one after the other and notes never start past the end of their
+			// pattern, so only the last pattern starting before start can hold notes to skip to.
+			auto track_event = std::partition_point(
+				track_events.begin() + cursor.track_event_idx,
+				track_events.end(),
+				[start](PatternEvent const& event) { return event.start < start; }
+			);
+			if (track_event != track_events.begin() + cursor.track_event_idx) {
+				--track_event;
+			}
+
+			auto& note_events = patterns[track_event->pattern_idx].events();
+			auto first_note = track_event - track_events.begin() == cursor.track_event_idx
+				? note_events.begin() + cursor.note_idx
+				: note_events.begin();
+			auto note_event = std::partition_point(
+				first_note,
+				note_events.end(),
+				[&](NoteEvent const& event) { return track_event->start + event.start < start; }
+			);
+
+			cursor.track_event_idx = (int)(track_event - track_events.begin());
+			cursor.note_idx = (int)(note_event - note_events.begin());
+		}
+
+		// Tracks with nothing left past start are dropped.
+		size_t kept = 0;
+		for (auto& cursor : _cursors) {
+			if (_settle(cursor)) {
+				_cursors[kept++] = cursor;
+			}
+		}
+		_cursors.resize(kept);
+
+		std::make_heap(_cursors.begin(), _cursors.end(), _is_later);
+	}
+
+	/*
+	 * @return The start in resolution time of the next note, or none after the last note.
+	*/
+	std::optional<int> peek_start() const {
+		if (_cursors.empty()) {
+			return std::nullopt;
+		}
+
+		return _cursors.front().start;
+	}
+
+	/*
+	 * @brief Takes the next note. Must only be called while peek_start() has a value.
+	*/
+	ScheduledNote next() {
+		std::pop_heap(_cursors.begin(), _cursors.end(), _is_later);
+		auto& cursor = _cursors.back();
+
+		auto& track = _music->get_tracks()[cursor.track_idx];
+		auto& track_event = track.events()[cursor.track_event_idx];
+		auto& note_event = _music->get_patterns()[track_event.pattern_idx].events()[cursor.note_idx];
+
+		ScheduledNote note{ cursor.track_idx, note_event.move(track_event.start) };
+
+		cursor.note_idx += 1;
+		if (_settle(cursor)) {
+			std::push_heap(_cursors.begin(), _cursors.end(), _is_later);
+		} else {
+			_cursors.pop_back();
+		}
+
+		return note;
+	}
+
+private:
+
+	struct Cursor {
+		int track_idx;
+		int track_event_idx;
+		int note_idx;
+		int start;
+	};
+
+	/*
+	 * @brief Moves the cursor onto a note that exists, skipping past empty patterns.
+	 * @return False if the track has no notes left.
+	*/
+	bool _settle(Cursor& cursor) const {
+		auto& track_events = _music->get_tracks()[cursor.track_idx].events();
+
+		while (cursor.track_event_idx < (int)track_events.size()) {
+			auto& track_event = track_events[cursor.track_event_idx];
+			auto& note_events = _music->get_patterns()[track_event.pattern_idx].events();
+
+			if (cursor.note_idx < (int)note_events.size()) {
+				cursor.start = track_event.start + note_events[cursor.note_idx].start;
+				return true;
+			}
+
+			cursor.track_event_idx += 1;
+			cursor.note_idx = 0;
+		}
+
+		return false;
+	}
+
+	// Heap ordering, ties are broken by track order to keep the output deterministic.
+	static bool _is_later(Cursor const& lhs, Cursor const& rhs) {
+		if (lhs.start != rhs.start) {
+			return lhs.start > rhs.start;
+		}
+
+		return lhs.track_idx > rhs.track_idx;
+	}
+
+private:
+
+	Music const* _music;
+	std::vector<Cursor> _cursors;
+};
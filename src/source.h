@@ -3,28 +3,114 @@
 #include <stdint.h>
 #include <optional>
 #include <functional>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+
+#include "pool.h"
 
 class Amplify;
 
 static constexpr uint64_t NANO_PER_SEC = 1000000000;
 
+// Samples quieter than this, about -100 dB, are treated as silence. Well under what a 16-bit file can hold.
+static constexpr float SILENCE_THRESHOLD = 1e-5f;
+
 class Source {
 public:
 
 	virtual ~Source() = default;
 
+	// Sources are created for every note, so their memory is recycled through the pool.
+	static void* operator new(size_t size) {
+		return pool::allocate(size);
+	}
+
+	static void operator delete(void* ptr, size_t size) {
+		pool::deallocate(ptr, size);
+	}
+
 	virtual int sample_rate() const = 0;
 	virtual int channel_count() const = 0;
 
 	/*
-	* @brief asdflkj
+	* @brief Produces the next interleaved sample.
 	* @return The sample value, none otherwise.
 	*/
 	virtual std::optional<double> next_sample() = 0;
 
+	/*
+	* @brief Renders a block of interleaved frames. Sources should override this when they
+	* can produce a block faster than one next_sample() call per sample.
+	* @param out Buffer holding at least frames * channel_count() samples.
+	* @param frames The number of frames requested.
+	* @return The number of frames written. Anything less than frames means the source is exhausted.
+	*/
+	virtual int fill(float* out, int frames) {
+		return fill_from_samples(out, frames);
+	}
+
+	/*
+	* @brief Moves past frames as if they had been rendered and thrown away, e.g. to start a note
+	* partway through. Sources should override this when they can get there without rendering.
+	* @return The number of frames skipped. Anything less than frames means the source is exhausted.
+	*/
+	virtual int64_t skip(int64_t frames) {
+		float buffer[1024];
+		auto chunk_frames = std::max(1, (int)(sizeof(buffer) / sizeof(float)) / channel_count());
+		int64_t skipped = 0;
+
+		while (skipped < frames) {
+			auto count = (int)std::min<int64_t>(chunk_frames, frames - skipped);
+			auto produced = fill(buffer, count);
+			skipped += produced;
+
+			if (produced < count) {
+				break;
+			}
+		}
+
+		return skipped;
+	}
+
 	virtual std::optional<std::chrono::nanoseconds> total_duration() const {
 		return std::nullopt;
 	}
+
+	/*
+	* @brief How many of the next frames are known to be silent, so they can be skipped instead
+	* of rendered. Sources that can't tell ahead of time report none.
+	*/
+	virtual int64_t silent_frames() const {
+		return 0;
+	}
+
+protected:
+
+	/*
+	* @brief Default adapter that renders a block through next_sample(). A trailing
+	* partial frame is zero padded and counted as written.
+	*/
+	int fill_from_samples(float* out, int frames) {
+		auto channels = channel_count();
+		for (int frame = 0; frame < frames; ++frame) {
+			for (int channel = 0; channel < channels; ++channel) {
+				auto sample = next_sample();
+				if (!sample) {
+					if (channel == 0) {
+						return frame;
+					}
+
+					std::fill_n(out, channels - channel, 0.0f);
+					return frame + 1;
+				}
+
+				*out++ = (float)*sample;
+			}
+		}
+
+		return frames;
+	}
 };
 
 class Amplify : public Source {
@@ -50,10 +136,28 @@ public:
 		return {};
 	}
 
+	int fill(float* out, int frames) override {
+		auto produced = _input->fill(out, frames);
+		auto count = produced * _input->channel_count();
+		for (int i = 0; i < count; ++i) {
+			out[i] = (float)(out[i] * _amp);
+		}
+
+		return produced;
+	}
+
+	int64_t skip(int64_t frames) override {
+		return _input->skip(frames);
+	}
+
 	std::optional<std::chrono::nanoseconds> total_duration() const override {
 		return _input->total_duration();
 	}
 
+	int64_t silent_frames() const override {
+		return _input->silent_frames();
+	}
+
 private:
 
 	std::unique_ptr<Source> _input;
@@ -66,9 +170,13 @@ public:
 	Duration(std::unique_ptr<Source> input, uint64_t duration_ns)
 		: _input(std::move(input))
 		, _requested_duration_ns(duration_ns)
-		, _remaining_duration_ns(duration_ns)
-		, _duration_ns_per_sample(NANO_PER_SEC / (_input->sample_rate() * _input->channel_count()))
+		, _remaining_samples(0)
 	{
+		// A sample is only produced while more than a sample's worth of duration remains.
+		auto duration_ns_per_sample = NANO_PER_SEC / (_input->sample_rate() * _input->channel_count());
+		if (duration_ns > 0) {
+			_remaining_samples = (duration_ns - 1) / duration_ns_per_sample;
+		}
 	}
 
 	int channel_count() const override {
@@ -80,25 +188,55 @@ public:
 	}
 
 	std::optional<double> next_sample() override {
-		if (_remaining_duration_ns <= _duration_ns_per_sample) {
+		if (_remaining_samples == 0) {
 			return std::nullopt;
 		}
 	
-		auto sample = _input->next_sample();
-		_remaining_duration_ns -= _duration_ns_per_sample;
-		return sample;
+		_remaining_samples -= 1;
+		return _input->next_sample();
+	}
+
+	int fill(float* out, int frames) override {
+		auto channels = _input->channel_count();
+		auto available = (int)std::min<uint64_t>(frames, _remaining_samples / channels);
+		auto produced = _input->fill(out, available);
+		_remaining_samples -= (uint64_t)produced * channels;
+
+		// The duration may end partway through a frame.
+		if (produced == available && produced < frames && _remaining_samples > 0) {
+			produced += fill_from_samples(out + produced * channels, 1);
+		}
+
+		return produced;
+	}
+
+	int64_t skip(int64_t frames) override {
+		auto channels = _input->channel_count();
+		auto available = std::min<int64_t>(frames, _remaining_samples / channels);
+		auto skipped = _input->skip(available);
+		_remaining_samples -= (uint64_t)skipped * channels;
+
+		// The duration may end partway through a frame.
+		if (skipped == available && skipped < frames && _remaining_samples > 0) {
+			skipped += Source::skip(1);
+		}
+
+		return skipped;
 	}
 
 	std::optional<std::chrono::nanoseconds> total_duration() const override {
 		return std::chrono::nanoseconds(_requested_duration_ns);
 	}
 
+	int64_t silent_frames() const override {
+		return std::min<int64_t>(_input->silent_frames(), _remaining_samples / _input->channel_count());
+	}
+
 private:
 
 	std::unique_ptr<Source> _input;
-	uint64_t _remaining_duration_ns;
 	uint64_t _requested_duration_ns;
-	uint64_t _duration_ns_per_sample;
+	uint64_t _remaining_samples;
 };
 
 class Delay : public Source {
@@ -107,9 +245,12 @@ public:
 	Delay(std::unique_ptr<Source> input, uint64_t delay_ns)
 		: _input(std::move(input))
 		, _requested_delay_ns(delay_ns)
-		, _remaining_delay_ns(delay_ns)
-		, _duration_ns_per_sample(NANO_PER_SEC / (_input->sample_rate() * _input->channel_count()))
+		, _remaining_delay_samples(0)
 	{
+		auto duration_ns_per_sample = NANO_PER_SEC / (_input->sample_rate() * _input->channel_count());
+		if (delay_ns > 0) {
+			_remaining_delay_samples = (delay_ns - 1) / duration_ns_per_sample;
+		}
 	}
 
 	int channel_count() const override {
@@ -121,14 +262,60 @@ public:
 	}
 
 	std::optional<double> next_sample() override {
-		if (_remaining_delay_ns <= _duration_ns_per_sample) {
+		if (_remaining_delay_samples == 0) {
 			return _input->next_sample();
 		}
 
-		_remaining_delay_ns -= _duration_ns_per_sample;
+		_remaining_delay_samples -= 1;
 		return 0.0;
 	}
 
+	int fill(float* out, int frames) override {
+		auto channels = _input->channel_count();
+		int written = 0;
+
+		if (_remaining_delay_samples > 0) {
+			written = (int)std::min<uint64_t>(frames, _remaining_delay_samples / channels);
+			std::fill_n(out, written * channels, 0.0f);
+			_remaining_delay_samples -= (uint64_t)written * channels;
+
+			// The delay may end partway through a frame.
+			if (written < frames && _remaining_delay_samples > 0) {
+				if (fill_from_samples(out + written * channels, 1) == 0) {
+					return written;
+				}
+				written += 1;
+			}
+		}
+
+		if (written < frames) {
+			written += _input->fill(out + written * channels, frames - written);
+		}
+
+		return written;
+	}
+
+	int64_t skip(int64_t frames) override {
+		auto channels = _input->channel_count();
+		auto delay_frames = std::min<int64_t>(frames, _remaining_delay_samples / channels);
+		_remaining_delay_samples -= (uint64_t)delay_frames * channels;
+		auto skipped = delay_frames;
+
+		// The delay may end partway through a frame.
+		if (skipped < frames && _remaining_delay_samples > 0) {
+			if (Source::skip(1) == 0) {
+				return skipped;
+			}
+			skipped += 1;
+		}
+
+		if (skipped < frames) {
+			skipped += _input->skip(frames - skipped);
+		}
+
+		return skipped;
+	}
+
 	std::optional<std::chrono::nanoseconds> total_duration() const override {
 		if (auto total = _input->total_duration()) {
 			return std::chrono::nanoseconds(_requested_delay_ns + total->count());
@@ -137,12 +324,20 @@ public:
 		return std::nullopt;
 	}
 
+	int64_t silent_frames() const override {
+		// Only whole frames of the delay, one ending partway through a frame is rendered.
+		if (_remaining_delay_samples > 0) {
+			return (int64_t)(_remaining_delay_samples / _input->channel_count());
+		}
+
+		return _input->silent_frames();
+	}
+
 private:
 
 	std::unique_ptr<Source> _input;
-	uint64_t _remaining_delay_ns;
 	uint64_t _requested_delay_ns;
-	uint64_t _duration_ns_per_sample;
+	uint64_t _remaining_delay_samples;
 };
 
 struct FilterInfo {
@@ -191,6 +386,30 @@ public:
 		return std::nullopt;
 	}
 
+	int fill(float* out, int frames) override {
+		auto produced = _input->fill(out, frames);
+
+		// Neither of these change between samples, so only query them once per block.
+		FilterInfo info;
+		info.sample_rate = _input->sample_rate();
+		info.total_duration = _input->total_duration();
+
+		auto count = produced * _input->channel_count();
+		for (int i = 0; i < count; ++i) {
+			info.current_sample = _current_sample;
+			_current_sample += 1;
+			out[i] = (float)_callback(out[i], info);
+		}
+
+		return produced;
+	}
+
+	int64_t skip(int64_t frames) override {
+		auto skipped = _input->skip(frames);
+		_current_sample += (int)(skipped * _input->channel_count());
+		return skipped;
+	}
+
 private:
 
 	std::unique_ptr<Source> _input;
@@ -0,0 +1,185 @@
+#include "stem_cache.h"
+#include "oscillators.h"
+
+#include <fstream>
+#include <type_traits>
+
+namespace {
+	// Bumped whenever rendering changes, so stems from older versions are not reused.
+	constexpr uint64_t STEM_VERSION = 2;
+
+	/*
+	 * 64-bit FNV-1a, fed one value at a time.
+	*/
+	class Hasher {
+	public:
+
+		void bytes(void const* data, size_t size) {
+			auto ptr = (uint8_t const*)data;
+			for (size_t i = 0; i < size; ++i) {
+				_hash ^= ptr[i];
+				_hash *= 0x100000001b3;
+			}
+		}
+
+		template<class T>
+		void value(T const& value) {
+			static_assert(std::is_arithmetic_v<T> || std::is_enum_v<T>);
+			bytes(&value, sizeof(T));
+		}
+
+		void string(std::string const& str) {
+			value(str.size());
+			bytes(str.data(), str.size());
+		}
+
+		/*
+		 * @return False if the file could not be read.
+		*/
+		bool file(std::filesystem::path const& path) {
+			std::ifstream file(path, std::ios::binary);
+			if (!file.is_open()) {
+				return false;
+			}
+
+			char buffer[64 * 1024];
+			while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+				bytes(buffer, (size_t)file.gcount());
+			}
+
+			return true;
+		}
+
+		uint64_t result() const {
+			return _hash;
+		}
+
+	private:
+
+		uint64_t _hash = 0xcbf29ce484222325;
+	};
+}
+
+StemWriter::~StemWriter() {
+	if (!_is_committed) {
+		_writer.close();
+
+		std::error_code ec;
+		std::filesystem::remove(_temp_path, ec);
+	}
+}
+
+bool StemWriter::commit() {
+	_is_committed = true;
+
+	std::error_code ec;
+	if (!_writer.close()) {
+		fprintf(stderr, "[ERROR] Could not write the stem '%s' to the cache\n", _path.string().c_str());
+		std::filesystem::remove(_temp_path, ec);
+		return false;
+	}
+
+	std::filesystem::rename(_temp_path, _path, ec);
+	if (ec) {
+		fprintf(stderr, "[ERROR] Could not move the stem '%s' into the cache\n", _path.string().c_str());
+		std::filesystem::remove(_temp_path, ec);
+		return false;
+	}
+
+	return true;
+}
+
+uint64_t StemCache::hash_track(
+	Music const& music,
+	int track_idx,
+	std::filesystem::path const& music_base_path,
+	int channel_count,
+	int sample_rate,
+	bool cache_patterns
+) {
+	Hasher hasher;
+	hasher.value(STEM_VERSION);
+	hasher.value(channel_count);
+	hasher.value(sample_rate);
+	hasher.value(cache_patterns);
+	hasher.value(detail::NUM_WAVE_SAMPLES);
+	hasher.value(detail::BAND_LIMITED_WAVES);
+
+	hasher.value(music.get_bpm());
+	hasher.value(music.get_time_signature().beats_per_bar);
+	hasher.value(music.get_time_signature().beat_value);
+	hasher.value(Music::get_resolution_per_beat());
+
+	auto& track = music.get_tracks()[track_idx];
+	hasher.value(track.gain());
+	hasher.value(music::get_polyphony(music, track));
+
+	auto& instrument = music.get_instruments()[track.instrument_idx()];
+	auto adsr = instrument.adsr();
+	hasher.value(adsr.attack);
+	hasher.value(adsr.decay);
+	hasher.value(adsr.sustain);
+	hasher.value(adsr.release);
+	hasher.value(adsr.curve);
+
+	hasher.value(instrument.source().index());
+	if (auto wave = std::get_if<InstrumentSourceWave>(&instrument.source())) {
+		hasher.value(*wave);
+	} else if (auto sample = std::get_if<InstrumentSourceSample>(&instrument.source())) {
+		// The sample's contents, so that replacing the file under the same name is noticed.
+		hasher.string(sample->filename);
+		if (!hasher.file(music_base_path / sample->filename)) {
+			hasher.value(false);
+		}
+	}
+
+	auto& patterns = music.get_patterns();
+	hasher.value(track.events().size());
+	for (auto& event : track.events()) {
+		hasher.value(event.start);
+		hasher.value(event.end);
+
+		auto& notes = patterns[event.pattern_idx].events();
+		hasher.value(notes.size());
+		for (auto& note : notes) {
+			hasher.value(note.start);
+			hasher.value(note.end);
+			hasher.value(note.note.freq());
+		}
+	}
+
+	return hasher.result();
+}
+
+std::optional<WaveFile> StemCache::open(uint64_t hash, int channel_count, int sample_rate) const {
+	auto file = WaveFile::read(_stem_path(hash).string());
+	if (!file || file->channel_count() != channel_count || file->sample_rate() != sample_rate) {
+		return std::nullopt;
+	}
+
+	return file;
+}
+
+std::optional<StemWriter> StemCache::create(uint64_t hash, int channel_count, int sample_rate) const {
+	std::error_code ec;
+	std::filesystem::create_directories(_directory, ec);
+
+	auto path = _stem_path(hash);
+	auto temp_path = path;
+	temp_path += ".tmp";
+
+	// Floats, so the stem is exactly what the track rendered, including anything past full scale.
+	auto writer = wave::WaveWriter::create(temp_path.string(), sample_rate, channel_count, 32, wave::FORMAT_FLOAT);
+	if (!writer) {
+		fprintf(stderr, "[ERROR] Could not create the stem '%s'\n", temp_path.string().c_str());
+		return std::nullopt;
+	}
+
+	return StemWriter(std::move(*writer), std::move(temp_path), std::move(path));
+}
+
+std::filesystem::path StemCache::_stem_path(uint64_t hash) const {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.wav", (unsigned long long)hash);
+	return _directory / name;
+}
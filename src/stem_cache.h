@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdint.h>
+#include <optional>
+#include <filesystem>
+
+#include "music.h"
+#include "wave_importer.h"
+
+/*
+ * Writes a rendered track into the stem cache. The stem is written under a temporary name and
+ * only takes its place in the cache once committed, so an export that stops partway never leaves
+ * a truncated stem behind to be reused.
+*/
+class StemWriter {
+public:
+
+	StemWriter(wave::WaveWriter writer, std::filesystem::path temp_path, std::filesystem::path path)
+		: _writer(std::move(writer))
+		, _temp_path(std::move(temp_path))
+		, _path(std::move(path))
+		, _is_committed(false)
+	{}
+
+	StemWriter(StemWriter&& other)
+		: _writer(std::move(other._writer))
+		, _temp_path(std::move(other._temp_path))
+		, _path(std::move(other._path))
+		, _is_committed(other._is_committed)
+	{
+		other._is_committed = true;
+	}
+
+	~StemWriter();
+
+	void write(float const* samples, int sample_count) {
+		_writer.write(samples, sample_count);
+	}
+
+	/*
+	 * @brief Finishes the stem and moves it into the cache.
+	 * @return False if the stem could not be moved into place, an error is logged in that case.
+	*/
+	bool commit();
+
+private:
+
+	wave::WaveWriter _writer;
+	std::filesystem::path _temp_path;
+	std::filesystem::path _path;
+	bool _is_committed;
+};
+
+/*
+ * Keeps the rendered tracks of songs in a directory, so exporting a song again only renders the
+ * tracks that changed. Each stem is named after the hash of everything that affects how its
+ * track renders, and holds the track's float samples before the master gain is applied.
+ *
+ * Stems are never removed, the directory can be cleared at any time.
+*/
+class StemCache {
+public:
+
+	StemCache(std::filesystem::path directory)
+		: _directory(std::move(directory))
+	{}
+
+	/*
+	 * @brief Hashes a track along with its instrument, the patterns it plays and the song's tempo
+	 * and time signature, as well as the contents of its sample and the settings it renders with.
+	*/
+	static uint64_t hash_track(
+		Music const& music,
+		int track_idx,
+		std::filesystem::path const& music_base_path,
+		int channel_count,
+		int sample_rate,
+		bool cache_patterns
+	);
+
+	/*
+	 * @brief Opens the stem of a track for reading.
+	 * @return None if the track has not been rendered before.
+	*/
+	std::optional<WaveFile> open(uint64_t hash, int channel_count, int sample_rate) const;
+
+	/*
+	 * @brief Creates a stem to write a track to as it renders.
+	 * @return None if the stem could not be created, an error is logged in that case.
+	*/
+	std::optional<StemWriter> create(uint64_t hash, int channel_count, int sample_rate) const;
+
+private:
+
+	std::filesystem::path _stem_path(uint64_t hash) const;
+
+private:
+
+	std::filesystem::path _directory;
+};
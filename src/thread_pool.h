@@ -0,0 +1,144 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * A fixed set of worker threads for splitting work into independent jobs.
+ */
+class ThreadPool {
+public:
+
+	/*
+	 * @param thread_count Total threads that run jobs, including the thread calling parallel_for.
+	*/
+	ThreadPool(int thread_count)
+		: _job_fn(nullptr)
+		, _job_count(0)
+		, _next_job(0)
+		, _busy_workers(0)
+		, _generation(0)
+		, _is_running(true)
+	{
+		for (int i = 1; i < thread_count; ++i) {
+			_workers.emplace_back(_task_worker, this);
+		}
+	}
+
+	~ThreadPool() {
+		{
+			std::scoped_lock lk(_mtx);
+			_is_running = false;
+		}
+		_work_cv.notify_all();
+
+		for (auto& worker : _workers) {
+			worker.join();
+		}
+	}
+
+	ThreadPool(ThreadPool const&) = delete;
+	ThreadPool& operator=(ThreadPool const&) = delete;
+
+	int thread_count() const {
+		return (int)_workers.size() + 1;
+	}
+
+	/*
+	 * @brief Calls fn(i) for every i in [0, count) across all threads, and returns once every call
+	 * has finished. Which thread runs a job is unspecified, so results should be written per job.
+	*/
+	void parallel_for(int count, std::function<void(int)> const& fn) {
+		if (_workers.empty() || count <= 1) {
+			for (int i = 0; i < count; ++i) {
+				fn(i);
+			}
+			return;
+		}
+
+		{
+			std::scoped_lock lk(_mtx);
+			_job_fn = &fn;
+			_job_count = count;
+			_next_job.store(0, std::memory_order_relaxed);
+			_busy_workers = (int)_workers.size();
+			_generation += 1;
+		}
+		_work_cv.notify_all();
+
+		_run_jobs(fn, count);
+
+		std::unique_lock lk(_mtx);
+		_done_cv.wait(lk, [&] { return _busy_workers == 0; });
+		_job_fn = nullptr;
+	}
+
+private:
+
+	void _run_jobs(std::function<void(int)> const& fn, int count) {
+		while (true) {
+			auto job = _next_job.fetch_add(1, std::memory_order_relaxed);
+			if (job >= count) {
+				break;
+			}
+
+			fn(job);
+		}
+	}
+
+	static void _task_worker(ThreadPool* pool) {
+		uint64_t seen_generation = 0;
+
+		while (true) {
+			std::function<void(int)> const* fn;
+			int count;
+			{
+				std::unique_lock lk(pool->_mtx);
+				pool->_work_cv.wait(lk, [&] {
+					return !pool->_is_running || pool->_generation != seen_generation;
+				});
+
+				if (!pool->_is_running) {
+					return;
+				}
+
+				seen_generation = pool->_generation;
+				fn = pool->_job_fn;
+				count = pool->_job_count;
+			}
+
+			pool->_run_jobs(*fn, count);
+
+			bool is_last;
+			{
+				std::scoped_lock lk(pool->_mtx);
+				pool->_busy_workers -= 1;
+				is_last = pool->_busy_workers == 0;
+			}
+
+			if (is_last) {
+				pool->_done_cv.notify_one();
+			}
+		}
+	}
+
+private:
+
+	std::vector<std::thread> _workers;
+
+	std::mutex _mtx;
+	std::condition_variable _work_cv;
+	std::condition_variable _done_cv;
+
+	std::function<void(int)> const* _job_fn;
+	int _job_count;
+	std::atomic<int> _next_job;
+	int _busy_workers;
+	uint64_t _generation;
+	bool _is_running;
+};
@@ -0,0 +1,359 @@
+#pragma once
+
+#include <stdint.h>
+#include <optional>
+#include <chrono>
+#include <algorithm>
+
+#include "source.h"
+#include "music.h"
+#include "oscillators.h"
+
+/*
+ * Shapes a voice with an instrument's ADSR over the voice's length, the release taking up
+ * its end. Steps through the stages incrementally, so each sample costs one multiply-add on
+ * the level, with the coefficients worked out once per stage.
+*/
+class AdsrEnvelope {
+public:
+
+	AdsrEnvelope(Adsr adsr, int sample_rate, uint64_t duration_ns)
+		: _adsr(adsr)
+		, _attack_samples((int64_t)(adsr.attack * sample_rate))
+		, _decay_samples((int64_t)(adsr.decay * sample_rate))
+		, _release_samples((int64_t)(adsr.release * sample_rate))
+		, _stage(Stage::Attack)
+		, _current_sample(0)
+		, _stage_end(0)
+		, _target(0.0)
+		, _level(0.0)
+		, _coefficient(1.0)
+		, _offset(0.0)
+	{
+		auto total_samples = (int64_t)(duration_ns * sample_rate / NANO_PER_SEC);
+		_release_start = std::max<int64_t>(0, total_samples - _release_samples);
+		_enter(Stage::Attack);
+	}
+
+	/*
+	 * @brief Once finished, the envelope stays silent, so the voice can end.
+	*/
+	bool is_finished() const {
+		return _stage == Stage::Finished;
+	}
+
+	/*
+	 * @brief Gets the amplitude of the next sample.
+	*/
+	double next() {
+		auto level = 1.0;
+		if (apply(&level, 1) == 0) {
+			return 0.0;
+		}
+
+		return level;
+	}
+
+	/*
+	 * @brief Multiplies the next samples by the envelope.
+	 * @return The number of samples shaped. Anything less than count means the envelope
+	 * finished, and the rest of the samples are left as they are.
+	*/
+	template<class T>
+	int apply(T* samples, int count) {
+		int shaped = 0;
+
+		while (shaped < count && _stage != Stage::Finished) {
+			auto n = (int)std::min<int64_t>(count - shaped, _stage_end - _current_sample);
+			auto level = _level;
+			auto coefficient = _coefficient;
+			auto offset = _offset;
+
+			for (int i = 0; i < n; ++i) {
+				samples[shaped + i] = (T)(samples[shaped + i] * level);
+				level = level * coefficient + offset;
+			}
+
+			_level = level;
+			_current_sample += n;
+			shaped += n;
+
+			if (_current_sample == _stage_end) {
+				_next_stage();
+			}
+		}
+
+		return shaped;
+	}
+
+	/*
+	 * @brief Moves past samples without shaping any. Each stage's level is worked out in closed
+	 * form, so it costs the same however many samples are skipped.
+	 * @return The number of samples skipped. Anything less than count means the envelope finished.
+	*/
+	int64_t skip(int64_t count) {
+		int64_t skipped = 0;
+
+		while (skipped < count && _stage != Stage::Finished) {
+			auto n = std::min<int64_t>(count - skipped, _stage_end - _current_sample);
+
+			if (_coefficient == 1.0) {
+				_level += _offset * n;
+			} else {
+				// Every step moves the level the same fraction of the way to where it converges.
+				auto limit = _offset / (1.0 - _coefficient);
+				_level = limit + (_level - limit) * pow(_coefficient, (double)n);
+			}
+
+			_current_sample += n;
+			skipped += n;
+
+			if (_current_sample == _stage_end) {
+				_next_stage();
+			}
+		}
+
+		return skipped;
+	}
+
+private:
+
+	enum class Stage {
+		Attack,
+		Decay,
+		Sustain,
+		Release,
+		Finished
+	};
+
+	// How far past its target an exponential stage aims, as a fraction of the stage's span.
+	// Attack curves gently, decay and release fall away quickly like an analog envelope.
+	static constexpr double ATTACK_OVERSHOOT = 0.3;
+	static constexpr double DECAY_OVERSHOOT = 0.001;
+
+	void _next_stage() {
+		// Lands exactly on a stage's target, however the steps rounded. A stage cut short by
+		// the release is released from wherever it got to instead.
+		if (_current_sample < _release_start || _stage == Stage::Release) {
+			_level = _target;
+		}
+
+		switch (_stage) {
+			case Stage::Attack:
+				_enter(_current_sample < _release_start ? Stage::Decay : Stage::Release);
+			break;
+			case Stage::Decay:
+				_enter(_current_sample < _release_start ? Stage::Sustain : Stage::Release);
+			break;
+			case Stage::Sustain:
+				_enter(Stage::Release);
+			break;
+			default:
+				_enter(Stage::Finished);
+			break;
+		}
+	}
+
+	void _enter(Stage stage) {
+		_stage = stage;
+
+		switch (stage) {
+			case Stage::Attack:
+				_start_ramp(1.0, _attack_samples, ATTACK_OVERSHOOT);
+			break;
+			case Stage::Decay:
+				_start_ramp(_adsr.sustain, _decay_samples, DECAY_OVERSHOOT);
+			break;
+			case Stage::Sustain:
+				// Nothing more is heard from a voice that sustains silence.
+				if (_level <= 0.0) {
+					_stage = Stage::Finished;
+					return;
+				}
+
+				_target = _level;
+				_coefficient = 1.0;
+				_offset = 0.0;
+				_stage_end = _release_start;
+			break;
+			case Stage::Release:
+				_start_ramp(0.0, _release_samples, DECAY_OVERSHOOT);
+			break;
+			default:
+			break;
+		}
+
+		if (_stage != Stage::Finished && _current_sample >= _stage_end) {
+			_next_stage();
+		}
+	}
+
+	/*
+	 * @brief Sets up the steps from the current level to a target over a number of samples.
+	 * Stages before the release are cut short once the release starts.
+	*/
+	void _start_ramp(double target, int64_t length, double overshoot) {
+		_target = target;
+		_stage_end = _current_sample + std::max<int64_t>(length, 0);
+		if (_stage != Stage::Release) {
+			_stage_end = std::min(_stage_end, _release_start);
+		}
+
+		if (length <= 0) {
+			_coefficient = 1.0;
+			_offset = 0.0;
+			return;
+		}
+
+		if (_adsr.curve == AdsrCurve::Exponential) {
+			// Approaches a point past the target, so that it reaches the target in length samples.
+			auto aim = target + (target - _level) * overshoot;
+			_coefficient = pow(overshoot / (1.0 + overshoot), 1.0 / length);
+			_offset = aim * (1.0 - _coefficient);
+		} else {
+			_coefficient = 1.0;
+			_offset = (target - _level) / length;
+		}
+	}
+
+private:
+
+	Adsr _adsr;
+	int64_t _attack_samples;
+	int64_t _decay_samples;
+	int64_t _release_samples;
+	int64_t _release_start;
+
+	Stage _stage;
+	int64_t _current_sample;
+	int64_t _stage_end;
+	double _target;
+
+	// Each sample, _level = _level * _coefficient + _offset.
+	double _level;
+	double _coefficient;
+	double _offset;
+};
+
+struct ConstantGain {
+	double amp;
+
+	double operator()(double sample) const {
+		return sample * amp;
+	}
+};
+
+/*
+ * A note played on a built-in wave, with its envelope, gain and length composed at compile time.
+ * Does the work of an oscillator under Duration, Filter and Amplify sources, but without a
+ * virtual call or std::function between the layers, so the whole chain can be inlined.
+ *
+ * Sources that are only known at runtime, such as samples, are still composed through SourceBuilder.
+*/
+template<class Osc, class Envelope, class Gain>
+class Voice : public Source {
+public:
+
+	Voice(Osc osc, Envelope envelope, Gain gain, uint64_t duration_ns)
+		: _osc(std::move(osc))
+		, _envelope(std::move(envelope))
+		, _gain(std::move(gain))
+		, _duration_ns(duration_ns)
+		, _remaining_samples(0)
+	{
+		// Same length as a Duration source, a sample is only produced while more than a
+		// sample's worth of duration remains.
+		auto duration_ns_per_sample = NANO_PER_SEC / (_osc.sample_rate() * _osc.channel_count());
+		if (duration_ns > 0) {
+			_remaining_samples = (duration_ns - 1) / duration_ns_per_sample;
+		}
+	}
+
+	int sample_rate() const override {
+		return _osc.sample_rate();
+	}
+
+	int channel_count() const override {
+		return _osc.channel_count();
+	}
+
+	std::optional<double> next_sample() override {
+		if (_remaining_samples == 0 || _envelope.is_finished()) {
+			return std::nullopt;
+		}
+
+		_remaining_samples -= 1;
+
+		if (auto sample = _osc.next_sample()) {
+			return _gain(*sample * _envelope.next());
+		}
+
+		return std::nullopt;
+	}
+
+	int fill(float* out, int frames) override {
+		auto channels = _osc.channel_count();
+		auto available = (int)std::min<uint64_t>(frames, _remaining_samples / channels);
+		auto produced = _osc.fill(out, available);
+
+		auto count = _envelope.apply(out, produced * channels);
+		for (int i = 0; i < count; ++i) {
+			out[i] = (float)_gain(out[i]);
+		}
+
+		// The voice ends as soon as its envelope does, so the mixer can drop it right away.
+		if (count < produced * channels) {
+			_remaining_samples = 0;
+			return count / channels;
+		}
+
+		_remaining_samples -= (uint64_t)produced * channels;
+
+		// The duration may end partway through a frame.
+		if (produced == available && produced < frames && _remaining_samples > 0) {
+			produced += fill_from_samples(out + produced * channels, 1);
+		}
+
+		return produced;
+	}
+
+	int64_t skip(int64_t frames) override {
+		auto channels = _osc.channel_count();
+		auto available = std::min<int64_t>(frames, _remaining_samples / channels);
+		auto skipped = _envelope.skip(available * channels) / channels;
+		_osc.skip(skipped);
+
+		if (skipped < available) {
+			_remaining_samples = 0;
+			return skipped;
+		}
+
+		_remaining_samples -= (uint64_t)skipped * channels;
+
+		// The duration may end partway through a frame.
+		if (skipped < frames && _remaining_samples > 0) {
+			skipped += Source::skip(1);
+		}
+
+		return skipped;
+	}
+
+	std::optional<std::chrono::nanoseconds> total_duration() const override {
+		return std::chrono::nanoseconds(_duration_ns);
+	}
+
+private:
+
+	Osc _osc;
+	Envelope _envelope;
+	Gain _gain;
+	uint64_t _duration_ns;
+	uint64_t _remaining_samples;
+};
+
+using SineVoice = Voice<SineWave, AdsrEnvelope, ConstantGain>;
+using TriangleVoice = Voice<TriangleWave, AdsrEnvelope, ConstantGain>;
+using SquareVoice = Voice<SquareWave, AdsrEnvelope, ConstantGain>;
+using SawVoice = Voice<SawWave, AdsrEnvelope, ConstantGain>;
+using PianoVoice = Voice<PianoWave, AdsrEnvelope, ConstantGain>;
+using ViolinVoice = Voice<ViolinWave, AdsrEnvelope, ConstantGain>;
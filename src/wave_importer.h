@@ -4,51 +4,145 @@
 #include <optional>
 #include <string_view>
 #include <chrono>
+#include <algorithm>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
 
 #include "source.h"
 
-struct WaveHeader {
-	char tag[4];
-	int file_size;
-	char type[4];
-	char format_marker[4];
-	int format_marker_len;
-	int16_t format_type;
-	int16_t channel_count;
-	int sample_rate;
-	int avg_bytes_per_sec;
-	int16_t block_align;
-	int16_t bits_per_sample;
-	char data_marker[4];
-	int data_size;
-};
+// Encoding to PCM converts 4 or 8 samples at a time when SSE2 is there, which every x86-64 target has.
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WAVE_SSE2
+#endif
+
+namespace wave {
+	constexpr int16_t FORMAT_PCM = 0x1;
+	constexpr int16_t FORMAT_FLOAT = 0x3;
+	constexpr uint16_t FORMAT_EXTENSIBLE = 0xfffe;
+
+	struct ChunkHeader {
+		char id[4];
+		uint32_t size;
+	};
+
+	static_assert(sizeof(ChunkHeader) == 8);
+
+	// The part of the "fmt " chunk shared by every format.
+	struct FormatChunk {
+		int16_t format_type;
+		int16_t channel_count;
+		int sample_rate;
+		int avg_bytes_per_sec;
+		int16_t block_align;
+		int16_t bits_per_sample;
+	};
+
+	static_assert(sizeof(FormatChunk) == 16);
+
+	// KSDATAFORMAT_SUBTYPE_PCM and _IEEE_FLOAT share this guid, with the format type in the first two bytes.
+	constexpr uint8_t SUB_FORMAT_GUID_TAIL[14] = {
+		0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+	};
 
-static_assert(sizeof(WaveHeader) == 44);
-static_assert(alignof(WaveHeader) == 4);
+	/*
+	 * @brief Converts little endian PCM samples to floats in [-1, 1).
+	 * The switch is kept outside of the loops so each one is a plain loop the compiler can vectorize.
+	*/
+	inline void decode_pcm(uint8_t const* in, float* out, int sample_count, int bits_per_sample) {
+		switch (bits_per_sample) {
+			case 8:
+				// 8-bit wave files are unsigned, centered on 128.
+				for (int i = 0; i < sample_count; ++i) {
+					out[i] = (float)((int)in[i] - 128) * (1.0f / 128.0f);
+				}
+			break;
+			case 16:
+				for (int i = 0; i < sample_count; ++i) {
+					auto value = (int16_t)(in[2 * i] | (in[2 * i + 1] << 8));
+					out[i] = (float)value * (1.0f / 32768.0f);
+				}
+			break;
+			case 24:
+				for (int i = 0; i < sample_count; ++i) {
+					// Placed in the top 24 bits so the shift back down sign extends.
+					auto value = (int32_t)((uint32_t)in[3 * i] << 8 | (uint32_t)in[3 * i + 1] << 16 | (uint32_t)in[3 * i + 2] << 24) >> 8;
+					out[i] = (float)value * (1.0f / 8388608.0f);
+				}
+			break;
+			case 32:
+				for (int i = 0; i < sample_count; ++i) {
+					int32_t value;
+					memcpy(&value, in + 4 * i, sizeof(int32_t));
+					out[i] = (float)((double)value * (1.0 / 2147483648.0));
+				}
+			break;
+		}
+	}
+
+	inline void decode_float(uint8_t const* in, float* out, int sample_count) {
+		memcpy(out, in, sample_count * sizeof(float));
+	}
+}
 
 class WaveFile : public Source {
 public:
 
+	/*
+	 * @brief Opens a wave file and finds its samples. Chunks other than "fmt " and "data" are skipped.
+	 * Supports 8, 16, 24 and 32-bit PCM as well as 32-bit float samples.
+	*/
 	static std::optional<WaveFile> read(std::string_view filename) {
 		std::ifstream file(filename.data(), std::ios::binary);
 		if (!file.is_open()) {
 			return std::nullopt;
 		}
 
-		WaveHeader header;
-		file.read((char*)&header, sizeof(WaveHeader));
-		
-		// Must always be "RIFF"
-		if (strncmp(header.tag, "RIFF", 4) != 0) {
+		char riff[12];
+		if (!file.read(riff, sizeof(riff))) {
 			return std::nullopt;
 		}
 
-		// We expect wave to be stored as PCM (0x1)
-		if (header.format_type != 1) {
+		// Must always be "RIFF" followed by the size and "WAVE"
+		if (strncmp(riff, "RIFF", 4) != 0 || strncmp(riff + 8, "WAVE", 4) != 0) {
 			return std::nullopt;
 		}
 
-		return WaveFile(header, std::move(file));
+		std::optional<wave::FormatChunk> format;
+		wave::ChunkHeader chunk;
+
+		while (file.read((char*)&chunk, sizeof(chunk))) {
+			// Chunks are padded to an even size.
+			std::streamoff chunk_end = file.tellg() + (std::streamoff)(chunk.size + (chunk.size & 1));
+
+			if (strncmp(chunk.id, "fmt ", 4) == 0) {
+				if (chunk.size < sizeof(wave::FormatChunk)) {
+					return std::nullopt;
+				}
+
+				format.emplace();
+				file.read((char*)&*format, sizeof(wave::FormatChunk));
+
+				// Extensible formats store the actual format at the start of the sub format guid.
+				if ((uint16_t)format->format_type == wave::FORMAT_EXTENSIBLE && chunk.size >= 40) {
+					file.seekg(8, std::ios::cur);
+					file.read((char*)&format->format_type, sizeof(int16_t));
+				}
+			} else if (strncmp(chunk.id, "data", 4) == 0) {
+				if (!format || !_is_supported(*format)) {
+					return std::nullopt;
+				}
+
+				return WaveFile(*format, chunk.size, std::move(file));
+			}
+
+			file.seekg(chunk_end);
+		}
+
+		return std::nullopt;
 	}
 
 	int channel_count() const override {
@@ -64,93 +158,565 @@ public:
 	}
 
 	std::optional<double> next_sample() override {
-		if (!_file.is_open()) {
-			return std::nullopt;
+		if (_decoded_idx >= _decoded.size()) {
+			_decoded.resize(BLOCK_SIZE / _bytes_per_sample);
+			_decoded.resize(_read_samples(_decoded.data(), (int)_decoded.size()));
+			_decoded_idx = 0;
+
+			if (_decoded.empty()) {
+				return std::nullopt;
+			}
 		}
 
-		// No way any wave file could have samples larger than 4 bytes right?
-		int8_t buffer[4] = {0};
-		if (!_file.read((char*)buffer, _bytes_per_sample)) {
-			_file.close();
-			return std::nullopt;
+		auto sample = _decoded[_decoded_idx];
+		_decoded_idx += 1;
+		return sample;
+	}
+
+	int fill(float* out, int frames) override {
+		auto requested = frames * _channel_count;
+		int written = 0;
+
+		// Samples already decoded for next_sample come first.
+		if (_decoded_idx < _decoded.size()) {
+			written = (int)std::min(_decoded.size() - _decoded_idx, (size_t)requested);
+			std::copy_n(_decoded.data() + _decoded_idx, written, out);
+			_decoded_idx += written;
 		}
 
-		if (_file.gcount() != _bytes_per_sample) {
-			_file.close();
-			return std::nullopt;
+		written += _read_samples(out + written, requested - written);
+
+		// Zero pad the last frame if the file ends partway through it.
+		auto partial = written % _channel_count;
+		if (partial > 0) {
+			std::fill_n(out + written, _channel_count - partial, 0.0f);
+			written += _channel_count - partial;
 		}
 
-		auto sample = (double)_map_buffer_to_int(buffer) / _max_sample_value;
-		return sample;
+		return written / _channel_count;
+	}
+
+	int64_t skip(int64_t frames) override {
+		auto requested = (uint64_t)frames * _channel_count;
+		uint64_t skipped = 0;
+
+		if (_decoded_idx < _decoded.size()) {
+			skipped = std::min<uint64_t>(_decoded.size() - _decoded_idx, requested);
+			_decoded_idx += (size_t)skipped;
+		}
+
+		// Seeks past the samples rather than reading them.
+		auto samples = std::min<uint64_t>(requested - skipped, _data_remaining / _bytes_per_sample);
+		_file.seekg((std::streamoff)(samples * _bytes_per_sample), std::ios::cur);
+		_data_remaining -= (uint32_t)(samples * _bytes_per_sample);
+		skipped += samples;
+
+		// A partial last frame counts as a frame, like in fill.
+		return (int64_t)((skipped + _channel_count - 1) / _channel_count);
 	}
 
 private:
 
+	// Size in bytes of each read from the file.
+	static constexpr int BLOCK_SIZE = 64 * 1024;
+
 	WaveFile(
-		WaveHeader header,
+		wave::FormatChunk format,
+		uint32_t data_size,
 		std::ifstream file
 	)
 		: _file(std::move(file))
-		, _sample_count(header.data_size / (header.bits_per_sample / 8))
-		, _sample_rate(header.sample_rate)
-		, _channel_count((int)header.channel_count)
-		, _max_sample_value((int)exp2(header.bits_per_sample - 1))
-		, _duration((int64_t)((double)_sample_count / (_channel_count * _sample_rate) * 1e9))
-		, _bytes_per_sample(header.bits_per_sample / 8)
+		, _data_remaining(data_size)
+		, _sample_rate(format.sample_rate)
+		, _channel_count((int)format.channel_count)
+		, _bits_per_sample(format.bits_per_sample)
+		, _bytes_per_sample(format.bits_per_sample / 8)
+		, _is_float(format.format_type == wave::FORMAT_FLOAT)
+		, _duration((int64_t)((double)(data_size / (_bytes_per_sample * _channel_count)) / _sample_rate * 1e9))
+		, _decoded_idx(0)
+		, _raw(BLOCK_SIZE)
 	{
 	}
 
-	int _map_buffer_to_int(int8_t* buffer) {
-		switch (_bytes_per_sample) {
+	static bool _is_supported(wave::FormatChunk const& format) {
+		if (format.channel_count <= 0 || format.sample_rate <= 0) {
+			return false;
+		}
+
+		switch (format.format_type) {
+			case wave::FORMAT_PCM:
+				return format.bits_per_sample == 8
+					|| format.bits_per_sample == 16
+					|| format.bits_per_sample == 24
+					|| format.bits_per_sample == 32;
+			case wave::FORMAT_FLOAT:
+				return format.bits_per_sample == 32;
 			default:
-			case 1: return (int)*buffer;
-			case 2: return (int)*reinterpret_cast<int16_t*>(buffer);
-			case 4: return (int)*reinterpret_cast<int32_t*>(buffer);
+				return false;
+		}
+	}
+
+	/*
+	 * @brief Reads and decodes up to count samples, never reading past the data chunk.
+	 * @return The number of samples written.
+	*/
+	int _read_samples(float* out, int count) {
+		int written = 0;
+
+		while (written < count && _data_remaining >= (uint32_t)_bytes_per_sample) {
+			auto samples = std::min({
+				count - written,
+				BLOCK_SIZE / _bytes_per_sample,
+				(int)(_data_remaining / _bytes_per_sample)
+			});
+
+			_file.read((char*)_raw.data(), samples * _bytes_per_sample);
+			auto read = (int)_file.gcount() / _bytes_per_sample;
+
+			if (_is_float) {
+				wave::decode_float(_raw.data(), out + written, read);
+			} else {
+				wave::decode_pcm(_raw.data(), out + written, read, _bits_per_sample);
+			}
+
+			written += read;
+			_data_remaining -= read * _bytes_per_sample;
+
+			if (read < samples) {
+				// The file is shorter than its data chunk claims.
+				_data_remaining = 0;
+			}
 		}
+
+		return written;
 	}
 
-	int _sample_count;
+	std::ifstream _file;
+	uint32_t _data_remaining;	// In bytes
 	int _sample_rate;
 	int _channel_count;
-	int _max_sample_value;
+	int _bits_per_sample;
 	int _bytes_per_sample;
+	bool _is_float;
 	std::chrono::nanoseconds _duration;
-	std::ifstream _file;
+
+	// Samples decoded ahead for next_sample.
+	std::vector<float> _decoded;
+	size_t _decoded_idx;
+
+	// Raw bytes of the last read.
+	std::vector<uint8_t> _raw;
 };
 
 namespace wave {
-	void export_samples_as_wave(
-		std::string_view filename,
-		int sample_rate,
-		int channel_count,
-		float* samples,
-		int sample_count
-	) {
-		std::ofstream file(filename.data(), std::ios::binary | std::ios::trunc);
-		if (!file.is_open()) {
-			return;
-		}
-
-		WaveHeader header;
-		memcpy(header.tag, "RIFF", 4);
-		header.file_size = sizeof(WaveHeader) + sample_count * sizeof(int16_t) - 8;
-		memcpy(header.type, "WAVE", 4);
-		memcpy(header.format_marker, "fmt ", 4);
-		header.format_marker_len = 16;
-		header.format_type = 1;	// PCM
-		header.channel_count = channel_count;
-		header.sample_rate = sample_rate;
-		header.avg_bytes_per_sec = (sample_rate * 2 * channel_count);
-		header.block_align = 2 * channel_count;
-		header.bits_per_sample = 16;
-		memcpy(header.data_marker, "data", 4);
-		header.data_size = sample_count * sizeof(int16_t);
-
-		file.write((char*)&header, sizeof(WaveHeader));
-
-		std::for_each_n(samples, sample_count, [&](float sample) {
-			int16_t pcm = (int16_t)(sample * 0x8fff);
-			file.write((char*)&pcm, sizeof(int16_t));
-		});
+	namespace detail {
+		/*
+		 * @brief Converts floats to 16-bit samples, rounded to the nearest step and clamped to full scale.
+		 * @param dither Noise in steps added before rounding, only read when Dithered.
+		*/
+		template <bool Dithered>
+		inline void encode_pcm16(float const* in, uint8_t* out, int sample_count, float const* dither) {
+			int i = 0;
+
+#ifdef WAVE_SSE2
+			auto scale = _mm_set1_ps(32767.0f);
+			auto min = _mm_set1_ps(-32768.0f);
+			auto max = _mm_set1_ps(32767.0f);
+			for (; i + 8 <= sample_count; i += 8) {
+				auto low = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+				auto high = _mm_mul_ps(_mm_loadu_ps(in + i + 4), scale);
+				if (Dithered) {
+					low = _mm_add_ps(low, _mm_loadu_ps(dither + i));
+					high = _mm_add_ps(high, _mm_loadu_ps(dither + i + 4));
+				}
+
+				// Clamped before converting, as anything out of range converts to the lowest value.
+				low = _mm_min_ps(_mm_max_ps(low, min), max);
+				high = _mm_min_ps(_mm_max_ps(high, min), max);
+
+				auto packed = _mm_packs_epi32(_mm_cvtps_epi32(low), _mm_cvtps_epi32(high));
+				_mm_storeu_si128((__m128i*)(out + 2 * i), packed);
+			}
+#endif
+
+			for (; i < sample_count; ++i) {
+				auto noise = Dithered ? dither[i] : 0.0f;
+				auto value = (int16_t)lrintf(std::clamp(in[i] * 32767.0f + noise, -32768.0f, 32767.0f));
+				memcpy(out + 2 * i, &value, sizeof(int16_t));
+			}
+		}
+
+		/*
+		 * @brief Scales floats to steps of scale, rounded to the nearest one and clamped to full scale.
+		 * Done in double, as a float can't hold 24 or 32-bit steps near full scale.
+		 * @param dither Noise in steps added before rounding, only read when Dithered.
+		*/
+		template <bool Dithered>
+		inline void quantize_wide(float const* in, int32_t* out, int sample_count, double scale, float const* dither) {
+			int i = 0;
+
+#ifdef WAVE_SSE2
+			auto scales = _mm_set1_pd(scale);
+			auto min = _mm_set1_pd(-scale - 1.0);
+			auto max = _mm_set1_pd(scale);
+			for (; i + 4 <= sample_count; i += 4) {
+				auto samples = _mm_loadu_ps(in + i);
+				auto low = _mm_mul_pd(_mm_cvtps_pd(samples), scales);
+				auto high = _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(samples, samples)), scales);
+				if (Dithered) {
+					auto noise = _mm_loadu_ps(dither + i);
+					low = _mm_add_pd(low, _mm_cvtps_pd(noise));
+					high = _mm_add_pd(high, _mm_cvtps_pd(_mm_movehl_ps(noise, noise)));
+				}
+
+				low = _mm_min_pd(_mm_max_pd(low, min), max);
+				high = _mm_min_pd(_mm_max_pd(high, min), max);
+
+				auto values = _mm_unpacklo_epi64(_mm_cvtpd_epi32(low), _mm_cvtpd_epi32(high));
+				_mm_storeu_si128((__m128i*)(out + i), values);
+			}
+#endif
+
+			for (; i < sample_count; ++i) {
+				auto noise = Dithered ? (double)dither[i] : 0.0;
+				out[i] = (int32_t)llrint(std::clamp((double)in[i] * scale + noise, -scale - 1.0, scale));
+			}
+		}
+
+		template <bool Dithered>
+		inline void encode_pcm(float const* in, uint8_t* out, int sample_count, int bits_per_sample, float const* dither) {
+			if (bits_per_sample == 16) {
+				encode_pcm16<Dithered>(in, out, sample_count, dither);
+				return;
+			}
+
+			// Wider samples are rounded a block at a time, then stored at their size.
+			constexpr int BLOCK_SIZE = 256;
+			int32_t values[BLOCK_SIZE];
+			for (int offset = 0; offset < sample_count; offset += BLOCK_SIZE) {
+				auto count = std::min(BLOCK_SIZE, sample_count - offset);
+				auto bytes = out + offset * (bits_per_sample / 8);
+
+				switch (bits_per_sample) {
+					case 24:
+						quantize_wide<Dithered>(in + offset, values, count, 8388607.0, Dithered ? dither + offset : nullptr);
+						for (int i = 0; i < count; ++i) {
+							bytes[3 * i] = (uint8_t)values[i];
+							bytes[3 * i + 1] = (uint8_t)(values[i] >> 8);
+							bytes[3 * i + 2] = (uint8_t)(values[i] >> 16);
+						}
+					break;
+					case 32:
+						quantize_wide<Dithered>(in + offset, values, count, 2147483647.0, Dithered ? dither + offset : nullptr);
+						memcpy(bytes, values, count * sizeof(int32_t));
+					break;
+				}
+			}
+		}
+	}
+
+	/*
+	 * @brief Converts floats to little endian PCM samples of bits_per_sample bits (16, 24 or 32),
+	 * rounded to the nearest step and clamped to full scale.
+	 * @param dither Noise in steps added to each sample before rounding, or null for none.
+	*/
+	inline void encode_pcm(float const* in, uint8_t* out, int sample_count, int bits_per_sample, float const* dither = nullptr) {
+		// Dithering is picked once so neither loop branches per sample.
+		if (dither) {
+			detail::encode_pcm<true>(in, out, sample_count, bits_per_sample, dither);
+		} else {
+			detail::encode_pcm<false>(in, out, sample_count, bits_per_sample, dither);
+		}
+	}
+
+	/*
+	 * Triangular (TPDF) dither of up to one step either way, which decorrelates rounding errors
+	 * from the signal so quiet passages fade into noise rather than distorting. Each value is
+	 * hashed from its position in the stream, so the same export always gets the same noise.
+	*/
+	class TpdfDither {
+	public:
+
+		void generate(float* out, int count) {
+			for (int i = 0; i < count; ++i) {
+				auto hash = (_position + (uint32_t)i) * 0x9e3779b9u;
+				hash ^= hash >> 16;
+				hash *= 0x7feb352du;
+				hash ^= hash >> 15;
+				hash *= 0x846ca68bu;
+				hash ^= hash >> 16;
+
+				// Two uniform values from each half of the hash, summed into a triangle over [-1, 1).
+				out[i] = (float)((int32_t)(hash & 0xffff) + (int32_t)(hash >> 16)) * (1.0f / 65536.0f) - 1.0f;
+			}
+
+			_position += (uint32_t)count;
+		}
+
+	private:
+
+		uint32_t _position = 0;
+	};
+
+	inline void encode_float(float const* in, uint8_t* out, int sample_count) {
+		memcpy(out, in, sample_count * sizeof(float));
 	}
-}
\ No newline at end of file
+
+	/*
+	 * Writes a wave file as samples are produced, so the song never has to be held in memory.
+	 * The header is written upfront with empty sizes, which are filled in once the writer is closed.
+	*/
+	class WaveWriter {
+	public:
+
+		/*
+		 * @param bits_per_sample 16, 24 or 32 for PCM, 32 for float.
+		 * @param format_type FORMAT_PCM or FORMAT_FLOAT. Float samples are written as is, unclamped.
+		 * @param dither Adds TPDF dither to PCM samples before they are rounded. Silence written
+		 * with write_silence stays digital silence.
+		 * @return None if the file could not be created.
+		*/
+		static std::optional<WaveWriter> create(
+			std::string_view filename,
+			int sample_rate,
+			int channel_count,
+			int bits_per_sample = 16,
+			int16_t format_type = FORMAT_PCM,
+			bool dither = false
+		) {
+			std::ofstream file(filename.data(), std::ios::binary | std::ios::trunc);
+			if (!file.is_open()) {
+				return std::nullopt;
+			}
+
+			auto bytes_per_sample = bits_per_sample / 8;
+
+			// PCM wider than 16 bits and more than two channels need the extensible format, which
+			// carries the number of valid bits and the speaker layout.
+			auto is_extensible = (format_type == FORMAT_PCM && bits_per_sample > 16) || channel_count > 2;
+
+			std::vector<uint8_t> header;
+			auto append = [&header](auto value) {
+				auto bytes = (uint8_t const*)&value;
+				header.insert(header.end(), bytes, bytes + sizeof(value));
+			};
+
+			header.insert(header.end(), { 'R', 'I', 'F', 'F' });
+			append((uint32_t)0);
+			header.insert(header.end(), { 'W', 'A', 'V', 'E' });
+
+			// Plain PCM has no extension, every other format at least has its size.
+			uint32_t extension_size = is_extensible ? 22 : 0;
+			uint32_t format_size = sizeof(FormatChunk);
+			if (is_extensible || format_type != FORMAT_PCM) {
+				format_size += 2 + extension_size;
+			}
+
+			FormatChunk format;
+			format.format_type = is_extensible ? (int16_t)FORMAT_EXTENSIBLE : format_type;
+			format.channel_count = channel_count;
+			format.sample_rate = sample_rate;
+			format.avg_bytes_per_sec = sample_rate * bytes_per_sample * channel_count;
+			format.block_align = bytes_per_sample * channel_count;
+			format.bits_per_sample = bits_per_sample;
+
+			header.insert(header.end(), { 'f', 'm', 't', ' ' });
+			append(format_size);
+			append(format);
+			if (format_size > sizeof(FormatChunk)) {
+				append((uint16_t)extension_size);
+			}
+			if (is_extensible) {
+				// Every bit is used, and the channels are the first speakers in order, with mono in front.
+				append((uint16_t)bits_per_sample);
+				append(channel_count == 1 ? (uint32_t)0x4 : (uint32_t)((1ull << std::min(channel_count, 18)) - 1));
+				append((uint16_t)format_type);
+				header.insert(header.end(), std::begin(SUB_FORMAT_GUID_TAIL), std::end(SUB_FORMAT_GUID_TAIL));
+			}
+
+			// Formats other than PCM need the number of frames, filled in when closed.
+			size_t fact_offset = 0;
+			if (format_type != FORMAT_PCM) {
+				header.insert(header.end(), { 'f', 'a', 'c', 't' });
+				append((uint32_t)4);
+				fact_offset = header.size();
+				append((uint32_t)0);
+			}
+
+			header.insert(header.end(), { 'd', 'a', 't', 'a' });
+			append((uint32_t)0);
+
+			if (!file.write((char*)header.data(), header.size())) {
+				return std::nullopt;
+			}
+
+			return WaveWriter(
+				std::move(file),
+				channel_count,
+				bits_per_sample,
+				format_type,
+				dither && format_type == FORMAT_PCM,
+				header.size(),
+				fact_offset
+			);
+		}
+
+		WaveWriter(WaveWriter&&) = default;
+
+		~WaveWriter() {
+			close();
+		}
+
+		void write(float const* samples, int sample_count) {
+			while (sample_count > 0) {
+				auto count = std::min(sample_count, (int)(_buffer.size() - _buffer_len) / _bytes_per_sample);
+				if (_format_type == FORMAT_FLOAT) {
+					encode_float(samples, _buffer.data() + _buffer_len, count);
+				} else if (_dither) {
+					_dither->generate(_noise.data(), count);
+					encode_pcm(samples, _buffer.data() + _buffer_len, count, _bits_per_sample, _noise.data());
+				} else {
+					encode_pcm(samples, _buffer.data() + _buffer_len, count, _bits_per_sample);
+				}
+				_buffer_len += count * _bytes_per_sample;
+				samples += count;
+				sample_count -= count;
+
+				if (_buffer_len + _bytes_per_sample > _buffer.size()) {
+					_flush();
+				}
+			}
+		}
+
+		/*
+		 * @brief Writes silent samples without encoding any, as silence is all zero bytes in
+		 * every format.
+		*/
+		void write_silence(int sample_count) {
+			while (sample_count > 0) {
+				auto count = std::min(sample_count, (int)(_buffer.size() - _buffer_len) / _bytes_per_sample);
+				std::fill_n(_buffer.data() + _buffer_len, count * _bytes_per_sample, (uint8_t)0);
+				_buffer_len += count * _bytes_per_sample;
+				sample_count -= count;
+
+				if (_buffer_len + _bytes_per_sample > _buffer.size()) {
+					_flush();
+				}
+			}
+		}
+
+		/*
+		 * @brief Writes what is left and fills in the sizes of the header.
+		 * @return False if any write failed, or the samples did not fit in a wave file, in which
+		 * case the file is incomplete.
+		*/
+		bool close() {
+			if (!_file.is_open()) {
+				return !_has_failed;
+			}
+
+			_flush();
+
+			// Chunks are padded to an even size, the pad byte is not part of the data size.
+			auto pad_size = (uint32_t)(_data_size & 1);
+			if (pad_size > 0) {
+				_file.put(0);
+			}
+
+			auto data_size = (uint32_t)_data_size;
+			auto file_size = (uint32_t)(_data_size + pad_size + _header_size - 8);
+
+			_file.seekp(4);
+			_file.write((char*)&file_size, sizeof(uint32_t));
+			if (_fact_offset > 0) {
+				auto frame_count = (uint32_t)(_data_size / (_bytes_per_sample * _channel_count));
+				_file.seekp(_fact_offset);
+				_file.write((char*)&frame_count, sizeof(uint32_t));
+			}
+			_file.seekp(_header_size - 4);
+			_file.write((char*)&data_size, sizeof(uint32_t));
+			_file.close();
+
+			if (_file.fail()) {
+				_has_failed = true;
+			}
+
+			return !_has_failed;
+		}
+
+		/*
+		 * @brief Whether a write failed or the samples outgrew a wave file. Everything written after
+		 * is dropped.
+		*/
+		bool has_failed() const {
+			return _has_failed;
+		}
+
+	private:
+
+		// Size in bytes of each write to the file.
+		static constexpr size_t BUFFER_SIZE = 256 * 1024;
+
+		WaveWriter(
+			std::ofstream file,
+			int channel_count,
+			int bits_per_sample,
+			int16_t format_type,
+			bool dither,
+			size_t header_size,
+			size_t fact_offset
+		)
+			: _file(std::move(file))
+			, _header_size(header_size)
+			, _fact_offset(fact_offset)
+			, _channel_count(channel_count)
+			, _format_type(format_type)
+			, _bits_per_sample(bits_per_sample)
+			, _bytes_per_sample(bits_per_sample / 8)
+			, _data_size(0)
+			, _buffer(BUFFER_SIZE)
+			, _buffer_len(0)
+			, _has_failed(false)
+		{
+			if (dither) {
+				_dither.emplace();
+				_noise.resize(BUFFER_SIZE / _bytes_per_sample);
+			}
+		}
+
+		void _flush() {
+			// Sizes in the header are 32-bit, and the RIFF size also counts the rest of the header
+			// and the pad byte.
+			if (!_has_failed && _data_size + _buffer_len > UINT32_MAX - (_header_size - 8) - 1) {
+				_has_failed = true;
+			}
+
+			if (!_has_failed && !_file.write((char*)_buffer.data(), _buffer_len)) {
+				_has_failed = true;
+			}
+
+			if (!_has_failed) {
+				_data_size += _buffer_len;
+			}
+			_buffer_len = 0;
+		}
+
+	private:
+
+		std::ofstream _file;
+		size_t _header_size;	// Ends with the data size
+		size_t _fact_offset;	// Of the frame count, or 0 without a fact chunk
+		int _channel_count;
+		int16_t _format_type;
+		int _bits_per_sample;
+		int _bytes_per_sample;
+		uint64_t _data_size;	// In bytes
+		std::vector<uint8_t> _buffer;
+		size_t _buffer_len;
+		bool _has_failed;
+
+		// Noise for the samples being encoded, as many as fit in the buffer.
+		std::optional<TpdfDither> _dither;
+		std::vector<float> _noise;
+	};
+}